@@ -1,51 +1,806 @@
 /*** includes ***/
 
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TXT_X86 1
+#endif
+
 /*** defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 #define TXT_VERSION "0.0.1"
 
+// bytes of the original buffer summarized by one line index entry
+#define LINEIDX_CHUNK (1 << 16)
+
+// largest file kept as rows; anything bigger stays in the piece table over
+// the mapped file
+#define ROWS_MAX_FILE (16 << 20)
+
+// bytes of raw input that can wait to be decoded, and decoded keys that can
+// wait to be processed
+#define INBUF_SIZE 4096
+#define KEYQ_SIZE 256
+
+// how long to wait for the rest of an escape sequence before taking the
+// escape as a key of its own
+#define ESC_TIMEOUT_MS 25
+
+// how long frames wait for a terminal asked for its size to answer, and
+// the size assumed if it never does
+#define SIZE_REPORT_MS 200
+#define DEFAULT_ROWS 24
+#define DEFAULT_COLS 80
+
+// timers the event loop can sleep on
+enum editorTimerId {
+  TIMER_ESCAPE = 0,
+  TIMER_FRAME,
+  TIMER_JOURNAL,
+  TIMER_FOLLOW,
+  TIMER_SIZE,
+  TIMER_MAX
+};
+
+// columns between tab stops
+#define TAB_STOP 8
+
+// a line's column is remembered every COL_STEP bytes or so, for the last
+// COL_CACHE_LINES lines looked at
+#define COL_STEP 256
+#define COL_CACHE_LINES 256
+
+// edits the column cache remembers to bring its lines up to date with
+#define COL_EDITS 64
+
+// the longest a stream of input may hold back the next frame
+#define FRAME_MAX_DELAY_MS 100
+
+// bytes of the document an incremental find scans between looks at input
+#define FIND_CHUNK (1 << 22)
+
+// longest find query in bytes
+#define FIND_MAX 256
+
+// longest position typed at the go-to prompt
+#define GOTO_MAX 32
+
+// matches a find keeps offsets of for jumping between; more are only counted
+#define FIND_MAX_MATCHES (1 << 22)
+
+// most worker threads a find of a large document is split between
+#define FIND_THREADS_MAX 8
+
+// a save gathers this much of the document before each write, and has the
+// kernel copy spans of the original file at least SAVE_COPY_MIN long
+#define SAVE_BUF (1 << 20)
+#define SAVE_COPY_MIN (1 << 16)
+
+// the save thread wakes the event loop to show progress this often
+#define SAVE_WAKE (64 << 20)
+
+// what a save flushes to disk before it is reported done
+enum saveSync { SYNC_NONE = 0, SYNC_FILE, SYNC_FULL };
+
+// undo history kept in memory before older history moves to a file
+#define UNDO_MEM_DEFAULT (64 << 20)
+
+// undo record flags
+#define UNDO_DELETE (1 << 0)   // the edit removed its bytes
+#define UNDO_BACKWARD (1 << 1) // removed by backspacing, bytes stored reversed
+#define UNDO_JOINED (1 << 2)   // undone and redone with the record before
+
+// log position standing for no record
+#define UNDO_NONE ((size_t)-1)
+
+// edits are journaled in batches, written and flushed this often
+#define JOURNAL_SYNC_MS 1000
+
+// first bytes of a journal file
+#define JOURNAL_MAGIC "TXTJRNL1"
+
+// bytes appended to a followed file that are read per pass of the event loop
+#define FOLLOW_CHUNK (4 << 20)
+
+// how often a followed file is looked at without inotify
+#define FOLLOW_POLL_MS 250
+
+// latency histograms keep the first 2^HIST_SUB_BITS nanoseconds exact and
+// split every power of two above that into 2^(HIST_SUB_BITS-1) buckets, so
+// a value is never off by more than about 6%
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+// stages of the path from a key to the frame showing it
+enum latencyStage { LAT_PROCESS = 0, LAT_BUILD, LAT_WRITE, LAT_TOTAL, LAT_MAX };
+
+// keys are unicode code points, special keys are numbered past the last one
 enum editorKey {
-  MOVE_LEFT = 1000,
-  MOVE_RIGHT = 1001,
-  MOVE_UP = 1002,
-  MOVE_DOWN = 1003,
-  PAGE_UP = 1004,
-  PAGE_DOWN = 1005
+  BACKSPACE = 127,
+  MOVE_LEFT = 0x110000,
+  MOVE_RIGHT,
+  MOVE_UP,
+  MOVE_DOWN,
+  PAGE_UP,
+  PAGE_DOWN,
+  HOME_KEY,
+  END_KEY,
+  DEL_KEY,
+  PASTE_START,
+  PASTE_KEY
 };
 
+#ifdef TXT_BENCH
+// the benchmark build counts every heap allocation the editor makes
+unsigned long benchAllocs;
+
+void *benchMalloc(size_t size) {
+  // find workers allocate too
+  __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+void *benchRealloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+  return realloc(ptr, size);
+}
+
+#define malloc(size) benchMalloc(size)
+#define realloc(ptr, size) benchRealloc(ptr, size)
+#endif
+
 /*** data ***/
 
-// struct to store the editor state
-struct editorConfig {
-  int cx;
-  int cy;
-  int screenrows;
-  int screencols;
-  struct termios orig_termios;
+// chunked newline index over a read-only buffer, filled in lazily front to
+// back either on demand or by a background thread
+struct lineIndex {
+  const char *buf;
+  size_t len;
+  size_t *cum;     // cum[i] is the number of newlines before chunk i
+  size_t nchunks;  // chunks scanned so far, cum is valid up to cum[nchunks]
+  size_t total;    // chunks needed to cover the whole buffer
+  pthread_mutex_t lock;
+  pthread_t worker;
+  int running;     // the worker thread has been started and not yet joined
+  int stop;        // asks the worker to exit early
+};
+
+// which backing buffer a piece refers to
+enum pieceBuffer { PIECE_ORIG = 0, PIECE_ADD = 1 };
+
+// a span of one of the piece table's backing buffers
+struct piece {
+  int buf;
+  size_t start;
+  size_t len;
+};
+
+// node of the piece tree, an implicit treap ordered by document position
+struct pieceNode {
+  struct piece p;
+  size_t lf;       // newlines in the piece, if lfknown
+  int lfknown;     // the original buffer is not yet indexed this far
+  size_t size;     // total bytes in this subtree
+  size_t lfsum;    // total known newlines in this subtree
+  size_t unknown;  // pieces in this subtree with an unknown newline count
+  unsigned int prio;
+  struct pieceNode *left;
+  struct pieceNode *right;
+};
+
+// piece table document model: a read-only original buffer, an append-only add
+// buffer and a balanced tree of pieces that describes the document in order
+struct pieceTable {
+  const char *orig;
+  size_t origlen;
+  char *add;
+  size_t addlen;
+  size_t addcap;
+  struct lineIndex *idx;  // newline index of the original buffer
+  struct pieceNode *root;
+  size_t npieces;
+  unsigned int seed;
 };
 
-// struct for a dynamic string to reduce write() calls
+// struct for a dynamic string to reduce write() calls, its memory is kept
+// between uses and only grows
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 // simple abuf clean slate constant initializer
 #define ABUF_INIT                                                              \
-  { NULL, 0 }
+  { NULL, 0, 0 }
+
+// one character cell of the screen; a wide character's second cell is
+// empty
+struct cell {
+  char ch[6];        // bytes drawn in the cell, a character and any zero
+                     // width ones drawn over it
+  unsigned char len; // number of bytes in ch, 0 in a wide character's second
+                     // cell
+  unsigned char hl;  // highlight class of the character
+};
+
+// a grid of cells the size of the screen
+struct frame {
+  struct cell *cells;
+  int rows;
+  int cols;
+};
+
+enum vtState { VT_GROUND = 0, VT_ESC, VT_CSI };
+
+// an in-memory terminal that interprets the escapes the editor sends, used
+// in place of the real one by headless runs
+struct vterm {
+  struct frame screen;
+  int cx;
+  int cy;
+  int wrap;              // the last column was written, the next character
+                         // goes on the next line
+  int cursor;            // the cursor is shown
+  int top;               // scrolling region, from row top up to bottom
+  int bottom;
+  int hl;                // highlight class of the current foreground color
+  int state;             // which kind of sequence is being collected
+  unsigned char seq[32]; // parameters of a CSI sequence or the bytes of a
+                         // UTF-8 character collected so far
+  int seqlen;
+  int need;              // bytes a UTF-8 character is still missing
+  size_t bytes;          // bytes interpreted so far
+  unsigned long unknown; // sequences that were ignored
+};
+
+// what a headless run has measured so far
+struct headlessStats {
+  unsigned long frames;
+  size_t bytes;
+  long long latsum;      // keys to frame written, in microseconds
+  long long latmin;
+  long long latmax;
+};
+
+// log-linear histogram of durations in nanoseconds
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t n;
+  uint64_t max;
+};
+
+// latency instrumentation, off unless a file to dump it to was given
+struct latency {
+  char *path;            // where the histograms are written, NULL when off
+  struct histogram hist[LAT_MAX];
+  long long current;     // when the key being processed was decoded
+  long long *pending;    // when the keys handled since the last frame were
+                         // decoded
+  int npending;
+  int pendingcap;
+};
+
+// a one-shot timer run by the event loop
+struct editorTimer {
+  long long due; // editorNow() timestamp at which to fire
+  void (*fn)(void);
+};
+
+// highlight classes of the characters on screen
+enum highlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+// lexer state carried from the end of one row to the start of the next
+enum lexState { LEX_NORMAL = 0, LEX_COMMENT };
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+// how to highlight one kind of file
+struct editorSyntax {
+  const char *filetype;
+  const char **filematch; // file name endings that select it
+  const char **keywords;  // keywords, the second class ending in '|'
+  const char *comment;    // starts a comment to the end of the row
+  const char *mlstart;    // start and end of a comment that spans rows
+  const char *mlend;
+  int flags;
+};
+
+// thread that lexes the rows below the screen ahead of time
+struct syntaxWorker {
+  pthread_mutex_t lock;  // held while the row store changes or is lexed
+  pthread_cond_t work;   // rows are waiting to be lexed
+  pthread_cond_t yield;  // the editor is done with the lock it wanted
+  int wanted;            // the editor is waiting for the lock, set atomically
+  pthread_t thread;
+  int running;
+};
+
+// how the document is stored
+enum docKind { DOC_PIECES = 0, DOC_ROWS = 1 };
+
+// lines of a document stored as gap buffers packed into one arena, with the
+// per-row data kept as a struct of arrays so walking the rows stays in cache
+struct rowStore {
+  char *arena;          // storage of every row, each with its own gap
+  size_t arenalen;
+  size_t arenacap;
+  size_t garbage;       // arena bytes left behind by rows that moved
+  size_t *off;          // where each row's storage starts in the arena
+  int *len;             // bytes of text in each row, excluding the newline
+  int *cap;             // bytes of storage for each row, gap included
+  int *gap;             // where each row's gap starts
+  int *rlen;            // screen columns of each row, valid unless dirty
+  unsigned char *dirty; // row changed since rlen was computed
+  size_t *start;        // document offset of each row, valid below startvalid
+  int startvalid;
+  unsigned char *hl;    // lexer state at the start of each row, valid below
+                        // hlvalid
+  int hlvalid;
+  int hledit;           // first and last row edited since they were lexed,
+  int hleditend;        // hleditend < hledit when there are none
+  int numrows;
+  int rowcap;
+  size_t bytes;         // text bytes in all rows
+};
+
+// a slice of the document searched for a find's query in one go
+struct findJob {
+  size_t start;          // matches must start in [start, limit)
+  size_t limit;
+  size_t wend;           // end of the bytes the search may look at
+  char prev;             // byte before start, '\n' at the start of the document
+  unsigned long gen;     // pool generation the job was handed out in
+  size_t *matches;       // document offsets of the matches, in order
+  int nmatches;
+  int matchcap;
+  size_t count;          // matches found, including those not kept
+  size_t first;          // offset of the first match, -1 if there is none
+  size_t lastend;        // end of the last match
+  int done;
+};
+
+// contiguous run of document bytes, from a snapshot taken when a find starts
+struct findSpan {
+  const char *p;
+  size_t off;
+  size_t len;
+};
+
+// worker threads that search the jobs of a find on a large document in
+// parallel. The threads only read the span snapshot, never the piece tree.
+// The find prompt is modal, so the document can't change under them; a new
+// query or closing the prompt cancels the jobs before anything is freed.
+struct findPool {
+  pthread_t threads[FIND_THREADS_MAX];
+  int nthreads;
+  int max;               // threads to use, a pool of one isn't used
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // jobs were handed to the pool
+  pthread_cond_t idle;   // a worker finished a job
+  unsigned long gen;     // bumped to cancel the jobs being searched
+  int busy;              // workers in the middle of a job
+  int started;           // workers started, each numbered in turn
+  regex_t re[FIND_THREADS_MAX]; // each worker's copy of the expression
+                         // searched for, as glibc matches one regex_t on
+                         // one thread at a time
+  int nre;               // copies compiled for the jobs handed out
+  struct findJob *jobs;
+  int njobs;
+  int next;              // next job to hand out
+  struct findSpan *spans;
+  int nspans;
+  int spancap;
+};
+
+// an incremental find over the document. The scan starts at the cursor,
+// runs to the end and wraps around to where it started, so matches are found
+// in order from the cursor on: matches[0..nfirst) lie after the start and
+// matches[nfirst..nmatches) before it. The document is cut into jobs that
+// are searched one per event loop pass, or all at once by the worker pool,
+// and merged into the match list in order as they finish.
+struct findState {
+  int active;            // the find prompt is open
+  char query[FIND_MAX];
+  int querylen;
+  int regex;             // the query is an extended regular expression
+  int compiled;          // re holds the compiled query
+  int bad;               // the query is not a valid expression
+  regex_t re;
+  size_t skip[256];      // Horspool shifts for a literal query
+  int origcx;            // cursor when the prompt was opened
+  int origcy;
+  size_t start;          // document offset the scan started at
+  size_t pos;            // where the next job starts
+  int wrapped;           // the jobs reached the end and went on from 0
+  int scanning;          // part of the document is still to be searched
+  int pooled;            // the jobs are searched by the worker pool
+  struct findJob *jobs;
+  int njobs;
+  int jobcap;
+  int merged;            // jobs merged into the match list
+  int wrapjob;           // first job after the wrap, -1 before it
+  size_t lastend;        // end of the last match merged
+  size_t pending;        // matches in finished jobs not merged yet
+  size_t pendingbytes;   // bytes those jobs cover
+  size_t donebytes;      // bytes covered by the jobs merged
+  size_t *matches;       // document offsets of the matches found
+  int nmatches;
+  int matchcap;
+  int nfirst;            // matches found before the scan wrapped
+  size_t total;          // matches merged, including those not kept
+  int current;           // match the cursor is on, -1 before the first
+  struct abuf scratch;   // copy of text that isn't contiguous in the document
+};
+
+// a save running on its own thread: a snapshot of the document is written to
+// a temporary file next to the target, which is renamed over it when complete
+struct saveState {
+  pthread_mutex_t lock;  // held while the add buffer moves or is copied from
+  pthread_t thread;
+  int running;           // the thread has been started and not yet joined
+  int done;              // the thread is finished, set atomically
+  int sync;              // what to flush to disk, one of saveSync
+  char *path;            // file being saved
+  mode_t mode;           // permissions if the file doesn't exist yet
+  struct piece *spans;   // the pieces of the document when the save started
+  int nspans;
+  int spancap;
+  char *copy;            // the text of a row store document, else NULL
+  size_t total;          // bytes to write
+  size_t written;        // bytes written so far, updated atomically
+  const char *failed;    // the call that failed, NULL if none did
+  int err;               // errno of that failure
+  long long started;     // editorNow() when the save started
+  size_t journaled;      // journal position when the snapshot was taken
+  unsigned long edits;   // edits the snapshot holds
+};
+
+// start of a journal file: which state of the file its edits apply to
+struct journalHeader {
+  char magic[8];
+  uint64_t size;         // size of the file, all zero if there was no file
+  int64_t mtime;         // modification time in nanoseconds
+  uint64_t ino;
+  uint64_t dev;
+};
+
+// an edit in a journal file, followed by the bytes inserted if any
+struct journalRecord {
+  uint64_t off;
+  uint64_t len;
+  uint32_t del;          // the edit removed len bytes
+  uint32_t sum;          // FNV-1a of the record, with sum zero, and its bytes
+};
+
+// journal of the edits made since the file was opened or saved, kept next to
+// the file so a session that dies can be restored by replaying them over the
+// original. Edits are batched in memory; the journal thread writes each
+// batch and flushes it to disk.
+struct journal {
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // a batch or a restart is waiting
+  pthread_cond_t idle;   // the thread finished what it was given
+  pthread_t thread;
+  int running;           // the thread has been started
+  int enabled;           // keep journals at all
+  int active;            // edits to the document are journaled
+  char *path;            // journal of the open file, NULL if none
+  size_t appended;       // bytes of records made since the file was opened
+  struct abuf pending;   // records of the next batch
+  struct abuf writing;   // records of the batch being written
+  int flush;             // the thread should write the pending batch
+  int busy;              // the thread is working
+  int restart;           // the thread should start a journal over
+  size_t restartat;      // position of the first record to keep when it does
+  struct journalHeader next; // header of that new journal
+  // owned by the thread while it runs
+  int fd;                // the journal file, -1 until the first batch
+  struct journalHeader head; // header the journal file starts with
+  size_t base;           // position of the file's first record
+  int broken;            // a write failed, so the journal was dropped
+  // edits found in a journal at open, awaiting the user's say
+  int recover;           // number of edits, 0 if none
+  char *found;           // the journal's contents
+  size_t foundlen;       // bytes of it up to the last whole record
+};
+
+// header of an edit in the undo log, followed by the bytes the edit inserted
+// or removed
+struct undoRecord {
+  size_t off;   // document offset of the edit
+  size_t len;   // bytes inserted or removed
+  size_t prev;  // log position of the record before, UNDO_NONE for none
+  int flags;
+};
+
+// undo history as an append-only log of edit records. Records are addressed
+// by their position in the log; the oldest part of the log moves to an
+// unlinked temporary file once the part in memory outgrows the cap.
+struct undoLog {
+  char *mem;       // the log from position spilled on
+  size_t memlen;
+  size_t memcap;
+  size_t spilled;  // bytes of log no longer in memory
+  int fd;          // the file holding them, -1 until the first spill
+  size_t floor;    // history before this position was lost
+  size_t end;      // end of the log
+  size_t cur;      // end of the records applied, redo starts here
+  size_t last;     // position of the last record applied, UNDO_NONE for none
+  size_t cap;      // bytes of log kept in memory
+  int seal;        // the next edit starts a new record
+  int join;        // the next record is undone with the one before
+  struct abuf text; // bytes of a record being undone or redone
+};
+
+// where a line's text reaches a column, at a character boundary
+struct colMark {
+  size_t off;            // byte offset within the line
+  size_t col;            // column the character at off starts in
+};
+
+// columns of a line, worked out as far as they have been needed
+struct colLine {
+  int line;              // the line, -1 for an unused entry
+  size_t start;          // document offset of the line
+  size_t len;            // length of the line in bytes
+  unsigned long seen;    // edits start and len are up to date with
+  size_t ascii;          // the line starts with this many bytes of printable
+                         // ASCII, where columns are byte offsets
+  size_t done;           // bytes of the line scanned so far
+  size_t col;            // column reached at done
+  struct colMark *marks; // a mark every COL_STEP bytes or so from ascii up
+                         // to done
+  int nmarks;
+  int cap;
+  size_t wrapwidth;      // width the line's screen rows were found at
+  size_t *wraps;         // column each screen row after the first starts in
+  int nwraps;
+  int wrapcap;
+  int wrapdone;          // every screen row of the line has been found
+};
+
+// an edit of the document, as the column cache replays it
+struct colEdit {
+  size_t off;
+  size_t len;
+  int del;               // the bytes were removed
+  int lines;             // line breaks were inserted or removed
+};
+
+// byte offset to screen column mappings of recently drawn lines, indexed by
+// line number. Edits are only logged as they are made; a line is brought up
+// to date with them when it is next looked up, and dropped if one touched it.
+struct colCache {
+  struct colLine lines[COL_CACHE_LINES];
+  struct colEdit edits[COL_EDITS]; // the last edits, by number mod COL_EDITS
+  unsigned long nedits;            // edits made so far
+};
+
+// node of the wrap index, an implicit treap ordered by line number
+struct wrapNode {
+  int rows;              // screen rows of the line
+  int lines;             // lines in this subtree
+  int sum;               // screen rows of the lines in this subtree
+  unsigned int prio;
+  int left;              // children, as indexes into the nodes, 0 for none
+  int right;
+};
+
+// screen rows the lines of a row store document take when they are wrapped
+// at the screen width, summed in a balanced tree of lines so the screen row
+// a line starts on and the line on a screen row are both found in O(log n).
+// It is only built from every row when the width changes; an edit recounts
+// the lines it touched and adds or removes the lines it split or joined,
+// in O(log n) each.
+struct wrapIndex {
+  int valid;             // the tree matches the document at width
+  int width;             // columns the lines are wrapped at
+  int n;                 // lines counted: every row and the one after them
+  struct wrapNode *nodes; // every node, nodes[0] standing for none
+  int cap;
+  int used;              // nodes handed out from the end of the array
+  int free;              // first node of the free list, linked by left
+  int root;
+  unsigned int seed;
+};
+
+// following a file that other programs append to, as tail -f does
+struct follow {
+  int on;                // the file is being followed
+  size_t size;           // bytes of the file the document holds
+  int ifd;               // inotify instance, -1 when polling for changes
+  int wfile;             // watch on the file, -1 for none
+  int wdir;              // watch on its directory, where a rotated file's
+                         // successor turns up
+  int behind;            // bytes are waiting beyond what one pass reads
+  int toend;             // go to the end once the line index reaches it
+  struct abuf buf;       // bytes read from the file
+};
+
+// struct to store the editor state
+struct editorConfig {
+  int cx;               // byte offset of the cursor in its line
+  int cy;
+  int rx;               // column of the cursor on screen, from cx
+  int rowoff;           // first line on screen
+  int rowsub;           // screen row of that line at the top, when wrapping
+  int coloff;           // first column on screen
+  int cursory;          // where the cursor is on screen, from editorScroll
+  int cursorx;
+  int screenrows;
+  int screencols;
+  int dockind;          // which of pt or rows holds the document
+  struct pieceTable pt;
+  struct rowStore rows;
+  int forcepieces;      // never use the row store
+  char *filename;
+  int fd;          // the open file, -1 when there is none
+  unsigned long edits;      // edits made since the file was opened
+  unsigned long savededits; // how many of them the file on disk holds
+  char *orig;      // original contents backing the piece table
+  size_t origlen;
+  int origmapped;  // orig is a read-only mapping of fd rather than heap memory
+  int origrandom;  // the mapping has been switched to random access advice
+  struct lineIndex index;
+  int indexthread; // complete the line index on a background thread
+  struct colCache cols;
+  int softwrap;          // lines longer than the screen is wide are wrapped
+  struct wrapIndex wrap;
+  struct frame frame;    // the frame being drawn
+  struct frame shadow;   // what the terminal currently shows
+  int shadowvalid;       // shadow matches the terminal, else clear and redraw
+  int shadowrowoff;      // rowoff, rowsub and coloff the shadow was drawn at
+  int shadowrowsub;
+  int shadowcoloff;
+  int debug;             // show frame statistics on screen
+  unsigned char inbuf[INBUF_SIZE]; // input read but not decoded yet
+  int inlen;
+  int keyq[KEYQ_SIZE];   // decoded keys waiting to be processed
+  long long keytime[KEYQ_SIZE]; // when each queued key was decoded
+  int keyqhead;
+  int keyqlen;
+  int inpaste;           // in the middle of a bracketed paste
+  struct abuf paste;     // text of the last bracketed paste
+  struct editorTimer timers[TIMER_MAX];
+  int sigpipe[2];        // self-pipe written by signal handlers
+  int sizequery;         // the terminal was asked where its bottom right
+                         // corner is, since TIOCGWINSZ failed
+  int sizereport;        // it answered with reportrows and reportcols
+  int reportrows;
+  int reportcols;
+  int wakefd[2];         // written by background threads to wake the loop
+  int dirty;             // something changed since the last frame
+  int maxfps;            // cap on frames per second, 0 for no cap
+  long long lastframe;   // editorNow() when the last frame was sent
+  struct abuf ab;        // output of the frame being sent, reused every frame
+  struct abuf outq;      // output the terminal hasn't taken yet
+  int outflags;          // file status flags of stdout before raw mode
+  size_t framebytes;     // bytes written for the last frame
+  unsigned long frames;  // frames written so far
+  struct findState find;
+  struct findPool findpool;
+  struct editorSyntax *syntax; // highlighting for the file, NULL for none
+  struct syntaxWorker hlworker;
+  struct abuf hlrow;     // a row being drawn, copied out of its gap buffer
+  struct abuf hlclass;   // highlight class of every byte of that row
+  int hlline;            // row hlclass holds this frame, -1 for none, so
+                         // the screen rows of a wrapped row share one lex
+  int hlend;             // bytes of the row lexed
+  const char *hltext;    // text of the row
+  struct saveState save;
+  char statusmsg[96];    // shown on the status bar until the next key
+  int gotoactive;        // the go-to prompt is open
+  char gotoquery[GOTO_MAX];
+  int gotolen;
+  struct undoLog undo;
+  struct journal journal;
+  struct follow follow;
+  struct latency lat;
+  int headless;          // no tty: input from a script, output to vt
+  struct vterm vt;
+  struct headlessStats hstats;
+  struct termios orig_termios;
+};
 
 struct editorConfig E;
 
+/*** filetypes ***/
+
+const char *C_HL_extensions[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hh",
+                                 ".hpp", NULL};
+const char *C_HL_keywords[] = {
+    "switch",    "if",      "while",   "for",      "break",   "continue",
+    "return",    "else",    "struct",  "union",    "typedef", "static",
+    "enum",      "class",   "case",    "default",  "do",      "goto",
+    "sizeof",    "const",   "extern",  "volatile", "inline",  "#include",
+    "#define",   "#if",     "#ifdef",  "#ifndef",  "#else",   "#endif",
+    "int|",      "long|",   "double|", "float|",   "char|",   "unsigned|",
+    "signed|",   "void|",   "short|",  "size_t|",  "bool|",   NULL};
+
+const char *PY_HL_extensions[] = {".py", NULL};
+const char *PY_HL_keywords[] = {
+    "def",    "class", "return", "if",    "elif",   "else",    "for",
+    "while",  "break", "continue", "import", "from", "as",     "with",
+    "try",    "except", "finally", "raise", "pass",  "lambda", "yield",
+    "in",     "not",   "and",    "or",    "is",     "global",  "None|",
+    "True|",  "False|", "self|", NULL};
+
+struct editorSyntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"python", PY_HL_extensions, PY_HL_keywords, "#", NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+// SGR foreground color of each highlight class
+const int HL_COLORS[] = {39, 36, 33, 32, 35, 31};
+
 /*** append buffer ***/
 
+int abReserve(struct abuf *ab, int len) {
+  /* Makes room for more bytes, at least doubling the capacity whenever the
+   * buffer has to grow so appends are amortized O(1).
+   *
+   * ab: pointer to the append buffer to grow
+   * len: number of bytes about to be appended
+   *
+   * Returns:
+   *  0 if successful, -1 if out of memory
+   */
+  if (ab->len + len <= ab->cap)
+    return 0;
+
+  int cap = ab->cap ? ab->cap * 2 : 1024;
+  while (cap < ab->len + len)
+    cap *= 2;
+  char *new = realloc(ab->b, cap);
+  if (new == NULL)
+    return -1;
+  ab->b = new;
+  ab->cap = cap;
+  return 0;
+}
+
 void abAppend(struct abuf *ab, const char *s, int len) {
   /* Adds a new string to the append buffer.
    *
@@ -53,31 +808,177 @@ void abAppend(struct abuf *ab, const char *s, int len) {
    * s: pointer to the new string to add to the append buffer
    * len: length of the new string to append
    */
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL)
+  if (abReserve(ab, len) == -1)
     return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
+void abAppendRepeat(struct abuf *ab, char c, int n) {
+  /* Adds a character repeated n times to the append buffer.
+   *
+   * ab: pointer to the append buffer to add to
+   * c: the character to repeat
+   * n: number of times to add it
+   */
+  if (n <= 0 || abReserve(ab, n) == -1)
+    return;
+  memset(&ab->b[ab->len], c, n);
+  ab->len += n;
+}
+
+void abAppendInt(struct abuf *ab, int v) {
+  /* Adds the decimal form of an integer to the append buffer without going
+   * through the printf machinery.
+   *
+   * ab: pointer to the append buffer to add to
+   * v: the integer to add
+   */
+  char buf[12];
+  int i = sizeof(buf);
+  unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+  do {
+    buf[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (v < 0)
+    buf[--i] = '-';
+  abAppend(ab, &buf[i], sizeof(buf) - i);
+}
+
+void abReset(struct abuf *ab) {
+  /* Empties the append buffer but keeps its memory for the next use.
+   *
+   * ab: pointer to the append buffer to reset
+   */
+  ab->len = 0;
+}
+
 void abFree(struct abuf *ab) {
   /* Frees the append buffer memory.
    *
    * ab: pointer to the append buffer to free from memory
    */
   free(ab->b);
+  ab->b = NULL;
+  ab->len = 0;
+  ab->cap = 0;
+}
+
+/*** clock ***/
+
+long long editorNow() {
+  /* Returns:
+   *  a monotonic timestamp in milliseconds
+   */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long editorNanos() {
+  /* Returns:
+   *  a monotonic timestamp in nanoseconds, for measuring
+   */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /*** terminal ***/
 
+int outputFlush() {
+  /* Writes as much of the queued output as the terminal takes without
+   * blocking.
+   *
+   * Returns:
+   *  1 if output is still queued, 0 if it has all been written; output the
+   *  terminal can't take at all (it went away) is dropped
+   */
+  struct abuf *q = &E.outq;
+  int done = 0;
+  while (done < q->len) {
+    ssize_t n = write(STDOUT_FILENO, q->b + done, q->len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        done = q->len;
+      break;
+    }
+    done += n;
+  }
+  memmove(q->b, q->b + done, q->len - done);
+  q->len -= done;
+  return q->len > 0;
+}
+
+void outputWritev(struct iovec *iov, int n) {
+  /* Writes segments of output to the terminal in one system call, after any
+   * output still queued. Whatever the terminal doesn't take right away is
+   * queued, to be written once stdout is writable again.
+   *
+   * iov: the segments, which are advanced past what got written
+   * n: number of segments
+   */
+  if (E.outq.len > 0)
+    outputFlush();
+  while (E.outq.len == 0 && n > 0) {
+    ssize_t w = writev(STDOUT_FILENO, iov, n);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return;
+      break;
+    }
+    // skip what was written, which may end in the middle of a segment
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  for (; n > 0; iov++, n--)
+    abAppend(&E.outq, iov->iov_base, iov->iov_len);
+}
+
+void outputWrite(const char *s, size_t len) {
+  /* Writes output to the terminal, queueing what it doesn't take right away.
+   *
+   * s: the output
+   * len: number of bytes of output
+   */
+  struct iovec iov = {(char *)s, len};
+  outputWritev(&iov, 1);
+}
+
+void outputDrain() {
+  /* Waits until all queued output has been written, for when the editor is
+   * about to exit or give the terminal back.
+   */
+  while (outputFlush()) {
+    struct pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+      break;
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+      break;
+  }
+}
+
 void die(const char *s) {
   /* Prints an error message and exits the program.
    *
    * s: the error message to print
    */
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  if (!E.headless) {
+    outputWrite("\x1b[2J\x1b[H", 7);
+    outputDrain();
+  }
   perror(s);
   exit(1);
 }
@@ -85,6 +986,9 @@ void die(const char *s) {
 void disableRawMode() {
   /* Resets the terminal to its original state.
    */
+  outputWrite("\x1b[?2004l", 8);
+  outputDrain();
+  fcntl(STDOUT_FILENO, F_SETFL, E.outflags);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -99,6 +1003,9 @@ void enableRawMode() {
   // save the original terminal attributes
   if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
     die("tcgetattr");
+  E.outflags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (E.outflags == -1)
+    die("fcntl");
 
   // set the atexit function to disableRawMode to restore the terminal to its
   // original state when the program exits
@@ -119,124 +1026,7035 @@ void enableRawMode() {
   // (extended input processing) flags
   raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
 
-  // set the VMIN value to 0 to set the minimum number of bytes of input needed
-  // before read() can return
+  // set the VMIN and VTIME values to 0 so read() returns whatever is available
+  // right away; waiting for input is left to poll()
   raw.c_cc[VMIN] = 0;
-  // set the VTIME value to 1/10th of a second to set the maximum amount of time
-  // to wait before read() returns
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   // set the terminal attributes to the modified termios struct
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  // frames are written without blocking; what the terminal can't take yet
+  // waits in the output queue
+  if (fcntl(STDOUT_FILENO, F_SETFL, E.outflags | O_NONBLOCK) == -1)
+    die("fcntl");
+
+  // have the terminal bracket pasted text so it arrives as one edit
+  outputWrite("\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-  /* Reads a single keypress from the user and returns it.
+int editorCsiKey(const unsigned char *params, int len, unsigned char final) {
+  /* Maps a CSI escape sequence to a key. Modifier parameters (as in ESC [ 1 ;
+   * 5 C for ctrl-right) are ignored.
+   *
+   * params: the parameter bytes between "ESC [" and the final byte
+   * len: number of parameter bytes
+   * final: the final byte of the sequence
    *
    * Returns:
-   *  the keypress
+   *  the key, or -1 if the sequence isn't one the editor uses
    */
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die("read");
+  int p = 0;
+  int i;
+  for (i = 0; i < len && isdigit(params[i]); i++)
+    p = p * 10 + (params[i] - '0');
+
+  switch (final) {
+  case 'A':
+    return MOVE_UP;
+  case 'B':
+    return MOVE_DOWN;
+  case 'C':
+    return MOVE_RIGHT;
+  case 'D':
+    return MOVE_LEFT;
+  case 'H':
+    return HOME_KEY;
+  case 'F':
+    return END_KEY;
+  case '~':
+    switch (p) {
+    case 1:
+    case 7:
+      return HOME_KEY;
+    case 3:
+      return DEL_KEY;
+    case 4:
+    case 8:
+      return END_KEY;
+    case 5:
+      return PAGE_UP;
+    case 6:
+      return PAGE_DOWN;
+    case 200:
+      return PASTE_START;
     }
   }
+  return -1;
+}
 
-  if (c == '\x1b') {
-    char seq[3];
+int editorCsiReport(const unsigned char *params, int len, int *row,
+                    int *col) {
+  /* Reads the row and column of a cursor position report (ESC [ row ; col
+   * R).
+   *
+   * params: the parameter bytes between "ESC [" and the R
+   * len: number of parameter bytes
+   * row: receives the row, counting from 1
+   * col: receives the column, counting from 1
+   *
+   * Returns:
+   *  0 if the parameters are a position, -1 if not
+   */
+  int v[2] = {0, 0};
+  int n = 0;
+  int i;
+  for (i = 0; i < len; i++) {
+    if (params[i] == ';' && n == 0)
+      n = 1;
+    else if (isdigit(params[i]) && v[n] < 10000)
+      v[n] = v[n] * 10 + (params[i] - '0');
+    else
+      return -1;
+  }
+  if (n != 1 || v[0] == 0 || v[1] == 0)
+    return -1;
+  *row = v[0];
+  *col = v[1];
+  return 0;
+}
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-      return '\x1b';
-    }
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-      return '\x1b';
-    }
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-          return '\x1b';
-        }
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-          case '5':
-            return PAGE_UP;
-          case '6':
-            return PAGE_DOWN;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-        case 'A':
-          return MOVE_UP;
-        case 'B':
-          return MOVE_DOWN;
-        case 'C':
-          return MOVE_RIGHT;
-        case 'D':
-          return MOVE_LEFT;
-        }
-      }
-    }
-    return '\x1b';
+int editorDecodeUtf8(const unsigned char *s, int n, int *key) {
+  /* Decodes one UTF-8 encoded character. Overlong forms, surrogates and
+   * anything past U+10FFFF are malformed, so no input decodes to a special
+   * key; they are told apart by the lead byte and the range it allows the
+   * second byte in, as Unicode's table of well-formed sequences has it.
+   *
+   * s: the bytes to decode
+   * n: number of bytes available
+   * key: receives the code point, U+FFFD for malformed input
+   *
+   * Returns:
+   *  the number of bytes used, 0 if the character is not complete yet; a
+   *  malformed character uses the bytes up to the first one that doesn't
+   *  fit, at least one
+   */
+  int need;
+  int cp;
+  unsigned char lo = 0x80, hi = 0xbf;
+  if (s[0] < 0x80) {
+    *key = s[0];
+    return 1;
+  } else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    need = 2;
+    cp = s[0] & 0x1f;
+  } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    need = 3;
+    cp = s[0] & 0x0f;
+    if (s[0] == 0xe0)
+      lo = 0xa0; // overlong
+    else if (s[0] == 0xed)
+      hi = 0x9f; // surrogates
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    need = 4;
+    cp = s[0] & 0x07;
+    if (s[0] == 0xf0)
+      lo = 0x90; // overlong
+    else if (s[0] == 0xf4)
+      hi = 0x8f; // past U+10FFFF
   } else {
-    return c;
+    *key = 0xfffd;
+    return 1;
   }
 
-  return c;
+  int i;
+  for (i = 1; i < need; i++) {
+    if (i >= n)
+      return 0;
+    if (s[i] < lo || s[i] > hi) {
+      *key = 0xfffd;
+      return i;
+    }
+    cp = (cp << 6) | (s[i] & 0x3f);
+    lo = 0x80;
+    hi = 0xbf;
+  }
+  *key = cp;
+  return need;
 }
 
-int getWindowSize(int *rows, int *cols) {
-  /* Gets the size of the terminal window and stores it in the rows and cols
-   * pointers.
+int editorDecodeKey(const unsigned char *s, int n, int *key) {
+  /* Decodes the key at the start of a run of input bytes: a CSI or SS3
+   * escape sequence, a lone escape, or a UTF-8 character.
    *
-   * rows: a pointer to the variable to store the number of rows
-   * cols: a pointer to the variable to store the number of columns
+   * s: the bytes to decode
+   * n: number of bytes available
+   * key: receives the key, or -1 for a sequence the editor ignores
    *
    * Returns:
-   *  0 if successful, -1 if not
+   *  the number of bytes used, 0 if more bytes are needed to tell
    */
-  struct winsize w;
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0) {
-    return -1;
-  } else {
-    *cols = w.ws_col;
-    *rows = w.ws_row;
+  if (s[0] != '\x1b')
+    return editorDecodeUtf8(s, n, key);
+  if (n < 2)
     return 0;
+
+  if (s[1] == '[') {
+    // parameter and intermediate bytes run up to the final byte
+    int i = 2;
+    while (i < n && s[i] >= 0x20 && s[i] <= 0x3f)
+      i++;
+    if (i == n)
+      return 0;
+    if (s[i] < 0x40 || s[i] > 0x7e) {
+      *key = '\x1b';
+      return 1;
+    }
+    if (s[i] == 'R' && E.sizequery &&
+        editorCsiReport(s + 2, i - 2, &E.reportrows, &E.reportcols) == 0) {
+      // the answer to the size query: the corner the cursor was sent to
+      E.sizequery = 0;
+      E.sizereport = 1;
+      *key = -1;
+      return i + 1;
+    }
+    *key = editorCsiKey(s + 2, i - 2, s[i]);
+    return i + 1;
+  }
+
+  if (s[1] == 'O') {
+    if (n < 3)
+      return 0;
+    // SS3 sequences are what cursor keys send in application mode
+    *key = editorCsiKey(NULL, 0, s[2]);
+    return 3;
   }
+
+  *key = '\x1b';
+  return 1;
 }
 
-/*** input ***/
+void editorKeyPush(int key) {
+  /* Adds a decoded key to the back of the key queue.
+   *
+   * key: the key to queue
+   */
+  int i = (E.keyqhead + E.keyqlen) % KEYQ_SIZE;
+  E.keyq[i] = key;
+  E.keytime[i] = E.lat.path ? editorNanos() : 0;
+  E.keyqlen++;
+}
 
-void editorMoveCursor(int key) {
-  /* Moves the cursor.
+void editorDecodeInput(int flush) {
+  /* Decodes as many keys as possible from the input buffer into the key
+   * queue. Bytes of a bracketed paste are collected into the paste buffer
+   * and queued as a single PASTE_KEY, after which decoding stops so the paste
+   * buffer isn't reused before that key is handled.
    *
-   * key: motion keys (using vim motion keys)
+   * flush: no more input is coming soon, so a sequence cut short is taken as
+   *        the keys its bytes stand for on their own (an escape press), or
+   *        for a UTF-8 character cut short, as malformed
    */
-  switch (key) {
-  case MOVE_LEFT:
-    if (E.cx != 0) {
-      E.cx--;
+  static const char pasteEnd[] = "\x1b[201~";
+  int pos = 0;
+  while (pos < E.inlen && E.keyqlen < KEYQ_SIZE) {
+    if (E.inpaste) {
+      unsigned char *start = E.inbuf + pos;
+      unsigned char *end = memmem(start, E.inlen - pos, pasteEnd, 6);
+      if (end) {
+        abAppend(&E.paste, (char *)start, end - start);
+        pos += end - start + 6;
+        E.inpaste = 0;
+        editorKeyPush(PASTE_KEY);
+        break;
+      }
+      // keep a possible partial terminator for the next read
+      int keep = E.inlen - pos < 5 ? E.inlen - pos : 5;
+      abAppend(&E.paste, (char *)start, E.inlen - pos - keep);
+      pos = E.inlen - keep;
+      break;
     }
-    break;
-  case MOVE_RIGHT:
-    if (E.cx != E.screencols - 1) {
-      E.cx++;
+
+    int key;
+    int used = editorDecodeKey(E.inbuf + pos, E.inlen - pos, &key);
+    if (used == 0) {
+      if (!flush)
+        break;
+      key = E.inbuf[pos] < 0x80 ? E.inbuf[pos] : 0xfffd;
+      used = 1;
     }
-    break;
-  case MOVE_UP:
-    if (E.cy != 0) {
-      E.cy--;
+    pos += used;
+
+    if (key == PASTE_START) {
+      E.inpaste = 1;
+      abReset(&E.paste);
+    } else if (key != -1) {
+      editorKeyPush(key);
     }
-    break;
-  case MOVE_DOWN:
-    if (E.cy != E.screencols - 1) {
-      E.cy++;
+  }
+
+  memmove(E.inbuf, E.inbuf + pos, E.inlen - pos);
+  E.inlen -= pos;
+}
+
+int editorFillInput() {
+  /* Reads everything that is available on stdin into the input buffer with a
+   * single read().
+   *
+   * Returns:
+   *  the number of bytes read
+   */
+  int nread = read(STDIN_FILENO, E.inbuf + E.inlen, INBUF_SIZE - E.inlen);
+  if (nread == -1) {
+    if (errno != EAGAIN && errno != EINTR)
+      die("read");
+    return 0;
+  }
+  E.inlen += nread;
+  return nread;
+}
+
+int editorWaitInput(int timeout) {
+  /* Sleeps until stdin is readable.
+   *
+   * timeout: milliseconds to wait at most, -1 to wait indefinitely
+   *
+   * Returns:
+   *  1 if there is input to read, 0 on timeout
+   */
+  struct pollfd pfd;
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  int n;
+  while ((n = poll(&pfd, 1, timeout)) == -1) {
+    if (errno != EINTR)
+      die("poll");
+  }
+  return n > 0;
+}
+
+int editorReadKey() {
+  /* Returns the next key from the key queue, waiting for and decoding more
+   * input when the queue is empty.
+   *
+   * Returns:
+   *  the keypress
+   */
+  editorDecodeInput(0);
+  while (E.keyqlen == 0) {
+    // the rest of a cut-off escape sequence gets a short grace period
+    int ready = editorWaitInput(E.inlen > 0 && !E.inpaste ? ESC_TIMEOUT_MS : -1);
+    if (ready)
+      editorFillInput();
+    editorDecodeInput(!ready);
+  }
+
+  int key = E.keyq[E.keyqhead];
+  E.lat.current = E.keytime[E.keyqhead];
+  E.keyqhead = (E.keyqhead + 1) % KEYQ_SIZE;
+  E.keyqlen--;
+  return key;
+}
+
+int getWindowSize(int *rows, int *cols) {
+  /* Gets the size of the terminal window and stores it in the rows and cols
+   * pointers.
+   *
+   * rows: a pointer to the variable to store the number of rows
+   * cols: a pointer to the variable to store the number of columns
+   *
+   * Returns:
+   *  0 if successful, -1 if not
+   */
+  struct winsize w;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0) {
+    return -1;
+  } else {
+    *cols = w.ws_col;
+    *rows = w.ws_row;
+    return 0;
+  }
+}
+
+/*** timers and wakeups ***/
+
+void editorTimerSet(int id, int ms, void (*fn)(void)) {
+  /* Arms a timer, replacing any earlier deadline it had.
+   *
+   * id: which timer (one of enum editorTimerId)
+   * ms: milliseconds from now until it fires
+   * fn: function to call when it fires
+   */
+  E.timers[id].due = editorNow() + ms;
+  E.timers[id].fn = fn;
+}
+
+void editorTimerCancel(int id) {
+  /* Disarms a timer.
+   *
+   * id: which timer
+   */
+  E.timers[id].fn = NULL;
+}
+
+int editorTimerTimeout() {
+  /* Returns:
+   *  milliseconds until the next timer is due, suitable as a poll() timeout,
+   *  -1 if no timer is armed
+   */
+  long long now = editorNow();
+  int timeout = -1;
+  int i;
+  for (i = 0; i < TIMER_MAX; i++) {
+    if (E.timers[i].fn == NULL)
+      continue;
+    long long left = E.timers[i].due - now;
+    if (left < 0)
+      left = 0;
+    if (timeout == -1 || left < timeout)
+      timeout = left;
+  }
+  return timeout;
+}
+
+void editorRunTimers() {
+  /* Calls every timer that is due. A timer is disarmed before it is called
+   * so it can arm itself again.
+   */
+  long long now = editorNow();
+  int i;
+  for (i = 0; i < TIMER_MAX; i++) {
+    void (*fn)(void) = E.timers[i].fn;
+    if (fn && E.timers[i].due <= now) {
+      E.timers[i].fn = NULL;
+      fn();
+    }
+  }
+}
+
+void editorWake() {
+  /* Wakes the event loop. Safe to call from background threads when they
+   * have finished something the editor should look at.
+   */
+#ifdef __linux__
+  uint64_t one = 1;
+  write(E.wakefd[1], &one, sizeof(one));
+#else
+  write(E.wakefd[1], "w", 1);
+#endif
+}
+
+void editorDrainFd(int fd) {
+  /* Empties a non-blocking notification pipe or eventfd.
+   *
+   * fd: the descriptor to drain
+   */
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+void editorSigwinch(int sig) {
+  /* SIGWINCH handler. Only pokes the self-pipe; the resize itself is handled
+   * by the event loop.
+   */
+  (void)sig;
+  int saved = errno;
+  write(E.sigpipe[1], "w", 1);
+  errno = saved;
+}
+
+void editorInitEvents() {
+  /* Creates the self-pipe for signals and the wakeup descriptor for
+   * background threads, and installs the SIGWINCH handler.
+   */
+  if (pipe(E.sigpipe) == -1)
+    die("pipe");
+#ifdef __linux__
+  E.wakefd[0] = E.wakefd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (E.wakefd[0] == -1)
+    die("eventfd");
+#else
+  if (pipe(E.wakefd) == -1)
+    die("pipe");
+#endif
+
+  int i, j;
+  for (i = 0; i < 2; i++) {
+    int *fds = i == 0 ? E.sigpipe : E.wakefd;
+    for (j = 0; j < 2; j++) {
+      fcntl(fds[j], F_SETFL, fcntl(fds[j], F_GETFL) | O_NONBLOCK);
+      fcntl(fds[j], F_SETFD, FD_CLOEXEC);
+    }
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorSigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+
+  for (i = 0; i < TIMER_MAX; i++)
+    E.timers[i].fn = NULL;
+}
+
+/*** latency ***/
+
+int histBucket(uint64_t v) {
+  /* Returns:
+   *  the bucket of a histogram a value falls in
+   */
+  if (v < (1 << HIST_SUB_BITS))
+    return v;
+  int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+  return (shift << (HIST_SUB_BITS - 1)) + (v >> shift);
+}
+
+uint64_t histBucketTop(int b) {
+  /* Returns:
+   *  the largest value that falls in a bucket of a histogram
+   */
+  int half = 1 << (HIST_SUB_BITS - 1);
+  if (b < 2 * half)
+    return b;
+  int shift = b / half - 1;
+  return (((uint64_t)(b % half + half) + 1) << shift) - 1;
+}
+
+void histRecord(struct histogram *h, long long ns) {
+  /* Counts a duration in a histogram.
+   *
+   * h: the histogram
+   * ns: the duration in nanoseconds
+   */
+  uint64_t v = ns > 0 ? ns : 0;
+  h->counts[histBucket(v)]++;
+  h->n++;
+  if (v > h->max)
+    h->max = v;
+}
+
+uint64_t histPercentile(struct histogram *h, double p) {
+  /* Returns:
+   *  the value below which a fraction p of the durations counted lie, to
+   *  the precision of the buckets
+   */
+  uint64_t want = (uint64_t)(p * h->n);
+  if (want < p * h->n || want < 1)
+    want++;
+  uint64_t seen = 0;
+  int b;
+  for (b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen >= want)
+      return histBucketTop(b) < h->max ? histBucketTop(b) : h->max;
+  }
+  return h->max;
+}
+
+void latencyKeyDone() {
+  /* Records that the key taken from the queue last has been handled.
+   */
+  struct latency *lat = &E.lat;
+  if (lat->path == NULL)
+    return;
+  histRecord(&lat->hist[LAT_PROCESS], editorNanos() - lat->current);
+  if (lat->npending == lat->pendingcap) {
+    int cap = lat->pendingcap ? lat->pendingcap * 2 : 64;
+    long long *new = realloc(lat->pending, sizeof(long long) * cap);
+    if (new == NULL)
+      die("realloc");
+    lat->pending = new;
+    lat->pendingcap = cap;
+  }
+  lat->pending[lat->npending++] = lat->current;
+}
+
+void latencyFrame(long long start, long long built, long long written) {
+  /* Records the timing of a frame, and of every key handled since the last
+   * one from its decoding until the frame showing it was written.
+   *
+   * start: when the frame started to be drawn
+   * built: when its output was ready
+   * written: when the output had been written
+   */
+  struct latency *lat = &E.lat;
+  if (lat->path == NULL)
+    return;
+  histRecord(&lat->hist[LAT_BUILD], built - start);
+  histRecord(&lat->hist[LAT_WRITE], written - built);
+  int i;
+  for (i = 0; i < lat->npending; i++)
+    histRecord(&lat->hist[LAT_TOTAL], written - lat->pending[i]);
+  lat->npending = 0;
+}
+
+void latencyDump() {
+  /* Writes percentiles of every latency histogram to the latency file,
+   * replacing what an earlier dump wrote there.
+   */
+  static const char *names[LAT_MAX] = {"process", "build", "write", "total"};
+  if (E.lat.path == NULL)
+    return;
+  FILE *fp = fopen(E.lat.path, "w");
+  if (fp == NULL)
+    return;
+  fprintf(fp, "# decoded -> handled (process), frame drawn (build), "
+              "frame written (write), decoded -> written (total); us\n");
+  fprintf(fp, "%-8s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "p50",
+          "p90", "p99", "p99.9", "max");
+  int i;
+  for (i = 0; i < LAT_MAX; i++) {
+    struct histogram *h = &E.lat.hist[i];
+    fprintf(fp, "%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i],
+            (unsigned long long)h->n, histPercentile(h, 0.5) / 1000.0,
+            histPercentile(h, 0.9) / 1000.0, histPercentile(h, 0.99) / 1000.0,
+            histPercentile(h, 0.999) / 1000.0, h->max / 1000.0);
+  }
+  fclose(fp);
+}
+
+/*** unicode ***/
+
+// code points that take no column, drawn over the character before them
+const int ZERO_WIDTH[][2] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+    {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711}, {0x0730, 0x074a},
+    {0x07a6, 0x07b0}, {0x07eb, 0x07f3}, {0x0900, 0x0902}, {0x093a, 0x093a},
+    {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+    {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09bc, 0x09bc}, {0x09c1, 0x09c4},
+    {0x09cd, 0x09cd}, {0x0a01, 0x0a02}, {0x0a3c, 0x0a3c}, {0x0a41, 0x0a51},
+    {0x0a81, 0x0a82}, {0x0abc, 0x0abc}, {0x0ac1, 0x0ac8}, {0x0acd, 0x0acd},
+    {0x0b01, 0x0b01}, {0x0b3c, 0x0b3c}, {0x0b41, 0x0b44}, {0x0b4d, 0x0b4d},
+    {0x0bc0, 0x0bc0}, {0x0bcd, 0x0bcd}, {0x0c3e, 0x0c40}, {0x0c46, 0x0c56},
+    {0x0cbc, 0x0cbc}, {0x0ccc, 0x0ccd}, {0x0d41, 0x0d44}, {0x0d4d, 0x0d4d},
+    {0x0dca, 0x0dca}, {0x0dd2, 0x0dd6}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a},
+    {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1}, {0x0eb4, 0x0ebc}, {0x0ec8, 0x0ecd},
+    {0x0f18, 0x0f19}, {0x0f35, 0x0f35}, {0x0f37, 0x0f37}, {0x0f39, 0x0f39},
+    {0x0f71, 0x0f7e}, {0x0f80, 0x0f84}, {0x0f86, 0x0f87}, {0x0f8d, 0x0fbc},
+    {0x102d, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103a}, {0x1160, 0x11ff},
+    {0x135d, 0x135f}, {0x1712, 0x1714}, {0x17b4, 0x17b5}, {0x17b7, 0x17bd},
+    {0x17c6, 0x17c6}, {0x17c9, 0x17d3}, {0x180b, 0x180f}, {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064},
+    {0x20d0, 0x20f0}, {0x302a, 0x302d}, {0x3099, 0x309a}, {0xa66f, 0xa672},
+    {0xa674, 0xa67d}, {0xa69e, 0xa69f}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+    {0xfeff, 0xfeff}, {0x1d167, 0x1d169}, {0x1d173, 0x1d182},
+    {0x1f3fb, 0x1f3ff}, {0xe0001, 0xe007f}, {0xe0100, 0xe01ef}};
+
+// code points of East Asian wide and fullwidth characters and emoji, which
+// take two columns
+const int DOUBLE_WIDTH[][2] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},
+    {0x23e9, 0x23ec},   {0x23f0, 0x23f0},   {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267f, 0x267f},   {0x2693, 0x2693},   {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3},   {0x26f5, 0x26f5},   {0x26fa, 0x26fa},
+    {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},
+    {0x2728, 0x2728},   {0x274c, 0x274c},   {0x274e, 0x274e},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},
+    {0x2b50, 0x2b50},   {0x2b55, 0x2b55},   {0x2e80, 0x303e},
+    {0x3041, 0x3098},   {0x309b, 0x33ff},   {0x3400, 0x4dbf},
+    {0x4e00, 0x9fff},   {0xa000, 0xa4cf},   {0xa960, 0xa97f},
+    {0xac00, 0xd7a3},   {0xf900, 0xfaff},   {0xfe10, 0xfe19},
+    {0xfe30, 0xfe6f},   {0xff00, 0xff60},   {0xffe0, 0xffe6},
+    {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff},
+    {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e},
+    {0x1f191, 0x1f19a}, {0x1f200, 0x1f251}, {0x1f300, 0x1f320},
+    {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393},
+    {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0},
+    {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f3fa}, {0x1f400, 0x1f43e},
+    {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d},
+    {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a},
+    {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f},
+    {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2},
+    {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc},
+    {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945},
+    {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd}};
+
+int unicodeInTable(const int (*table)[2], int n, int cp) {
+  /* Looks a code point up in a sorted table of ranges.
+   *
+   * table: the ranges, first and last code point of each
+   * n: number of ranges
+   * cp: the code point
+   *
+   * Returns:
+   *  1 if one of the ranges holds the code point, 0 if not
+   */
+  int lo = 0, hi = n - 1;
+  if (cp < table[0][0] || cp > table[hi][1])
+    return 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < table[mid][0])
+      hi = mid - 1;
+    else if (cp > table[mid][1])
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+int charWidth(int cp) {
+  /* Returns:
+   *  the columns a printable code point takes on the screen: 0 for combining
+   *  marks and other zero width characters, 2 for wide ones, else 1
+   */
+  if (cp < 0x300)
+    return 1;
+  if (unicodeInTable(ZERO_WIDTH, sizeof(ZERO_WIDTH) / sizeof(ZERO_WIDTH[0]),
+                     cp))
+    return 0;
+  if (unicodeInTable(DOUBLE_WIDTH,
+                     sizeof(DOUBLE_WIDTH) / sizeof(DOUBLE_WIDTH[0]), cp))
+    return 2;
+  return 1;
+}
+
+int charDecode(const char *p, size_t n, int *cp) {
+  /* Decodes the character text starts with. Control characters, malformed
+   * or cut off UTF-8 and the C1 controls all come out as -1, which is shown
+   * as a '?' one byte at a time.
+   *
+   * p: the text
+   * n: bytes available, at least 1
+   * cp: receives the code point, or -1
+   *
+   * Returns:
+   *  the length of the character in bytes
+   */
+  const unsigned char *s = (const unsigned char *)p;
+  if (s[0] < 0x80) {
+    *cp = s[0] == '\t' || (s[0] >= 0x20 && s[0] != 0x7f) ? s[0] : -1;
+    return 1;
+  }
+  int len = editorDecodeUtf8(s, n < 4 ? n : 4, cp);
+  // a real U+FFFD is the only 3 byte sequence starting with 0xef it stands
+  // for; anything else is malformed
+  if (len == 0 || (*cp == 0xfffd && (len != 3 || s[0] != 0xef)) ||
+      (*cp >= 0x80 && *cp < 0xa0)) {
+    *cp = -1;
+    return 1;
+  }
+  return len;
+}
+
+int charColumns(int cp, size_t col) {
+  /* Returns:
+   *  the columns a decoded character takes when it starts at a column of
+   *  its line; a tab reaches the next tab stop
+   */
+  if (cp == '\t')
+    return TAB_STOP - col % TAB_STOP;
+  return cp == -1 ? 1 : charWidth(cp);
+}
+
+size_t asciiSpanScalar(const char *p, size_t n) {
+  /* Returns:
+   *  how many bytes text starts with that are printable ASCII, each one
+   *  column wide
+   */
+  size_t i = 0;
+  while (i < n && (unsigned char)p[i] >= 0x20 && (unsigned char)p[i] < 0x7f)
+    i++;
+  return i;
+}
+
+size_t asciiSpan(const char *p, size_t n) {
+  /* Vectorized asciiSpanScalar, 16 bytes per compare where SSE2 is there.
+   * Bytes from 0x80 up are negative as signed bytes, so one signed compare
+   * against 0x1f rules out them and the control characters together.
+   *
+   * p: text to scan
+   * n: length of the text
+   *
+   * Returns:
+   *  the length of the printable ASCII prefix of the text
+   */
+  size_t i = 0;
+#ifdef TXT_X86
+  const __m128i low = _mm_set1_epi8(0x1f);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del),
+                                  _mm_cmpgt_epi8(v, low));
+    int mask = _mm_movemask_epi8(ok);
+    if (mask != 0xffff)
+      return i + __builtin_ctz(~mask);
+  }
+#endif
+  return i + asciiSpanScalar(p + i, n - i);
+}
+
+int textWidth(const char *s, int len) {
+  /* Returns:
+   *  the columns UTF-8 text takes as framePut draws it
+   */
+  int cols = 0;
+  int i = 0;
+  while (i < len) {
+    int cp;
+    i += charDecode(s + i, len - i, &cp);
+    cols += cp < 0x20 ? 1 : charWidth(cp);
+  }
+  return cols;
+}
+
+/*** frame buffer ***/
+
+void frameClearRow(struct frame *f, int y) {
+  /* Fills a row of a frame with blanks.
+   *
+   * f: the frame to modify
+   * y: the row to clear
+   */
+  struct cell *row = &f->cells[y * f->cols];
+  int x;
+  for (x = 0; x < f->cols; x++) {
+    memset(&row[x], 0, sizeof(struct cell));
+    row[x].ch[0] = ' ';
+    row[x].len = 1;
+  }
+}
+
+void frameResize(struct frame *f, int rows, int cols) {
+  /* (Re)allocates a frame for a screen size and blanks it.
+   *
+   * f: the frame to size
+   * rows: number of screen rows
+   * cols: number of screen columns
+   */
+  struct cell *new = realloc(f->cells, sizeof(struct cell) * rows * cols);
+  if (new == NULL)
+    die("realloc");
+  f->cells = new;
+  f->rows = rows;
+  f->cols = cols;
+
+  int y;
+  for (y = 0; y < rows; y++)
+    frameClearRow(f, y);
+}
+
+void frameScroll(struct frame *f, int top, int bottom, int n) {
+  /* Moves the rows of a region of a frame up, blanking the rows uncovered at
+   * the bottom, as a terminal scrolls.
+   *
+   * f: the frame
+   * top: first row of the region
+   * bottom: row after the region
+   * n: rows to scroll up by, negative to scroll down
+   */
+  int cols = f->cols;
+  int height = bottom - top;
+  int k = n < 0 ? -n : n;
+  int y;
+  if (k > height)
+    k = height;
+  if (n > 0) {
+    memmove(&f->cells[top * cols], &f->cells[(top + k) * cols],
+            sizeof(struct cell) * cols * (height - k));
+    for (y = bottom - k; y < bottom; y++)
+      frameClearRow(f, y);
+  } else {
+    memmove(&f->cells[(top + k) * cols], &f->cells[top * cols],
+            sizeof(struct cell) * cols * (height - k));
+    for (y = top; y < top + k; y++)
+      frameClearRow(f, y);
+  }
+}
+
+int framePutChar(struct frame *f, int y, int x, const char *s, int len,
+                 int width, int hl) {
+  /* Writes a character into a row: into one cell, or two for a wide one, or
+   * for a zero width one into the cell before it if there is room. A wide
+   * character cut off by the right edge is drawn as a blank.
+   *
+   * f: the frame to draw into
+   * y: the row to draw on
+   * x: the column to draw at
+   * s: the bytes of the character
+   * len: number of bytes
+   * width: columns the character takes, 0 to 2
+   * hl: highlight class to draw it in
+   *
+   * Returns:
+   *  the column after the character
+   */
+  struct cell *row = &f->cells[y * f->cols];
+  if (width == 0) {
+    if (x > 0 && x <= f->cols) {
+      struct cell *c = &row[x - 1];
+      if (c->len == 0 && x > 1)
+        c = &row[x - 2];
+      if (c->len + len <= (int)sizeof(c->ch)) {
+        memcpy(c->ch + c->len, s, len);
+        c->len += len;
+      }
+    }
+    return x;
+  }
+  if (x >= f->cols)
+    return x;
+  if (width == 2 && x + 1 == f->cols) {
+    s = " ";
+    len = 1;
+    width = 1;
+  }
+  // the whole cell is written, as frames are compared a cell at a time
+  struct cell c = {{0}, len, hl};
+  memcpy(c.ch, s, len);
+  row[x] = c;
+  if (width == 2) {
+    memset(&row[x + 1], 0, sizeof(struct cell));
+    row[x + 1].hl = hl;
+  }
+  return x + width;
+}
+
+int framePutAscii(struct frame *f, int y, int x, const char *s, int len,
+                  const unsigned char *hl) {
+  /* Writes printable ASCII into a row a cell per byte, clipped at the right
+   * edge.
+   *
+   * f: the frame to draw into
+   * y: the row to draw on
+   * x: the column of the first character
+   * s: the text to draw
+   * len: length of the text
+   * hl: highlight class of every byte, or NULL for none
+   *
+   * Returns:
+   *  the column after the last character drawn
+   */
+  struct cell *row = &f->cells[y * f->cols];
+  if (len > f->cols - x)
+    len = f->cols - x;
+  int i;
+  for (i = 0; i < len; i++) {
+    struct cell *c = &row[x + i];
+    memset(c, 0, sizeof(*c));
+    c->ch[0] = s[i];
+    c->len = 1;
+    if (hl)
+      c->hl = hl[i];
+  }
+  return x + (len > 0 ? len : 0);
+}
+
+int framePut(struct frame *f, int y, int x, const char *s, int len) {
+  /* Writes UTF-8 text into a row, clipped at the right edge, with control
+   * characters shown as '?'.
+   *
+   * f: the frame to draw into
+   * y: the row to draw on
+   * x: the column of the first character
+   * s: the text to draw
+   * len: length of the text in bytes
+   *
+   * Returns:
+   *  the column after the last character drawn
+   */
+  int i = 0;
+  while (i < len && x < f->cols) {
+    int cp;
+    int n = charDecode(s + i, len - i, &cp);
+    if (cp < 0x20)
+      x = framePutChar(f, y, x, "?", 1, 1, HL_NORMAL);
+    else
+      x = framePutChar(f, y, x, s + i, n, charWidth(cp), HL_NORMAL);
+    i += n;
+  }
+  return x;
+}
+
+void abAppendMove(struct abuf *ab, int y, int x) {
+  /* Adds the escape that moves the terminal cursor to a cell.
+   *
+   * ab: the append buffer
+   * y: zero based screen row
+   * x: zero based screen column
+   */
+  abAppend(ab, "\x1b[", 2);
+  abAppendInt(ab, y + 1);
+  abAppend(ab, ";", 1);
+  abAppendInt(ab, x + 1);
+  abAppend(ab, "H", 1);
+}
+
+int cellBlank(struct cell *c) {
+  /* Returns:
+   *  1 if the cell shows nothing, so erasing to end of line can stand in for
+   *  drawing it
+   */
+  return c->len == 1 && c->ch[0] == ' ';
+}
+
+void abAppendColor(struct abuf *ab, int hl) {
+  /* Adds the escape that sets the foreground color of a highlight class.
+   *
+   * ab: the append buffer
+   * hl: the highlight class
+   */
+  abAppend(ab, "\x1b[", 2);
+  abAppendInt(ab, HL_COLORS[hl]);
+  abAppend(ab, "m", 1);
+}
+
+void frameEmitRun(struct abuf *ab, struct frame *f, int y, int x0, int x1,
+                  int *color) {
+  /* Appends the escapes that move the terminal cursor to a run of cells and
+   * redraw it. The run ends in an erase to end of line instead of explicit
+   * blanks when nothing but blanks follow it. The color only changes where
+   * a visible character needs another one; blanks look the same in any.
+   *
+   * ab: the append buffer
+   * f: the frame holding the new contents
+   * y: the row of the run
+   * x0: first column of the run
+   * x1: column one past the run
+   * color: highlight class the terminal is drawing in, updated
+   */
+  struct cell *row = &f->cells[y * f->cols];
+  int last = f->cols;
+  while (last > x0 && cellBlank(&row[last - 1]))
+    last--;
+
+  abAppendMove(ab, y, x0);
+
+  int x = x0;
+  int end = x1 < last ? x1 : last;
+  while (x < end) {
+    if (cellBlank(&row[x])) {
+      int blanks = 1;
+      while (x + blanks < end && cellBlank(&row[x + blanks]))
+        blanks++;
+      abAppendRepeat(ab, ' ', blanks);
+      x += blanks;
+    } else if (row[x].len == 0) {
+      // the second cell of a wide character drawn before it
+      x++;
+    } else {
+      if (row[x].hl != *color) {
+        abAppendColor(ab, row[x].hl);
+        *color = row[x].hl;
+      }
+      abAppend(ab, row[x].ch, row[x].len);
+      x++;
+    }
+  }
+  if (x1 > last)
+    abAppend(ab, "\x1b[K", 3);
+}
+
+void frameDiff(struct abuf *ab, struct frame *cur, struct frame *next) {
+  /* Appends the output that turns the screen shown in one frame into
+   * another, touching only the cells that differ. Runs of changed cells that
+   * are only a few unchanged cells apart are sent as one run, since a cursor
+   * move costs more than redrawing a short gap.
+   *
+   * ab: the append buffer
+   * cur: what the terminal shows now
+   * next: what it should show
+   */
+  // frames start and end in the default color
+  int color = HL_NORMAL;
+  int y;
+  for (y = 0; y < next->rows; y++) {
+    struct cell *a = &cur->cells[y * cur->cols];
+    struct cell *b = &next->cells[y * next->cols];
+    int x = 0;
+    while (x < next->cols) {
+      if (memcmp(&a[x], &b[x], sizeof(struct cell)) == 0) {
+        x++;
+        continue;
+      }
+
+      // a wide character is redrawn from its first cell
+      int start = x > 0 && b[x].len == 0 ? x - 1 : x;
+      int end = x + 1;
+      int gap = 0;
+      for (x = end; x < next->cols && gap < 8; x++) {
+        if (memcmp(&a[x], &b[x], sizeof(struct cell)) == 0) {
+          gap++;
+        } else {
+          gap = 0;
+          end = x + 1;
+        }
+      }
+      frameEmitRun(ab, next, y, start, end, &color);
+      x = end;
+    }
+  }
+  if (color != HL_NORMAL)
+    abAppendColor(ab, HL_NORMAL);
+}
+
+/*** virtual terminal ***/
+
+void vtInit(struct vterm *vt, int rows, int cols) {
+  /* Sets up a blank virtual terminal with the cursor at the top left.
+   *
+   * vt: the virtual terminal to initialize
+   * rows: number of screen rows
+   * cols: number of screen columns
+   */
+  memset(vt, 0, sizeof(struct vterm));
+  frameResize(&vt->screen, rows, cols);
+  vt->cursor = 1;
+  vt->bottom = rows;
+}
+
+void vtLineFeed(struct vterm *vt) {
+  /* Moves the cursor down a row, scrolling the scrolling region up at its
+   * bottom.
+   */
+  if (vt->cy == vt->bottom - 1)
+    frameScroll(&vt->screen, vt->top, vt->bottom, 1);
+  else if (vt->cy < vt->screen.rows - 1)
+    vt->cy++;
+}
+
+void vtErase(struct vterm *vt, int y, int x0, int x1) {
+  /* Blanks the cells of a row from x0 up to but not including x1.
+   */
+  struct cell *row = &vt->screen.cells[y * vt->screen.cols];
+  int x;
+  for (x = x0; x < x1; x++) {
+    memset(&row[x], 0, sizeof(struct cell));
+    row[x].ch[0] = ' ';
+    row[x].len = 1;
+  }
+}
+
+void vtPut(struct vterm *vt, const unsigned char *s, int len) {
+  /* Writes one character at the cursor and advances it, wrapping to the next
+   * row once the last column has been written. A wide character takes two
+   * cells and a zero width one joins the character before it, as framePut
+   * draws them. Overwriting either half of a wide character blanks the
+   * other.
+   *
+   * vt: the virtual terminal
+   * s: the bytes of the character
+   * len: number of bytes, at most 4
+   */
+  int cp;
+  int width = charDecode((const char *)s, len, &cp) == len && cp >= 0x20
+                  ? charWidth(cp)
+                  : 1;
+  int cols = vt->screen.cols;
+  if (width == 0) {
+    framePutChar(&vt->screen, vt->cy, vt->wrap ? cols : vt->cx,
+                 (const char *)s, len, 0, vt->hl);
+    return;
+  }
+  if (vt->wrap || (width == 2 && vt->cx == cols - 1)) {
+    vt->cx = 0;
+    vtLineFeed(vt);
+    vt->wrap = 0;
+  }
+  struct cell *row = &vt->screen.cells[vt->cy * cols];
+  if (row[vt->cx].len == 0 && vt->cx > 0)
+    vtErase(vt, vt->cy, vt->cx - 1, vt->cx);
+  if (vt->cx + width < cols && row[vt->cx + width].len == 0)
+    vtErase(vt, vt->cy, vt->cx + width, vt->cx + width + 1);
+  framePutChar(&vt->screen, vt->cy, vt->cx, (const char *)s, len, width,
+               vt->hl);
+  if (vt->cx + width >= cols)
+    vt->wrap = 1;
+  else
+    vt->cx += width;
+}
+
+void vtCsi(struct vterm *vt, unsigned char final) {
+  /* Carries out a CSI sequence whose parameters have been collected.
+   *
+   * vt: the virtual terminal
+   * final: the byte that ended the sequence
+   */
+  int priv = vt->seqlen > 0 && vt->seq[0] == '?';
+  int params[8] = {0};
+  int nparams = 0;
+  int i;
+  for (i = priv; i < vt->seqlen; i++) {
+    if (vt->seq[i] == ';') {
+      if (nparams < 7)
+        nparams++;
+    } else if (isdigit(vt->seq[i])) {
+      params[nparams] = params[nparams] * 10 + vt->seq[i] - '0';
+    }
+  }
+  nparams++;
+
+  int rows = vt->screen.rows;
+  int cols = vt->screen.cols;
+  int n = params[0] ? params[0] : 1;
+  vt->wrap = 0;
+  if (priv) {
+    if (params[0] == 25 && (final == 'h' || final == 'l'))
+      vt->cursor = final == 'h';
+    // other modes (bracketed paste) don't change what is shown
+    else if (final != 'h' && final != 'l')
+      vt->unknown++;
+    return;
+  }
+
+  switch (final) {
+  case 'H':
+  case 'f':
+    vt->cy = params[0] ? params[0] - 1 : 0;
+    vt->cx = nparams > 1 && params[1] ? params[1] - 1 : 0;
+    break;
+  case 'A':
+    vt->cy -= n;
+    break;
+  case 'B':
+    vt->cy += n;
+    break;
+  case 'C':
+    vt->cx += n;
+    break;
+  case 'D':
+    vt->cx -= n;
+    break;
+  case 'J':
+    if (params[0] == 2) {
+      for (i = 0; i < rows; i++)
+        vtErase(vt, i, 0, cols);
+    } else if (params[0] == 0) {
+      vtErase(vt, vt->cy, vt->cx, cols);
+      for (i = vt->cy + 1; i < rows; i++)
+        vtErase(vt, i, 0, cols);
+    } else {
+      for (i = 0; i < vt->cy; i++)
+        vtErase(vt, i, 0, cols);
+      vtErase(vt, vt->cy, 0, vt->cx + 1);
+    }
+    break;
+  case 'm':
+    // foreground colors map back to the highlight class that uses them
+    for (i = 0; i < nparams; i++) {
+      int k;
+      for (k = 0; k < (int)(sizeof(HL_COLORS) / sizeof(HL_COLORS[0])); k++)
+        if (HL_COLORS[k] == params[i] || (params[i] == 0 && k == HL_NORMAL))
+          vt->hl = k;
+    }
+    break;
+  case 'r':
+    vt->top = params[0] ? params[0] - 1 : 0;
+    vt->bottom = nparams > 1 && params[1] && params[1] <= rows ? params[1]
+                                                                : rows;
+    if (vt->top >= vt->bottom - 1) {
+      vt->top = 0;
+      vt->bottom = rows;
+    }
+    vt->cx = 0;
+    vt->cy = 0;
+    break;
+  case 'S':
+    frameScroll(&vt->screen, vt->top, vt->bottom, n);
+    break;
+  case 'T':
+    frameScroll(&vt->screen, vt->top, vt->bottom, -n);
+    break;
+  case 'K':
+    if (params[0] == 0)
+      vtErase(vt, vt->cy, vt->cx, cols);
+    else if (params[0] == 1)
+      vtErase(vt, vt->cy, 0, vt->cx + 1);
+    else
+      vtErase(vt, vt->cy, 0, cols);
+    break;
+  default:
+    vt->unknown++;
+    break;
+  }
+
+  // cursor movement stops at the edges of the screen
+  if (vt->cy < 0)
+    vt->cy = 0;
+  if (vt->cy >= rows)
+    vt->cy = rows - 1;
+  if (vt->cx < 0)
+    vt->cx = 0;
+  if (vt->cx >= cols)
+    vt->cx = cols - 1;
+}
+
+void vtFeed(struct vterm *vt, const char *s, size_t len) {
+  /* Interprets output as a terminal would. Sequences may be split across
+   * calls.
+   *
+   * vt: the virtual terminal
+   * s: the output
+   * len: number of bytes of output
+   */
+  size_t i;
+  vt->bytes += len;
+  for (i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (vt->state == VT_ESC) {
+      vt->state = c == '[' ? VT_CSI : VT_GROUND;
+      vt->seqlen = 0;
+      if (c != '[')
+        vt->unknown++;
+    } else if (vt->state == VT_CSI) {
+      if (c >= 0x40 && c <= 0x7e) {
+        vtCsi(vt, c);
+        vt->state = VT_GROUND;
+      } else if (vt->seqlen < (int)sizeof(vt->seq)) {
+        vt->seq[vt->seqlen++] = c;
+      }
+    } else if (vt->need > 0 && (c & 0xc0) == 0x80) {
+      vt->seq[vt->seqlen++] = c;
+      if (--vt->need == 0)
+        vtPut(vt, vt->seq, vt->seqlen);
+    } else {
+      vt->need = 0;
+      if (c == '\x1b') {
+        vt->state = VT_ESC;
+      } else if (c == '\r') {
+        vt->cx = 0;
+        vt->wrap = 0;
+      } else if (c == '\n') {
+        vtLineFeed(vt);
+      } else if (c == '\b') {
+        if (vt->cx > 0)
+          vt->cx--;
+        vt->wrap = 0;
+      } else if (c >= 0xc0 && c < 0xf8) {
+        vt->seq[0] = c;
+        vt->seqlen = 1;
+        vt->need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+      } else if (c >= 32 && c != 127 && c < 0x80) {
+        vtPut(vt, &c, 1);
+      }
+    }
+  }
+}
+
+void vtDump(struct vterm *vt, FILE *fp) {
+  /* Prints the screen of a virtual terminal, without trailing blanks.
+   *
+   * vt: the virtual terminal
+   * fp: where to print it
+   */
+  int y, x;
+  for (y = 0; y < vt->screen.rows; y++) {
+    struct cell *row = &vt->screen.cells[y * vt->screen.cols];
+    int end = vt->screen.cols;
+    while (end > 0 && row[end - 1].len == 1 && row[end - 1].ch[0] == ' ')
+      end--;
+    for (x = 0; x < end; x++)
+      fwrite(row[x].ch, 1, row[x].len, fp);
+    fputc('\n', fp);
+  }
+}
+
+void editorWritev(struct iovec *iov, int n) {
+  /* Sends segments of output to the terminal, or to the virtual terminal in
+   * a headless run.
+   *
+   * iov: the segments
+   * n: number of segments
+   */
+  int i;
+  if (!E.headless)
+    outputWritev(iov, n);
+  else
+    for (i = 0; i < n; i++)
+      vtFeed(&E.vt, iov[i].iov_base, iov[i].iov_len);
+}
+
+void editorWrite(const char *s, size_t len) {
+  /* Sends output to the terminal, or to the virtual terminal in a headless
+   * run.
+   *
+   * s: the output
+   * len: number of bytes of output
+   */
+  struct iovec iov = {(char *)s, len};
+  editorWritev(&iov, 1);
+}
+
+/*** line index ***/
+
+size_t countNewlinesScalar(const char *p, size_t n) {
+  /* Counts newlines a word at a time with memchr doing the searching.
+   *
+   * p: bytes to scan
+   * n: number of bytes to scan
+   *
+   * Returns:
+   *  the number of '\n' bytes in p
+   */
+  size_t count = 0;
+  const char *end = p + n;
+  while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+    count++;
+    p++;
+  }
+  return count;
+}
+
+#ifdef TXT_X86
+size_t countNewlinesSSE2(const char *p, size_t n) {
+  /* SSE2 newline counter. Compare results (-1 per match) are subtracted into
+   * byte lanes for up to 255 blocks before being widened with psadbw.
+   */
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i zero = _mm_setzero_si128();
+  size_t count = 0;
+  size_t i = 0;
+  while (i + 16 <= n) {
+    __m128i acc = zero;
+    int blocks = 0;
+    for (; i + 16 <= n && blocks < 255; i += 16, blocks++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+    }
+    __m128i sums = _mm_sad_epu8(acc, zero);
+    count += _mm_cvtsi128_si32(sums) +
+             _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+  }
+  return count + countNewlinesScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t countNewlinesAVX2(const char *p,
+                                                         size_t n) {
+  /* AVX2 version of countNewlinesSSE2, 32 bytes per compare.
+   */
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0;
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i acc = zero;
+    int blocks = 0;
+    for (; i + 32 <= n && blocks < 255; i += 32, blocks++) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+    }
+    __m256i sums = _mm256_sad_epu8(acc, zero);
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + countNewlinesScalar(p + i, n - i);
+}
+#endif
+
+size_t countNewlines(const char *p, size_t n) {
+  /* Counts newlines with the widest vector unit the CPU has.
+   *
+   * p: bytes to scan
+   * n: number of bytes to scan
+   *
+   * Returns:
+   *  the number of '\n' bytes in p
+   */
+#ifdef TXT_X86
+  if (__builtin_cpu_supports("avx2"))
+    return countNewlinesAVX2(p, n);
+  return countNewlinesSSE2(p, n);
+#else
+  return countNewlinesScalar(p, n);
+#endif
+}
+
+const char *findNthNewline(const char *p, size_t n, size_t k) {
+  /* Finds the k-th newline in a range, skipping whole 4 KiB blocks with the
+   * vector counter and only walking the block that holds it.
+   *
+   * p: bytes to scan
+   * n: number of bytes to scan
+   * k: which newline to find, starting at 1
+   *
+   * Returns:
+   *  a pointer to the newline, NULL if the range has fewer than k
+   */
+  while (n > 0) {
+    size_t blk = n < 4096 ? n : 4096;
+    size_t c = countNewlines(p, blk);
+    if (c >= k) {
+      const char *hit = p - 1;
+      while (k--)
+        hit = memchr(hit + 1, '\n', p + blk - hit - 1);
+      return hit;
+    }
+    k -= c;
+    p += blk;
+    n -= blk;
+  }
+  return NULL;
+}
+
+void lineIndexInit(struct lineIndex *li, const char *buf, size_t len) {
+  /* Sets up an empty index over a buffer. Nothing is scanned yet.
+   *
+   * li: the index to initialize
+   * buf: the buffer to index, which must not change while indexed
+   * len: length of the buffer
+   */
+  li->buf = buf;
+  li->len = len;
+  li->total = (len + LINEIDX_CHUNK - 1) / LINEIDX_CHUNK;
+  li->cum = malloc((li->total + 1) * sizeof(size_t));
+  if (li->cum == NULL)
+    die("malloc");
+  li->cum[0] = 0;
+  li->nchunks = 0;
+  li->running = 0;
+  li->stop = 0;
+  pthread_mutex_init(&li->lock, NULL);
+}
+
+int lineIndexScanChunk(struct lineIndex *li) {
+  /* Indexes the next chunk of the buffer. The caller must hold the lock.
+   *
+   * li: the index to extend
+   *
+   * Returns:
+   *  1 if a chunk was scanned, 0 if the index was already complete
+   */
+  size_t i = li->nchunks;
+  if (i >= li->total)
+    return 0;
+  size_t start = i * LINEIDX_CHUNK;
+  size_t n = li->len - start < LINEIDX_CHUNK ? li->len - start : LINEIDX_CHUNK;
+  li->cum[i + 1] = li->cum[i] + countNewlines(li->buf + start, n);
+  li->nchunks = i + 1;
+  return 1;
+}
+
+void *lineIndexWorker(void *arg) {
+  /* Background thread body that indexes the rest of the buffer. The lock is
+   * dropped between chunks so the editor never waits on more than one.
+   *
+   * arg: the line index
+   */
+  struct lineIndex *li = arg;
+  while (1) {
+    pthread_mutex_lock(&li->lock);
+    int more = !li->stop && lineIndexScanChunk(li);
+    pthread_mutex_unlock(&li->lock);
+    if (!more)
+      break;
+  }
+  editorWake();
+  return NULL;
+}
+
+void lineIndexStart(struct lineIndex *li) {
+  /* Starts the background thread that completes the index.
+   *
+   * li: the index to complete
+   */
+  if (li->running || li->total == 0)
+    return;
+  li->stop = 0;
+  if (pthread_create(&li->worker, NULL, lineIndexWorker, li) == 0)
+    li->running = 1;
+}
+
+void lineIndexFree(struct lineIndex *li) {
+  /* Stops the background thread and frees the index.
+   *
+   * li: the index to free
+   */
+  if (li->running) {
+    pthread_mutex_lock(&li->lock);
+    li->stop = 1;
+    pthread_mutex_unlock(&li->lock);
+    pthread_join(li->worker, NULL);
+    li->running = 0;
+  }
+  pthread_mutex_destroy(&li->lock);
+  free(li->cum);
+  li->cum = NULL;
+}
+
+size_t lineIndexEnsure(struct lineIndex *li, size_t off) {
+  /* Makes sure the index covers a buffer offset, scanning only the chunks
+   * that are missing.
+   *
+   * li: the index to extend
+   * off: buffer offset that must be covered
+   *
+   * Returns:
+   *  the number of chunks indexed
+   */
+  pthread_mutex_lock(&li->lock);
+  while (li->nchunks * LINEIDX_CHUNK < off && lineIndexScanChunk(li))
+    ;
+  size_t n = li->nchunks;
+  pthread_mutex_unlock(&li->lock);
+  return n;
+}
+
+int lineIndexCovers(struct lineIndex *li, size_t off) {
+  /* Returns:
+   *  1 if newlines up to off can be counted without scanning new chunks
+   */
+  pthread_mutex_lock(&li->lock);
+  int covered = li->nchunks * LINEIDX_CHUNK >= off || li->nchunks == li->total;
+  pthread_mutex_unlock(&li->lock);
+  return covered;
+}
+
+size_t lineIndexCount(struct lineIndex *li, size_t start, size_t end) {
+  /* Counts the newlines in a range of the buffer, using whole chunk totals
+   * for everything but the partial chunks at either end.
+   *
+   * li: the index to use
+   * start: first buffer offset of the range
+   * end: buffer offset one past the range
+   *
+   * Returns:
+   *  the number of newlines in [start, end)
+   */
+  size_t first = start / LINEIDX_CHUNK + 1;
+  size_t last = end / LINEIDX_CHUNK;
+  if (first > last)
+    return countNewlines(li->buf + start, end - start);
+
+  lineIndexEnsure(li, last * LINEIDX_CHUNK);
+  return countNewlines(li->buf + start, first * LINEIDX_CHUNK - start) +
+         (li->cum[last] - li->cum[first]) +
+         countNewlines(li->buf + last * LINEIDX_CHUNK,
+                       end - last * LINEIDX_CHUNK);
+}
+
+int lineIndexNth(struct lineIndex *li, size_t start, size_t end, size_t k,
+                 size_t *pos) {
+  /* Finds the k-th newline in a range of the buffer. Chunks are only scanned
+   * as far as needed to reach it.
+   *
+   * li: the index to use
+   * start: first buffer offset of the range
+   * end: buffer offset one past the range
+   * k: which newline to find, starting at 1
+   * pos: receives the buffer offset of the newline
+   *
+   * Returns:
+   *  0 if found, -1 if the range has fewer than k newlines
+   */
+  size_t c0 = start / LINEIDX_CHUNK;
+  size_t c0start = c0 * LINEIDX_CHUNK;
+  size_t c0end = c0start + LINEIDX_CHUNK < end ? c0start + LINEIDX_CHUNK : end;
+
+  // the first, partial chunk is searched directly
+  const char *hit = findNthNewline(li->buf + start, c0end - start, k);
+  if (hit) {
+    *pos = hit - li->buf;
+    return 0;
+  }
+  if (c0end == end)
+    return -1;
+
+  // the newline we want is the target-th of the buffer
+  lineIndexEnsure(li, c0start);
+  size_t target =
+      li->cum[c0] + countNewlines(li->buf + c0start, start - c0start) + k;
+
+  // extend the index until it holds target newlines or passes the range
+  pthread_mutex_lock(&li->lock);
+  while (li->cum[li->nchunks] < target &&
+         li->nchunks * LINEIDX_CHUNK < end && lineIndexScanChunk(li))
+    ;
+  size_t n = li->nchunks;
+  pthread_mutex_unlock(&li->lock);
+  if (li->cum[n] < target)
+    return -1;
+
+  // binary search for the chunk where the count reaches target
+  size_t lo = c0 + 1, hi = n - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (li->cum[mid + 1] >= target)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  size_t cstart = lo * LINEIDX_CHUNK;
+  size_t clen = li->len - cstart < LINEIDX_CHUNK ? li->len - cstart
+                                                 : LINEIDX_CHUNK;
+  hit = findNthNewline(li->buf + cstart, clen, target - li->cum[lo]);
+  if (hit == NULL || (size_t)(hit - li->buf) >= end)
+    return -1;
+  *pos = hit - li->buf;
+  return 0;
+}
+
+/*** piece table ***/
+
+void ptUpdate(struct pieceNode *t) {
+  /* Recomputes the subtree totals of a node from its children.
+   *
+   * t: the node to update
+   */
+  t->size = t->p.len;
+  t->lfsum = t->lfknown ? t->lf : 0;
+  t->unknown = t->lfknown ? 0 : 1;
+  if (t->left) {
+    t->size += t->left->size;
+    t->lfsum += t->left->lfsum;
+    t->unknown += t->left->unknown;
+  }
+  if (t->right) {
+    t->size += t->right->size;
+    t->lfsum += t->right->lfsum;
+    t->unknown += t->right->unknown;
+  }
+}
+
+void ptCountLines(struct pieceTable *pt, struct pieceNode *n) {
+  /* Counts the newlines of a piece. Pieces of the original buffer are only
+   * counted once the line index reaches their end.
+   *
+   * pt: the piece table the node belongs to
+   * n: the node to count
+   */
+  size_t end = n->p.start + n->p.len;
+  if (n->p.buf == PIECE_ADD) {
+    n->lf = countNewlines(pt->add + n->p.start, n->p.len);
+    n->lfknown = 1;
+  } else if (lineIndexCovers(pt->idx, end)) {
+    n->lf = lineIndexCount(pt->idx, n->p.start, end);
+    n->lfknown = 1;
+  } else {
+    n->lf = 0;
+    n->lfknown = 0;
+  }
+}
+
+struct pieceNode *ptNewNode(struct pieceTable *pt, int buf, size_t start,
+                            size_t len) {
+  /* Allocates a new leaf node for the piece tree.
+   *
+   * pt: the piece table the node belongs to
+   * buf: the backing buffer of the piece (PIECE_ORIG or PIECE_ADD)
+   * start: offset of the piece in its backing buffer
+   * len: length of the piece in bytes
+   *
+   * Returns:
+   *  the new node
+   */
+  struct pieceNode *n = malloc(sizeof(struct pieceNode));
+  if (n == NULL)
+    die("malloc");
+
+  // xorshift keeps the treap priorities cheap and reproducible
+  pt->seed ^= pt->seed << 13;
+  pt->seed ^= pt->seed >> 17;
+  pt->seed ^= pt->seed << 5;
+
+  n->p.buf = buf;
+  n->p.start = start;
+  n->p.len = len;
+  n->prio = pt->seed;
+  n->left = NULL;
+  n->right = NULL;
+  ptCountLines(pt, n);
+  ptUpdate(n);
+  pt->npieces++;
+  return n;
+}
+
+struct pieceNode *ptMerge(struct pieceNode *a, struct pieceNode *b) {
+  /* Concatenates two piece trees, every piece of a coming before b.
+   *
+   * a: the left tree
+   * b: the right tree
+   *
+   * Returns:
+   *  the root of the merged tree
+   */
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->prio > b->prio) {
+    a->right = ptMerge(a->right, b);
+    ptUpdate(a);
+    return a;
+  }
+  b->left = ptMerge(a, b->left);
+  ptUpdate(b);
+  return b;
+}
+
+void ptSplit(struct pieceTable *pt, struct pieceNode *t, size_t off,
+             struct pieceNode **l, struct pieceNode **r) {
+  /* Splits a piece tree at a document offset, cutting the piece that straddles
+   * the offset in two.
+   *
+   * pt: the piece table that owns the tree
+   * t: the tree to split
+   * off: offset relative to the start of t
+   * l: receives the tree holding the bytes before off
+   * r: receives the tree holding the bytes from off onwards
+   */
+  if (t == NULL) {
+    *l = NULL;
+    *r = NULL;
+    return;
+  }
+
+  size_t lsize = t->left ? t->left->size : 0;
+  if (off <= lsize) {
+    ptSplit(pt, t->left, off, l, &t->left);
+    ptUpdate(t);
+    *r = t;
+  } else if (off >= lsize + t->p.len) {
+    ptSplit(pt, t->right, off - lsize - t->p.len, &t->right, r);
+    ptUpdate(t);
+    *l = t;
+  } else {
+    size_t cut = off - lsize;
+    struct pieceNode *tail =
+        ptNewNode(pt, t->p.buf, t->p.start + cut, t->p.len - cut);
+    struct pieceNode *right = t->right;
+
+    t->p.len = cut;
+    if (t->lfknown && tail->lfknown)
+      t->lf -= tail->lf;
+    else
+      ptCountLines(pt, t);
+    t->right = NULL;
+    ptUpdate(t);
+    *l = t;
+    *r = ptMerge(tail, right);
+  }
+}
+
+void ptFreeTree(struct pieceTable *pt, struct pieceNode *t) {
+  /* Frees every node of a piece tree.
+   *
+   * pt: the piece table that owns the tree
+   * t: root of the tree to free
+   */
+  if (t == NULL)
+    return;
+  ptFreeTree(pt, t->left);
+  ptFreeTree(pt, t->right);
+  free(t);
+  pt->npieces--;
+}
+
+void ptInit(struct pieceTable *pt, const char *orig, size_t origlen,
+            struct lineIndex *idx) {
+  /* Initializes a piece table over a read-only original buffer. The buffer is
+   * not copied and must outlive the piece table.
+   *
+   * pt: the piece table to initialize
+   * orig: the original document contents, may be NULL if origlen is 0
+   * origlen: length of the original buffer
+   * idx: line index over orig, may be NULL if origlen is 0
+   */
+  pt->orig = orig;
+  pt->origlen = origlen;
+  pt->idx = idx;
+  pt->add = NULL;
+  pt->addlen = 0;
+  pt->addcap = 0;
+  pt->root = NULL;
+  pt->npieces = 0;
+  pt->seed = 2463534242u;
+  if (origlen > 0)
+    pt->root = ptNewNode(pt, PIECE_ORIG, 0, origlen);
+}
+
+void ptFree(struct pieceTable *pt) {
+  /* Frees the piece tree and the add buffer. The original buffer belongs to
+   * whoever passed it to ptInit.
+   *
+   * pt: the piece table to free
+   */
+  ptFreeTree(pt, pt->root);
+  free(pt->add);
+  pt->root = NULL;
+  pt->add = NULL;
+  pt->addlen = 0;
+  pt->addcap = 0;
+}
+
+size_t ptLength(struct pieceTable *pt) {
+  /* Returns:
+   *  the length of the document in bytes
+   */
+  return pt->root ? pt->root->size : 0;
+}
+
+size_t ptSpan(struct pieceTable *pt, size_t off, const char **p) {
+  /* Finds the contiguous run of bytes stored at a document offset. The pointer
+   * is only valid until the next insert.
+   *
+   * pt: the piece table to read
+   * off: document offset to look up
+   * p: receives a pointer to the byte at off
+   *
+   * Returns:
+   *  the number of bytes readable from *p, 0 if off is at or past the end
+   */
+  struct pieceNode *t = pt->root;
+  while (t) {
+    size_t lsize = t->left ? t->left->size : 0;
+    if (off < lsize) {
+      t = t->left;
+      continue;
+    }
+    off -= lsize;
+    if (off < t->p.len) {
+      const char *base = t->p.buf == PIECE_ORIG ? pt->orig : pt->add;
+      *p = base + t->p.start + off;
+      return t->p.len - off;
+    }
+    off -= t->p.len;
+    t = t->right;
+  }
+  return 0;
+}
+
+size_t ptRead(struct pieceTable *pt, size_t off, char *buf, size_t len) {
+  /* Copies a range of the document into a buffer.
+   *
+   * pt: the piece table to read
+   * off: document offset to start reading at
+   * buf: destination buffer
+   * len: maximum number of bytes to copy
+   *
+   * Returns:
+   *  the number of bytes copied
+   */
+  size_t done = 0;
+  while (done < len) {
+    const char *p;
+    size_t n = ptSpan(pt, off + done, &p);
+    if (n == 0)
+      break;
+    if (n > len - done)
+      n = len - done;
+    memcpy(buf + done, p, n);
+    done += n;
+  }
+  return done;
+}
+
+size_t ptFindByte(struct pieceTable *pt, size_t off, int c) {
+  /* Finds the next occurrence of a byte at or after a document offset.
+   *
+   * pt: the piece table to search
+   * off: document offset to start searching at
+   * c: the byte to look for
+   *
+   * Returns:
+   *  the offset of the byte, or the document length if there is none
+   */
+  const char *p;
+  size_t n;
+  while ((n = ptSpan(pt, off, &p)) > 0) {
+    const char *hit = memchr(p, c, n);
+    if (hit)
+      return off + (hit - p);
+    off += n;
+  }
+  return off;
+}
+
+void ptAppendAdd(struct pieceTable *pt, const char *s, size_t len) {
+  /* Appends bytes to the add buffer, growing it geometrically.
+   *
+   * pt: the piece table to append to
+   * s: the bytes to append
+   * len: number of bytes to append
+   */
+  if (pt->addlen + len > pt->addcap) {
+    size_t cap = pt->addcap ? pt->addcap : 4096;
+    while (cap < pt->addlen + len)
+      cap *= 2;
+    // a save may be copying out of the buffer
+    pthread_mutex_lock(&E.save.lock);
+    char *new = realloc(pt->add, cap);
+    if (new == NULL)
+      die("realloc");
+    pt->add = new;
+    pt->addcap = cap;
+    pthread_mutex_unlock(&E.save.lock);
+  }
+  memcpy(&pt->add[pt->addlen], s, len);
+  pt->addlen += len;
+}
+
+void ptExtendLast(struct pieceNode *t, size_t len, size_t lf) {
+  /* Grows the last piece of a tree in place, fixing up subtree totals on the
+   * way down the right spine.
+   *
+   * t: root of the tree
+   * len: number of bytes to add to the last piece
+   * lf: number of newlines in the added bytes
+   */
+  while (t) {
+    t->size += len;
+    t->lfsum += lf;
+    if (t->right == NULL) {
+      t->p.len += len;
+      t->lf += lf;
+    }
+    t = t->right;
+  }
+}
+
+void ptInsert(struct pieceTable *pt, size_t off, const char *s, size_t len) {
+  /* Inserts bytes into the document.
+   *
+   * pt: the piece table to modify
+   * off: document offset to insert at, clamped to the document length
+   * s: the bytes to insert
+   * len: number of bytes to insert
+   */
+  if (len == 0)
+    return;
+  if (off > ptLength(pt))
+    off = ptLength(pt);
+
+  size_t addoff = pt->addlen;
+  ptAppendAdd(pt, s, len);
+
+  struct pieceNode *l, *r;
+  ptSplit(pt, pt->root, off, &l, &r);
+
+  // consecutive typing lands right after the previous insert, so grow that
+  // piece rather than adding one piece per keystroke
+  struct pieceNode *last = l;
+  while (last && last->right)
+    last = last->right;
+  if (last && last->p.buf == PIECE_ADD &&
+      last->p.start + last->p.len == addoff) {
+    ptExtendLast(l, len, countNewlines(s, len));
+  } else {
+    l = ptMerge(l, ptNewNode(pt, PIECE_ADD, addoff, len));
+  }
+  pt->root = ptMerge(l, r);
+}
+
+void ptDelete(struct pieceTable *pt, size_t off, size_t len) {
+  /* Removes a range of bytes from the document. The backing buffers are left
+   * untouched.
+   *
+   * pt: the piece table to modify
+   * off: document offset of the first byte to remove
+   * len: number of bytes to remove
+   */
+  if (len == 0 || off >= ptLength(pt))
+    return;
+
+  struct pieceNode *l, *m, *r;
+  ptSplit(pt, pt->root, off, &l, &r);
+  ptSplit(pt, r, len, &m, &r);
+  ptFreeTree(pt, m);
+  pt->root = ptMerge(l, r);
+}
+
+int ptSeekNewline(struct pieceTable *pt, struct pieceNode *t, size_t base,
+                  size_t *k, size_t *off) {
+  /* Finds the k-th newline of a subtree. Subtrees whose newline count is
+   * already known are skipped whole; pieces of the original that have not
+   * been indexed yet are indexed just far enough to answer, and their counts
+   * are filled in on the way back up.
+   *
+   * pt: the piece table that owns the tree
+   * t: root of the subtree to search
+   * base: document offset of the first byte of the subtree
+   * k: which newline to find, starting at 1; decremented by the newlines
+   *    skipped when the subtree does not hold it
+   * off: receives the document offset of the newline
+   *
+   * Returns:
+   *  1 if found, 0 if not
+   */
+  if (t == NULL)
+    return 0;
+
+  size_t lsize = t->left ? t->left->size : 0;
+  if (t->left) {
+    if (t->left->unknown == 0 && t->left->lfsum < *k) {
+      *k -= t->left->lfsum;
+    } else {
+      int found = ptSeekNewline(pt, t->left, base, k, off);
+      ptUpdate(t);
+      if (found)
+        return 1;
+    }
+  }
+
+  if (t->lfknown && t->lf < *k) {
+    *k -= t->lf;
+  } else {
+    size_t pos;
+    int found;
+    if (t->p.buf == PIECE_ADD) {
+      const char *hit = findNthNewline(pt->add + t->p.start, t->p.len, *k);
+      found = hit != NULL;
+      pos = found ? (size_t)(hit - pt->add) : 0;
+    } else {
+      found = lineIndexNth(pt->idx, t->p.start, t->p.start + t->p.len, *k,
+                           &pos) == 0;
+    }
+    if (found) {
+      *off = base + lsize + (pos - t->p.start);
+      return 1;
+    }
+
+    // the piece has fewer than k newlines; a search that ended within its
+    // first chunk didn't index it, so make sure the count is known
+    if (!t->lfknown) {
+      lineIndexEnsure(pt->idx, t->p.start + t->p.len);
+      ptCountLines(pt, t);
+      ptUpdate(t);
+    }
+    *k -= t->lf;
+  }
+
+  if (t->right) {
+    int found = ptSeekNewline(pt, t->right, base + lsize + t->p.len, k, off);
+    ptUpdate(t);
+    return found;
+  }
+  return 0;
+}
+
+int ptLineStart(struct pieceTable *pt, int line, size_t *off) {
+  /* Finds where a line begins.
+   *
+   * pt: the piece table to search
+   * line: zero based line number
+   * off: receives the document offset of the first byte of the line
+   *
+   * Returns:
+   *  0 if the document has at least line newlines, -1 if not
+   */
+  if (line <= 0) {
+    *off = 0;
+    return 0;
+  }
+
+  size_t k = line;
+  size_t pos;
+  if (!ptSeekNewline(pt, pt->root, 0, &k, &pos))
+    return -1;
+  *off = pos + 1;
+  return 0;
+}
+
+size_t ptCountAll(struct pieceTable *pt, struct pieceNode *t) {
+  /* Counts the newlines of a subtree, indexing original pieces whose count
+   * isn't known yet.
+   *
+   * pt: the piece table that owns the tree
+   * t: root of the subtree
+   *
+   * Returns:
+   *  the number of newlines in the subtree
+   */
+  if (t == NULL || t->unknown == 0)
+    return t ? t->lfsum : 0;
+  ptCountAll(pt, t->left);
+  if (!t->lfknown) {
+    lineIndexEnsure(pt->idx, t->p.start + t->p.len);
+    ptCountLines(pt, t);
+  }
+  ptCountAll(pt, t->right);
+  ptUpdate(t);
+  return t->lfsum;
+}
+
+size_t ptCountBefore(struct pieceTable *pt, struct pieceNode *t, size_t off) {
+  /* Counts the newlines of a subtree in front of an offset into it. Only the
+   * piece holding the offset is scanned; everything before it is counted
+   * from the subtree totals.
+   *
+   * pt: the piece table that owns the tree
+   * t: root of the subtree
+   * off: offset from the start of the subtree
+   *
+   * Returns:
+   *  the number of newlines before off
+   */
+  if (t == NULL)
+    return 0;
+  size_t lsize = t->left ? t->left->size : 0;
+  size_t n;
+  if (off <= lsize) {
+    n = ptCountBefore(pt, t->left, off);
+  } else if (off - lsize <= t->p.len) {
+    size_t in = off - lsize;
+    n = ptCountAll(pt, t->left);
+    if (t->p.buf == PIECE_ADD)
+      n += countNewlines(pt->add + t->p.start, in);
+    else
+      n += lineIndexCount(pt->idx, t->p.start, t->p.start + in);
+  } else {
+    n = ptCountAll(pt, t->left);
+    if (!t->lfknown) {
+      lineIndexEnsure(pt->idx, t->p.start + t->p.len);
+      ptCountLines(pt, t);
+    }
+    n += t->lf + ptCountBefore(pt, t->right, off - lsize - t->p.len);
+  }
+  ptUpdate(t);
+  return n;
+}
+
+/*** row store ***/
+
+void rowsFree(struct rowStore *rs) {
+  /* Frees the arena and the row arrays.
+   *
+   * rs: the row store to free
+   */
+  free(rs->arena);
+  free(rs->off);
+  free(rs->len);
+  free(rs->cap);
+  free(rs->gap);
+  free(rs->rlen);
+  free(rs->dirty);
+  free(rs->start);
+  free(rs->hl);
+  memset(rs, 0, sizeof(struct rowStore));
+}
+
+void rowsMarkEdited(struct rowStore *rs, int r) {
+  /* Records that a row changed, so the highlighter re-lexes from it.
+   *
+   * rs: the row store
+   * r: the row
+   */
+  if (rs->hleditend < rs->hledit) {
+    rs->hledit = rs->hleditend = r;
+    return;
+  }
+  if (r < rs->hledit)
+    rs->hledit = r;
+  if (r > rs->hleditend)
+    rs->hleditend = r;
+}
+
+void *rowsGrowArray(void *a, size_t size, int n) {
+  /* Resizes one of the row arrays.
+   */
+  void *new = realloc(a, size * n);
+  if (new == NULL)
+    die("realloc");
+  return new;
+}
+
+size_t rowsArenaAlloc(struct rowStore *rs, int cap) {
+  /* Carves storage for a row off the end of the arena, growing it
+   * geometrically.
+   *
+   * rs: the row store
+   * cap: bytes of storage needed
+   *
+   * Returns:
+   *  the arena offset of the storage
+   */
+  if (rs->arenalen + cap > rs->arenacap) {
+    size_t newcap = rs->arenacap ? rs->arenacap : 4096;
+    while (newcap < rs->arenalen + cap)
+      newcap *= 2;
+    char *new = realloc(rs->arena, newcap);
+    if (new == NULL)
+      die("realloc");
+    rs->arena = new;
+    rs->arenacap = newcap;
+  }
+  size_t off = rs->arenalen;
+  rs->arenalen += cap;
+  return off;
+}
+
+void rowsCompact(struct rowStore *rs) {
+  /* Rebuilds the arena with the rows back in order and the storage of
+   * relocated rows reclaimed.
+   *
+   * rs: the row store to compact
+   */
+  char *old = rs->arena;
+  rs->arena = NULL;
+  rs->arenalen = 0;
+  rs->arenacap = 0;
+  rs->garbage = 0;
+
+  int r;
+  for (r = 0; r < rs->numrows; r++) {
+    size_t off = rowsArenaAlloc(rs, rs->cap[r]);
+    memcpy(rs->arena + off, old + rs->off[r], rs->cap[r]);
+    rs->off[r] = off;
+  }
+  free(old);
+}
+
+void rowsInsertRows(struct rowStore *rs, int at, int n) {
+  /* Opens up n empty rows in the row arrays.
+   *
+   * rs: the row store
+   * at: index the first new row gets
+   * n: number of rows to add
+   */
+  if (rs->numrows + n > rs->rowcap) {
+    int cap = rs->rowcap ? rs->rowcap : 64;
+    while (cap < rs->numrows + n)
+      cap *= 2;
+    rs->off = rowsGrowArray(rs->off, sizeof(size_t), cap);
+    rs->len = rowsGrowArray(rs->len, sizeof(int), cap);
+    rs->cap = rowsGrowArray(rs->cap, sizeof(int), cap);
+    rs->gap = rowsGrowArray(rs->gap, sizeof(int), cap);
+    rs->rlen = rowsGrowArray(rs->rlen, sizeof(int), cap);
+    rs->dirty = rowsGrowArray(rs->dirty, 1, cap);
+    rs->start = rowsGrowArray(rs->start, sizeof(size_t), cap);
+    rs->hl = rowsGrowArray(rs->hl, 1, cap);
+    rs->rowcap = cap;
+  }
+
+  int move = rs->numrows - at;
+  memmove(&rs->off[at + n], &rs->off[at], sizeof(size_t) * move);
+  memmove(&rs->len[at + n], &rs->len[at], sizeof(int) * move);
+  memmove(&rs->cap[at + n], &rs->cap[at], sizeof(int) * move);
+  memmove(&rs->gap[at + n], &rs->gap[at], sizeof(int) * move);
+  memmove(&rs->rlen[at + n], &rs->rlen[at], sizeof(int) * move);
+  memmove(&rs->dirty[at + n], &rs->dirty[at], move);
+  memmove(&rs->hl[at + n], &rs->hl[at], move);
+
+  int r;
+  for (r = at; r < at + n; r++) {
+    rs->off[r] = rs->arenalen;
+    rs->len[r] = 0;
+    rs->cap[r] = 0;
+    rs->gap[r] = 0;
+    rs->rlen[r] = 0;
+    rs->dirty[r] = 0;
+  }
+  rs->numrows += n;
+  if (rs->startvalid > at + 1)
+    rs->startvalid = at + 1;
+  if (rs->startvalid < 1)
+    rs->startvalid = 1;
+  rs->start[0] = 0;
+
+  // lexer states past the new rows move along with their rows, and the new
+  // rows get theirs from the row before them
+  if (rs->hlvalid > at)
+    rs->hlvalid += n;
+  if (rs->hlvalid < 1)
+    rs->hlvalid = 1;
+  rs->hl[0] = LEX_NORMAL;
+  if (rs->hleditend >= rs->hledit) {
+    if (rs->hledit >= at)
+      rs->hledit += n;
+    if (rs->hleditend >= at)
+      rs->hleditend += n;
+  }
+  rowsMarkEdited(rs, at > 0 ? at - 1 : 0);
+  rowsMarkEdited(rs, at + n - 1);
+}
+
+void rowsInit(struct rowStore *rs) {
+  /* Initializes an empty row store holding one empty row, which is what an
+   * empty document looks like.
+   *
+   * rs: the row store to initialize
+   */
+  memset(rs, 0, sizeof(struct rowStore));
+  rowsInsertRows(rs, 0, 1);
+}
+
+void rowsDeleteRows(struct rowStore *rs, int at, int n) {
+  /* Removes n rows from the row arrays. Their storage becomes garbage.
+   *
+   * rs: the row store
+   * at: index of the first row to remove
+   * n: number of rows to remove
+   */
+  int r;
+  for (r = at; r < at + n; r++)
+    rs->garbage += rs->cap[r];
+
+  int move = rs->numrows - at - n;
+  memmove(&rs->off[at], &rs->off[at + n], sizeof(size_t) * move);
+  memmove(&rs->len[at], &rs->len[at + n], sizeof(int) * move);
+  memmove(&rs->cap[at], &rs->cap[at + n], sizeof(int) * move);
+  memmove(&rs->gap[at], &rs->gap[at + n], sizeof(int) * move);
+  memmove(&rs->rlen[at], &rs->rlen[at + n], sizeof(int) * move);
+  memmove(&rs->dirty[at], &rs->dirty[at + n], move);
+  memmove(&rs->hl[at], &rs->hl[at + n], move);
+  rs->numrows -= n;
+  if (rs->startvalid > at + 1)
+    rs->startvalid = at + 1;
+
+  if (rs->hlvalid > at + n)
+    rs->hlvalid -= n;
+  else if (rs->hlvalid > at)
+    rs->hlvalid = at;
+  if (rs->hleditend >= rs->hledit) {
+    if (rs->hledit >= at + n)
+      rs->hledit -= n;
+    else if (rs->hledit >= at)
+      rs->hledit = at - 1;
+    if (rs->hleditend >= at + n)
+      rs->hleditend -= n;
+    else if (rs->hleditend >= at)
+      rs->hleditend = at - 1;
+  }
+  rowsMarkEdited(rs, at - 1);
+}
+
+void rowsMoveGap(struct rowStore *rs, int r, int pos) {
+  /* Moves a row's gap so it starts at pos. Only the bytes between the old and
+   * the new position move, so typing in one place moves nothing.
+   *
+   * rs: the row store
+   * r: the row
+   * pos: byte offset in the row the gap should start at
+   */
+  char *b = rs->arena + rs->off[r];
+  int g = rs->gap[r];
+  int glen = rs->cap[r] - rs->len[r];
+  if (pos < g)
+    memmove(b + pos + glen, b + pos, g - pos);
+  else if (pos > g)
+    memmove(b + g, b + g + glen, pos - g);
+  rs->gap[r] = pos;
+}
+
+void rowsReserve(struct rowStore *rs, int r, int extra) {
+  /* Makes sure a row's gap can take more bytes. A row that is out of room is
+   * moved to the end of the arena with twice the storage; the arena is
+   * compacted once more than half of it is left behind by such moves.
+   *
+   * rs: the row store
+   * r: the row
+   * extra: number of bytes about to be inserted
+   */
+  if (rs->cap[r] - rs->len[r] >= extra)
+    return;
+
+  int cap = rs->cap[r] * 2;
+  if (cap < rs->len[r] + extra)
+    cap = rs->len[r] + extra;
+  if (cap < 16)
+    cap = 16;
+
+  if (rs->garbage > (1 << 20) && rs->garbage > rs->arenalen / 2)
+    rowsCompact(rs);
+
+  size_t off = rowsArenaAlloc(rs, cap);
+  char *old = rs->arena + rs->off[r];
+  char *new = rs->arena + off;
+  int g = rs->gap[r];
+  int post = rs->len[r] - g;
+  memcpy(new, old, g);
+  memcpy(new + cap - post, old + rs->cap[r] - post, post);
+
+  rs->garbage += rs->cap[r];
+  rs->off[r] = off;
+  rs->cap[r] = cap;
+}
+
+void rowsInsertText(struct rowStore *rs, int r, int col, const char *s,
+                    int len) {
+  /* Inserts text without newlines into a row through its gap.
+   *
+   * rs: the row store
+   * r: the row
+   * col: byte offset in the row to insert at
+   * s: the text
+   * len: length of the text
+   */
+  if (len == 0)
+    return;
+  rowsReserve(rs, r, len);
+  rowsMoveGap(rs, r, col);
+  memcpy(rs->arena + rs->off[r] + col, s, len);
+  rs->gap[r] += len;
+  rs->len[r] += len;
+  rs->bytes += len;
+  rs->dirty[r] = 1;
+  if (rs->startvalid > r + 1)
+    rs->startvalid = r + 1;
+  rowsMarkEdited(rs, r);
+}
+
+void rowsDeleteText(struct rowStore *rs, int r, int col, int len) {
+  /* Removes bytes from a row by widening its gap over them.
+   *
+   * rs: the row store
+   * r: the row
+   * col: byte offset in the row of the first byte to remove
+   * len: number of bytes to remove
+   */
+  if (len == 0)
+    return;
+  rowsMoveGap(rs, r, col);
+  rs->len[r] -= len;
+  rs->bytes -= len;
+  rs->dirty[r] = 1;
+  if (rs->startvalid > r + 1)
+    rs->startvalid = r + 1;
+  rowsMarkEdited(rs, r);
+}
+
+int rowsCopy(struct rowStore *rs, int r, int col, char *out, int len) {
+  /* Copies bytes of a row out from either side of its gap.
+   *
+   * rs: the row store
+   * r: the row
+   * col: byte offset in the row to start at
+   * out: destination buffer
+   * len: maximum number of bytes to copy
+   *
+   * Returns:
+   *  the number of bytes copied
+   */
+  const char *b = rs->arena + rs->off[r];
+  int g = rs->gap[r];
+  int glen = rs->cap[r] - rs->len[r];
+  int n = 0;
+  if (len > rs->len[r] - col)
+    len = rs->len[r] - col;
+  if (col < g) {
+    n = g - col < len ? g - col : len;
+    memcpy(out, b + col, n);
+  }
+  if (n < len)
+    memcpy(out + n, b + glen + col + n, len - n);
+  return len;
+}
+
+size_t rowsLength(struct rowStore *rs) {
+  /* Returns:
+   *  the length of the document in bytes, counting the newline between
+   *  every pair of rows
+   */
+  return rs->bytes + rs->numrows - 1;
+}
+
+int rowsFind(struct rowStore *rs, size_t off, int *col) {
+  /* Finds the row holding a document offset. Row starts are cached and only
+   * recomputed past the last edited row, as far as the lookup needs.
+   *
+   * rs: the row store
+   * off: document offset, at most the document length
+   * col: receives the byte offset within the row
+   *
+   * Returns:
+   *  the row
+   */
+  int v = rs->startvalid;
+  while (v < rs->numrows && rs->start[v - 1] + rs->len[v - 1] < off) {
+    rs->start[v] = rs->start[v - 1] + rs->len[v - 1] + 1;
+    v++;
+  }
+  rs->startvalid = v;
+
+  int lo = 0, hi = v - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (rs->start[mid] <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  *col = off - rs->start[lo];
+  return lo;
+}
+
+int rowsLineStart(struct rowStore *rs, int line, size_t *off) {
+  /* Finds where a line begins.
+   *
+   * rs: the row store
+   * line: zero based line number
+   * off: receives the document offset of the first byte of the line
+   *
+   * Returns:
+   *  0 if the line exists, -1 if not
+   */
+  if (line < 0 || line >= rs->numrows)
+    return -1;
+  int v = rs->startvalid;
+  while (v <= line) {
+    rs->start[v] = rs->start[v - 1] + rs->len[v - 1] + 1;
+    v++;
+  }
+  rs->startvalid = v;
+  *off = rs->start[line];
+  return 0;
+}
+
+size_t rowsRead(struct rowStore *rs, size_t off, char *buf, size_t len) {
+  /* Copies a range of the document out of the rows, looking up only the
+   * first row and walking on from there.
+   *
+   * rs: the row store
+   * off: document offset to start reading at
+   * buf: destination buffer
+   * len: maximum number of bytes to copy
+   *
+   * Returns:
+   *  the number of bytes copied
+   */
+  size_t total = rowsLength(rs);
+  if (off >= total)
+    return 0;
+  if (len > total - off)
+    len = total - off;
+  int col;
+  int r = rowsFind(rs, off, &col);
+  size_t done = 0;
+  while (done < len) {
+    size_t want = len - done;
+    done += rowsCopy(rs, r, col, buf + done, want < INT_MAX ? want : INT_MAX);
+    if (done < len && (size_t)col + want > (size_t)rs->len[r])
+      buf[done++] = '\n';
+    r++;
+    col = 0;
+  }
+  return len;
+}
+
+size_t rowsSpan(struct rowStore *rs, size_t off, const char **p) {
+  /* Finds the contiguous run of bytes stored at a document offset: one side
+   * of a row's gap, or the newline after a row.
+   *
+   * rs: the row store
+   * off: document offset to look up
+   * p: receives a pointer to the byte at off
+   *
+   * Returns:
+   *  the number of bytes readable from *p, 0 if off is at or past the end
+   */
+  if (off >= rowsLength(rs))
+    return 0;
+  int col;
+  int r = rowsFind(rs, off, &col);
+  const char *b = rs->arena + rs->off[r];
+  int g = rs->gap[r];
+  if (col < g) {
+    *p = b + col;
+    return g - col;
+  }
+  if (col < rs->len[r]) {
+    *p = b + (rs->cap[r] - rs->len[r]) + col;
+    return rs->len[r] - col;
+  }
+  *p = "\n";
+  return 1;
+}
+
+int rowsRenderLen(struct rowStore *rs, int r) {
+  /* Returns:
+   *  the number of screen columns a row takes, cached until it is edited
+   */
+  if (rs->dirty[r]) {
+    const char *b = rs->arena + rs->off[r];
+    int len = rs->len[r];
+    int g = rs->gap[r];
+    int glen = rs->cap[r] - len;
+    size_t col = 0;
+    int i = 0;
+    while (i < len) {
+      // the text either side of the gap, a run of printable ASCII at a time
+      const char *p = i < g ? b + i : b + glen + i;
+      int n = i < g ? g - i : len - i;
+      int k = asciiSpan(p, n);
+      col += k;
+      i += k;
+      if (k == n)
+        continue;
+      int cp;
+      if (n - k < 4 && i < g) {
+        // a character the gap splits is copied out whole
+        char buf[4];
+        int m = len - i < 4 ? len - i : 4;
+        rowsCopy(rs, r, i, buf, m);
+        i += charDecode(buf, m, &cp);
+      } else {
+        i += charDecode(p + k, n - k, &cp);
+      }
+      col += charColumns(cp, col);
+    }
+    rs->rlen[r] = col;
+    rs->dirty[r] = 0;
+  }
+  return rs->rlen[r];
+}
+
+int wrapBreaks(size_t col, int w, size_t start, size_t width) {
+  /* The rule wrapped lines are broken into screen rows by, as terminals
+   * break text: a character that doesn't fit in what is left of a row
+   * starts the next one, unless it is the first on its row and wider than
+   * the whole screen. The end of a line is taken as a character one column
+   * wide, so a cursor past a full last row has a row to be on.
+   *
+   * col: the column the character starts in
+   * w: columns the character takes
+   * start: the column its screen row starts in
+   * width: columns of a screen row
+   *
+   * Returns:
+   *  1 if the character starts a new screen row
+   */
+  return w > 0 && col + w > start + width && col > start;
+}
+
+int rowsWrapRows(struct rowStore *rs, int r, size_t width) {
+  /* Counts the screen rows a row takes wrapped at a width, walking its
+   * characters by wrapBreaks. A row narrower than the width, as most are,
+   * is known to take one from its cached width.
+   *
+   * rs: the row store
+   * r: the row
+   * width: columns of a screen row, at least 1
+   *
+   * Returns:
+   *  the number of screen rows
+   */
+  if ((size_t)rowsRenderLen(rs, r) < width)
+    return 1;
+  const char *b = rs->arena + rs->off[r];
+  int len = rs->len[r];
+  int g = rs->gap[r];
+  int glen = rs->cap[r] - len;
+  size_t col = 0, start = 0;
+  int rows = 1;
+  int i = 0;
+  while (i < len) {
+    const char *p = i < g ? b + i : b + glen + i;
+    int n = i < g ? g - i : len - i;
+    int k = asciiSpan(p, n);
+    // one column each, so the rows they start are width columns apart
+    size_t first = start + width > col ? start + width : col;
+    if (k > 0 && first < col + k) {
+      size_t more = (col + k - 1 - first) / width;
+      rows += more + 1;
+      start = first + more * width;
+    }
+    col += k;
+    i += k;
+    if (k == n)
+      continue;
+    int cp;
+    if (n - k < 4 && i < g) {
+      char buf[4];
+      int m = len - i < 4 ? len - i : 4;
+      rowsCopy(rs, r, i, buf, m);
+      i += charDecode(buf, m, &cp);
+    } else {
+      i += charDecode(p + k, n - k, &cp);
+    }
+    int w = charColumns(cp, col);
+    if (wrapBreaks(col, w, start, width)) {
+      rows++;
+      start = col;
+    }
+    col += w;
+  }
+  return rows + wrapBreaks(col, 1, start, width);
+}
+
+void rowsLoad(struct rowStore *rs, const char *buf, size_t len) {
+  /* Replaces the contents of a row store with a buffer split into rows. The
+   * rows are stored back to back without gaps; a row gets one the first time
+   * it is edited.
+   *
+   * rs: the row store
+   * buf: the document contents
+   * len: length of the buffer
+   */
+  rowsFree(rs);
+  int n = countNewlines(buf, len) + 1;
+  rowsInsertRows(rs, 0, n);
+
+  // size the arena for the whole file up front
+  rowsArenaAlloc(rs, len - (n - 1));
+  rs->arenalen = 0;
+
+  size_t pos = 0;
+  int r;
+  for (r = 0; r < n; r++) {
+    const char *nl = memchr(buf + pos, '\n', len - pos);
+    int rowlen = nl ? (size_t)(nl - buf) - pos : len - pos;
+    rs->off[r] = rowsArenaAlloc(rs, rowlen);
+    memcpy(rs->arena + rs->off[r], buf + pos, rowlen);
+    rs->len[r] = rowlen;
+    rs->cap[r] = rowlen;
+    rs->gap[r] = rowlen;
+    rs->dirty[r] = 1;
+    rs->bytes += rowlen;
+    pos += rowlen + 1;
+  }
+}
+
+void rowsInsert(struct rowStore *rs, size_t off, const char *s, size_t len) {
+  /* Inserts text into the document, splitting rows at its newlines.
+   *
+   * rs: the row store
+   * off: document offset to insert at, clamped to the document length
+   * s: the text
+   * len: length of the text
+   */
+  if (off > rowsLength(rs))
+    off = rowsLength(rs);
+  int col;
+  int r = rowsFind(rs, off, &col);
+
+  const char *nl = memchr(s, '\n', len);
+  if (nl == NULL) {
+    rowsInsertText(rs, r, col, s, len);
+    return;
+  }
+
+  // the rest of the row moves to the end of the last new row
+  int taillen = rs->len[r] - col;
+  char *tail = malloc(taillen ? taillen : 1);
+  if (tail == NULL)
+    die("malloc");
+  rowsCopy(rs, r, col, tail, taillen);
+  rowsDeleteText(rs, r, col, taillen);
+  rowsInsertText(rs, r, col, s, nl - s);
+
+  int k = countNewlines(s, len);
+  rowsInsertRows(rs, r + 1, k);
+  const char *seg = nl + 1;
+  int i;
+  for (i = 1; i <= k; i++) {
+    const char *end = i < k ? memchr(seg, '\n', s + len - seg) : s + len;
+    int seglen = end - seg;
+    rowsReserve(rs, r + i, seglen + (i == k ? taillen : 0));
+    rowsInsertText(rs, r + i, 0, seg, seglen);
+    seg = end + 1;
+  }
+  rowsInsertText(rs, r + k, rs->len[r + k], tail, taillen);
+  free(tail);
+}
+
+void rowsDelete(struct rowStore *rs, size_t off, size_t len) {
+  /* Removes a range of bytes from the document, joining the rows at either
+   * end when it spans newlines.
+   *
+   * rs: the row store
+   * off: document offset of the first byte to remove
+   * len: number of bytes to remove
+   */
+  size_t total = rowsLength(rs);
+  if (len == 0 || off >= total)
+    return;
+  if (off + len > total)
+    len = total - off;
+
+  int col1, col2;
+  int r1 = rowsFind(rs, off, &col1);
+  int r2 = rowsFind(rs, off + len, &col2);
+  if (r1 == r2) {
+    rowsDeleteText(rs, r1, col1, len);
+  } else {
+    int taillen = rs->len[r2] - col2;
+    char *tail = malloc(taillen ? taillen : 1);
+    if (tail == NULL)
+      die("malloc");
+    rowsCopy(rs, r2, col2, tail, taillen);
+    rowsDeleteText(rs, r1, col1, rs->len[r1] - col1);
+    rowsInsertText(rs, r1, col1, tail, taillen);
+    free(tail);
+
+    int r;
+    for (r = r1 + 1; r <= r2; r++)
+      rs->bytes -= rs->len[r];
+    rowsDeleteRows(rs, r1 + 1, r2 - r1);
+  }
+}
+
+/*** wrap index ***/
+
+void wrapUpdate(struct wrapIndex *w, int t) {
+  /* Recomputes the subtree totals of a node from its children.
+   *
+   * w: the wrap index
+   * t: the node to update
+   */
+  struct wrapNode *n = &w->nodes[t];
+  n->lines = 1 + w->nodes[n->left].lines + w->nodes[n->right].lines;
+  n->sum = n->rows + w->nodes[n->left].sum + w->nodes[n->right].sum;
+}
+
+int wrapNewNode(struct wrapIndex *w, int rows) {
+  /* Takes a node for a line off the free list, or from the end of the
+   * nodes, growing them as needed. Nodes are referred to by index, so they
+   * can move when the array grows.
+   *
+   * w: the wrap index
+   * rows: screen rows of the line
+   *
+   * Returns:
+   *  the new node
+   */
+  int t = w->free;
+  if (t) {
+    w->free = w->nodes[t].left;
+  } else {
+    if (w->used == w->cap) {
+      int cap = w->cap ? w->cap * 2 : 64;
+      struct wrapNode *nodes = realloc(w->nodes, sizeof(*nodes) * cap);
+      if (nodes == NULL)
+        die("realloc");
+      w->nodes = nodes;
+      w->cap = cap;
+    }
+    t = w->used++;
+  }
+
+  // xorshift keeps the treap priorities cheap and reproducible
+  w->seed ^= w->seed << 13;
+  w->seed ^= w->seed >> 17;
+  w->seed ^= w->seed << 5;
+
+  struct wrapNode *n = &w->nodes[t];
+  n->rows = rows;
+  n->prio = w->seed;
+  n->left = 0;
+  n->right = 0;
+  wrapUpdate(w, t);
+  return t;
+}
+
+void wrapFreeTree(struct wrapIndex *w, int t) {
+  /* Puts every node of a subtree on the free list.
+   *
+   * w: the wrap index
+   * t: root of the subtree
+   */
+  if (t == 0)
+    return;
+  wrapFreeTree(w, w->nodes[t].left);
+  wrapFreeTree(w, w->nodes[t].right);
+  w->nodes[t].left = w->free;
+  w->free = t;
+}
+
+int wrapMerge(struct wrapIndex *w, int a, int b) {
+  /* Concatenates two trees of lines, every line of a coming before b.
+   *
+   * w: the wrap index
+   * a: the left tree
+   * b: the right tree
+   *
+   * Returns:
+   *  the root of the merged tree
+   */
+  if (a == 0)
+    return b;
+  if (b == 0)
+    return a;
+  if (w->nodes[a].prio > w->nodes[b].prio) {
+    w->nodes[a].right = wrapMerge(w, w->nodes[a].right, b);
+    wrapUpdate(w, a);
+    return a;
+  }
+  w->nodes[b].left = wrapMerge(w, a, w->nodes[b].left);
+  wrapUpdate(w, b);
+  return b;
+}
+
+void wrapSplit(struct wrapIndex *w, int t, int line, int *l, int *r) {
+  /* Splits a tree of lines before a line.
+   *
+   * w: the wrap index
+   * t: the tree to split
+   * line: line number relative to the first line of t
+   * l: receives the tree of the lines before it
+   * r: receives the tree of the line and those after it
+   */
+  if (t == 0) {
+    *l = 0;
+    *r = 0;
+    return;
+  }
+  struct wrapNode *n = &w->nodes[t];
+  int llines = w->nodes[n->left].lines;
+  if (line <= llines) {
+    int left;
+    wrapSplit(w, n->left, line, l, &left);
+    w->nodes[t].left = left;
+    wrapUpdate(w, t);
+    *r = t;
+  } else {
+    int right;
+    wrapSplit(w, n->right, line - llines - 1, &right, r);
+    w->nodes[t].right = right;
+    wrapUpdate(w, t);
+    *l = t;
+  }
+}
+
+void wrapSet(struct wrapIndex *w, int t, int line, int rows) {
+  /* Changes the screen rows of a line, updating the totals above it.
+   *
+   * w: the wrap index
+   * t: the tree holding the line
+   * line: line number relative to the first line of t
+   * rows: its screen rows
+   */
+  struct wrapNode *n = &w->nodes[t];
+  int llines = w->nodes[n->left].lines;
+  if (line < llines)
+    wrapSet(w, n->left, line, rows);
+  else if (line > llines)
+    wrapSet(w, n->right, line - llines - 1, rows);
+  else
+    n->rows = rows;
+  wrapUpdate(w, t);
+}
+
+void wrapBuild(struct wrapIndex *w, struct rowStore *rs, int width) {
+  /* Counts the screen rows of every row at a width and builds the tree over
+   * them, in O(n): the lines come in order, so each one only has to be
+   * hung off the right edge of the tree built so far. Rows narrower than
+   * the width are known to take one from the rows' cached widths, so only
+   * wider ones are walked.
+   *
+   * w: the wrap index
+   * rs: the row store
+   * width: columns to wrap at, at least 1
+   */
+  int n = rs->numrows + 1;
+  int *edge = malloc(sizeof(int) * n);
+  if (edge == NULL)
+    die("malloc");
+  if (w->cap < n + 1) {
+    struct wrapNode *nodes = realloc(w->nodes, sizeof(*nodes) * (n + 1));
+    if (nodes == NULL)
+      die("realloc");
+    w->nodes = nodes;
+    w->cap = n + 1;
+  }
+  // nodes[0] stands for an empty subtree
+  memset(&w->nodes[0], 0, sizeof(w->nodes[0]));
+  w->used = 1;
+  w->free = 0;
+  w->seed = 2463534242u;
+  int top = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    int t = wrapNewNode(w, i < rs->numrows ? rowsWrapRows(rs, i, width) : 1);
+    // nodes of lower priority on the right edge become the new one's left
+    int last = 0;
+    while (top > 0 && w->nodes[edge[top - 1]].prio < w->nodes[t].prio) {
+      last = edge[--top];
+      wrapUpdate(w, last);
+    }
+    w->nodes[t].left = last;
+    if (top > 0)
+      w->nodes[edge[top - 1]].right = t;
+    edge[top++] = t;
+  }
+  while (top > 0)
+    wrapUpdate(w, edge[--top]);
+  w->root = edge[0];
+  free(edge);
+  w->n = n;
+  w->width = width;
+  w->valid = 1;
+}
+
+int wrapBefore(struct wrapIndex *w, int line) {
+  /* Returns:
+   *  the screen rows of the lines before a line, up to n
+   */
+  int sum = 0;
+  int t = w->root;
+  while (t) {
+    struct wrapNode *n = &w->nodes[t];
+    int llines = w->nodes[n->left].lines;
+    if (line <= llines) {
+      t = n->left;
+    } else {
+      sum += w->nodes[n->left].sum + n->rows;
+      line -= llines + 1;
+      t = n->right;
+    }
+  }
+  return sum;
+}
+
+int wrapRows(struct wrapIndex *w, int line) {
+  /* Returns:
+   *  the screen rows of a line, 1 past the last one
+   */
+  int t = w->root;
+  while (t) {
+    struct wrapNode *n = &w->nodes[t];
+    int llines = w->nodes[n->left].lines;
+    if (line == llines)
+      return n->rows;
+    if (line < llines) {
+      t = n->left;
+    } else {
+      line -= llines + 1;
+      t = n->right;
+    }
+  }
+  return 1;
+}
+
+int wrapFind(struct wrapIndex *w, int y, int *sub) {
+  /* Finds the line a screen row falls in, descending the tree.
+   *
+   * w: the wrap index
+   * y: screen row counted from the top of the document
+   * sub: receives the row within the line
+   *
+   * Returns:
+   *  the line, n if y is past the last one
+   */
+  int line = 0;
+  int t = w->root;
+  while (t) {
+    struct wrapNode *n = &w->nodes[t];
+    int lsum = w->nodes[n->left].sum;
+    if (y < lsum) {
+      t = n->left;
+      continue;
+    }
+    y -= lsum;
+    line += w->nodes[n->left].lines;
+    if (y < n->rows)
+      break;
+    y -= n->rows;
+    line++;
+    t = n->right;
+  }
+  *sub = y;
+  return line;
+}
+
+void wrapEdit(struct wrapIndex *w, struct rowStore *rs, size_t off) {
+  /* Brings the index up to date with an edit just made to the row store.
+   * Lines the edit split off the line it was made in are added after it,
+   * lines it joined onto it removed, and then only those lines are counted
+   * again.
+   *
+   * w: the wrap index
+   * rs: the row store
+   * off: document offset of the edit
+   */
+  if (!w->valid)
+    return;
+  int col;
+  int r = rowsFind(rs, off, &col);
+  int added = rs->numrows + 1 - w->n;
+  if (added != 0) {
+    int l, mid, tail;
+    wrapSplit(w, w->root, r + 1, &l, &tail);
+    if (added > 0) {
+      mid = 0;
+      int i;
+      for (i = 0; i < added; i++)
+        mid = wrapMerge(w, mid, wrapNewNode(w, 1));
+    } else {
+      wrapSplit(w, tail, -added, &mid, &tail);
+      wrapFreeTree(w, mid);
+      mid = 0;
+    }
+    w->root = wrapMerge(w, wrapMerge(w, l, mid), tail);
+    w->n = rs->numrows + 1;
+  }
+  int i;
+  for (i = r; i <= r + (added > 0 ? added : 0); i++)
+    wrapSet(w, w->root, i, rowsWrapRows(rs, i, w->width));
+}
+
+/*** journal ***/
+
+uint32_t journalSum(uint32_t h, const void *p, size_t n) {
+  /* Carries an FNV-1a hash on over more bytes.
+   *
+   * h: the hash so far, 2166136261 to start
+   * p: the bytes
+   * n: number of bytes
+   *
+   * Returns:
+   *  the hash including the bytes
+   */
+  const unsigned char *s = p;
+  while (n--) {
+    h ^= *s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+uint32_t journalRecordSum(const struct journalRecord *r, const char *s) {
+  /* Returns:
+   *  the checksum of a record and the bytes it inserts, s
+   */
+  struct journalRecord c = *r;
+  c.sum = 0;
+  uint32_t h = journalSum(2166136261u, &c, sizeof(c));
+  return journalSum(h, s, r->del ? 0 : r->len);
+}
+
+void journalFlush() {
+  /* Journal timer callback: hands the batch to the journal thread.
+   */
+  struct journal *j = &E.journal;
+  pthread_mutex_lock(&j->lock);
+  j->flush = 1;
+  pthread_cond_signal(&j->work);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void journalAppend(int del, size_t off, const char *s, size_t len) {
+  /* Adds an edit to the next batch, which goes to disk when the journal
+   * timer runs out.
+   *
+   * del: the edit removes bytes rather than inserting them
+   * off: document offset of the edit
+   * s: the bytes inserted, unused for a removal
+   * len: number of bytes inserted or removed
+   */
+  struct journal *j = &E.journal;
+  if (!j->active)
+    return;
+  struct journalRecord r;
+  r.off = off;
+  r.len = len;
+  r.del = del;
+  r.sum = journalRecordSum(&r, s);
+  pthread_mutex_lock(&j->lock);
+  if (abReserve(&j->pending, sizeof(r) + (del ? 0 : len)) == -1)
+    die("malloc");
+  abAppend(&j->pending, (const char *)&r, sizeof(r));
+  if (!del)
+    abAppend(&j->pending, s, len);
+  pthread_mutex_unlock(&j->lock);
+  j->appended += sizeof(r) + (del ? 0 : len);
+
+  if (E.timers[TIMER_JOURNAL].fn == NULL)
+    editorTimerSet(TIMER_JOURNAL, JOURNAL_SYNC_MS, journalFlush);
+}
+
+int journalWriteAll(int fd, const char *p, size_t n, off_t off) {
+  /* Writes a buffer out in full at an offset.
+   *
+   * Returns:
+   *  0 on success, -1 on error
+   */
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, off);
+    if (w == -1 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return -1;
+    p += w;
+    n -= w;
+    off += w;
+  }
+  return 0;
+}
+
+void journalDrop(struct journal *j) {
+  /* Gives up on a journal that couldn't be written: a journal missing edits
+   * would restore the wrong text, so none is better.
+   *
+   * j: the journal
+   */
+  if (j->fd != -1)
+    close(j->fd);
+  j->fd = -1;
+  unlink(j->path);
+  j->broken = 1;
+}
+
+void journalWrite(struct journal *j, const char *p, size_t n) {
+  /* Appends a batch to the journal file and flushes it to disk, creating the
+   * file with the first batch.
+   *
+   * j: the journal
+   * p: the records
+   * n: bytes of records
+   */
+  if (n == 0 || j->broken)
+    return;
+  if (j->fd == -1) {
+    // read back as well when the journal is started over
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (j->fd == -1 ||
+        journalWriteAll(j->fd, (const char *)&j->head, sizeof(j->head), 0) ==
+            -1) {
+      journalDrop(j);
+      return;
+    }
+  }
+  off_t end = lseek(j->fd, 0, SEEK_END);
+  if (end == -1 || journalWriteAll(j->fd, p, n, end) == -1 ||
+      fdatasync(j->fd) == -1)
+    journalDrop(j);
+}
+
+void journalRestart(struct journal *j, size_t at, struct journalHeader *h) {
+  /* Starts the journal over after a save. The saved file holds every edit
+   * before at; the records from at on are copied to a new journal for the
+   * saved file, which then replaces the old one.
+   *
+   * j: the journal
+   * at: position of the first record to keep
+   * h: header for the new journal
+   */
+  off_t from = sizeof(j->head) + (at - j->base);
+  off_t end = j->fd != -1 ? lseek(j->fd, 0, SEEK_END) : 0;
+  j->head = *h;
+  j->base = at;
+  if (j->broken || j->fd == -1)
+    return;
+  if (end <= from) {
+    // nothing left to keep: the next batch makes a new journal
+    close(j->fd);
+    j->fd = -1;
+    unlink(j->path);
+    return;
+  }
+
+  size_t size = strlen(j->path) + 8;
+  char *tmp = malloc(size);
+  if (tmp == NULL)
+    die("malloc");
+  snprintf(tmp, size, "%s.XXXXXX", j->path);
+  int fd = mkstemp(tmp);
+  int ok = fd != -1 &&
+           journalWriteAll(fd, (const char *)h, sizeof(*h), 0) == 0;
+  char buf[1 << 16];
+  off_t off = from;
+  while (ok && off < end) {
+    ssize_t n = pread(j->fd, buf, sizeof(buf), off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    ok = n > 0 &&
+         journalWriteAll(fd, buf, n, sizeof(*h) + (off - from)) == 0;
+    off += n;
+  }
+  ok = ok && fdatasync(fd) == 0 && rename(tmp, j->path) == 0;
+  if (ok) {
+    close(j->fd);
+    j->fd = fd;
+  } else {
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    journalDrop(j);
+  }
+  free(tmp);
+}
+
+void *journalThread(void *arg) {
+  /* Journal thread body: writes batches and starts journals over as asked,
+   * so the disk never holds up the editor.
+   *
+   * arg: the journal
+   */
+  struct journal *j = arg;
+  pthread_mutex_lock(&j->lock);
+  while (1) {
+    if (!j->flush && !j->restart) {
+      pthread_cond_wait(&j->work, &j->lock);
+      continue;
+    }
+    struct abuf batch = j->pending;
+    j->pending = j->writing;
+    j->pending.len = 0;
+    j->writing = batch;
+    int restart = j->restart;
+    size_t at = j->restartat;
+    struct journalHeader h = j->next;
+    j->flush = 0;
+    j->restart = 0;
+    j->busy = 1;
+    pthread_mutex_unlock(&j->lock);
+
+    journalWrite(j, batch.b, batch.len);
+    if (restart)
+      journalRestart(j, at, &h);
+
+    pthread_mutex_lock(&j->lock);
+    j->busy = 0;
+    pthread_cond_broadcast(&j->idle);
+  }
+  return NULL;
+}
+
+void journalInit(struct journal *j) {
+  /* Sets up a journal with no file. The thread is started by the first file
+   * journaled.
+   *
+   * j: the journal
+   */
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->work, NULL);
+  pthread_cond_init(&j->idle, NULL);
+  j->running = 0;
+  j->enabled = 1;
+  j->active = 0;
+  j->path = NULL;
+  j->fd = -1;
+  j->pending.b = NULL;
+  j->pending.len = 0;
+  j->pending.cap = 0;
+  j->writing = j->pending;
+  j->flush = 0;
+  j->busy = 0;
+  j->restart = 0;
+  j->recover = 0;
+  j->found = NULL;
+}
+
+void journalSync() {
+  /* Writes the pending batch now and waits until the thread is done with
+   * everything it was given.
+   */
+  struct journal *j = &E.journal;
+  if (!j->running)
+    return;
+  editorTimerCancel(TIMER_JOURNAL);
+  pthread_mutex_lock(&j->lock);
+  j->flush = 1;
+  pthread_cond_signal(&j->work);
+  while (j->flush || j->restart || j->busy)
+    pthread_cond_wait(&j->idle, &j->lock);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void journalIdentify(const char *filename, struct journalHeader *h) {
+  /* Fills in a journal header for the file as it is on disk now.
+   *
+   * filename: the file
+   * h: the header
+   */
+  struct stat st;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+  if (stat(filename, &st) == -1)
+    return;
+  h->size = st.st_size;
+  h->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  h->ino = st.st_ino;
+  h->dev = st.st_dev;
+}
+
+void journalScan(struct journal *j) {
+  /* Reads a journal left behind by a session that didn't end cleanly. If it
+   * was made for the file as it is now, its whole records are kept for the
+   * user to replay or not.
+   *
+   * j: the journal, with path and head set
+   */
+  int fd = open(j->path, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  char *buf = NULL;
+  size_t len = 0;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(j->head) &&
+      (buf = malloc(st.st_size)) != NULL) {
+    while (len < (size_t)st.st_size) {
+      ssize_t n = read(fd, buf + len, st.st_size - len);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      len += n;
+    }
+  }
+  close(fd);
+  if (buf == NULL || len < sizeof(j->head) ||
+      memcmp(buf, &j->head, sizeof(j->head)) != 0) {
+    free(buf);
+    return;
+  }
+
+  // a batch cut short by the crash ends the journal
+  size_t pos = sizeof(j->head);
+  int count = 0;
+  while (len - pos >= sizeof(struct journalRecord)) {
+    struct journalRecord r;
+    memcpy(&r, buf + pos, sizeof(r));
+    // only an insert's bytes are in the journal; a removal's length can be
+    // anything
+    if ((!r.del && r.len > len - pos - sizeof(r)) ||
+        journalRecordSum(&r, buf + pos + sizeof(r)) != r.sum)
+      break;
+    pos += sizeof(r) + (r.del ? 0 : r.len);
+    count++;
+  }
+  if (count == 0) {
+    free(buf);
+    return;
+  }
+  j->found = buf;
+  j->foundlen = pos;
+  j->recover = count;
+}
+
+void journalStart(const char *filename) {
+  /* Starts journaling edits to a newly opened file, in a journal named
+   * .<name>.txtj next to it. A symlink's journal goes next to the file it
+   * points to. A journal already there means the last session ended without
+   * a save or quit, and its edits are offered for replay first.
+   *
+   * filename: the file
+   */
+  struct journal *j = &E.journal;
+  if (!j->enabled || E.follow.on)
+    return;
+  if (!j->running) {
+    if (pthread_create(&j->thread, NULL, journalThread, j) != 0)
+      return;
+    j->running = 1;
+  }
+
+  char *target = realpath(filename, NULL);
+  const char *path = target != NULL ? target : filename;
+  const char *slash = strrchr(path, '/');
+  int dirlen = slash != NULL ? slash - path + 1 : 0;
+  size_t size = strlen(path) + 8;
+  j->path = malloc(size);
+  if (j->path == NULL)
+    die("malloc");
+  snprintf(j->path, size, "%.*s.%s.txtj", dirlen, path, path + dirlen);
+  free(target);
+
+  journalIdentify(filename, &j->head);
+  j->fd = -1;
+  j->base = 0;
+  j->broken = 0;
+  j->appended = 0;
+  journalScan(j);
+  j->active = !j->recover;
+}
+
+void journalRestartAt(size_t at, const char *filename) {
+  /* Asks the journal thread to start the journal over once a save made a
+   * new file.
+   *
+   * at: journal position when the save's snapshot was taken
+   * filename: the file saved
+   */
+  struct journal *j = &E.journal;
+  if (!j->active)
+    return;
+  pthread_mutex_lock(&j->lock);
+  journalIdentify(filename, &j->next);
+  j->restartat = at;
+  j->restart = 1;
+  pthread_cond_signal(&j->work);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void journalClose(int keep) {
+  /* Stops journaling the open file.
+   *
+   * keep: leave the journal on disk, as the document holds edits that were
+   *       not saved; otherwise it is removed
+   */
+  struct journal *j = &E.journal;
+  if (j->path == NULL)
+    return;
+  journalSync();
+  if (j->fd != -1)
+    close(j->fd);
+  if (!keep)
+    unlink(j->path);
+  free(j->path);
+  free(j->found);
+  j->path = NULL;
+  j->found = NULL;
+  j->fd = -1;
+  j->active = 0;
+  j->recover = 0;
+}
+
+/*** document ***/
+
+size_t docLength() {
+  /* Returns:
+   *  the length of the document in bytes
+   */
+  if (E.dockind == DOC_ROWS)
+    return rowsLength(&E.rows);
+  return ptLength(&E.pt);
+}
+
+size_t docSpan(size_t off, const char **p) {
+  /* Finds the contiguous run of bytes stored at a document offset. The
+   * pointer is only valid until the next edit.
+   *
+   * off: document offset to look up
+   * p: receives a pointer to the byte at off
+   *
+   * Returns:
+   *  the number of bytes readable from *p, 0 if off is at or past the end
+   */
+  if (E.dockind == DOC_ROWS)
+    return rowsSpan(&E.rows, off, p);
+  return ptSpan(&E.pt, off, p);
+}
+
+size_t docRead(size_t off, char *buf, size_t len) {
+  /* Copies a range of the document into a buffer.
+   *
+   * off: document offset to start reading at
+   * buf: destination buffer
+   * len: maximum number of bytes to copy
+   *
+   * Returns:
+   *  the number of bytes copied
+   */
+  if (E.dockind == DOC_ROWS)
+    return rowsRead(&E.rows, off, buf, len);
+  size_t done = 0;
+  while (done < len) {
+    const char *p;
+    size_t n = docSpan(off + done, &p);
+    if (n == 0)
+      break;
+    if (n > len - done)
+      n = len - done;
+    memcpy(buf + done, p, n);
+    done += n;
+  }
+  return done;
+}
+
+size_t docFindByte(size_t off, int c) {
+  /* Finds the next occurrence of a byte at or after a document offset.
+   *
+   * off: document offset to start searching at
+   * c: the byte to look for
+   *
+   * Returns:
+   *  the offset of the byte, or the document length if there is none
+   */
+  const char *p;
+  size_t n;
+  while ((n = docSpan(off, &p)) > 0) {
+    const char *hit = memchr(p, c, n);
+    if (hit)
+      return off + (hit - p);
+    off += n;
+  }
+  return off;
+}
+
+int docLineStart(int line, size_t *off) {
+  /* Finds where a line begins.
+   *
+   * line: zero based line number
+   * off: receives the document offset of the first byte of the line
+   *
+   * Returns:
+   *  0 if the document has at least line newlines, -1 if not
+   */
+  if (E.dockind == DOC_ROWS)
+    return rowsLineStart(&E.rows, line, off);
+  return ptLineStart(&E.pt, line, off);
+}
+
+int docLineOf(size_t off, int *col) {
+  /* Finds the line a document offset is on.
+   *
+   * off: document offset, at most the document length
+   * col: receives the byte offset within the line
+   *
+   * Returns:
+   *  the zero based line number
+   */
+  if (E.dockind == DOC_ROWS)
+    return rowsFind(&E.rows, off, col);
+  int line = ptCountBefore(&E.pt, E.pt.root, off);
+  size_t start = 0;
+  ptLineStart(&E.pt, line, &start);
+  *col = off - start;
+  return line;
+}
+
+void colCacheClear(struct colCache *cc) {
+  /* Forgets every cached line, keeping the memory of their marks.
+   */
+  int i;
+  for (i = 0; i < COL_CACHE_LINES; i++)
+    cc->lines[i].line = -1;
+}
+
+void colCacheEdit(int del, size_t off, const char *s, size_t len) {
+  /* Logs an edit about to be made for the column cache to catch up with,
+   * noting whether it adds or removes line breaks. For a removal that means
+   * looking through the bytes removed.
+   *
+   * del: the edit removes bytes rather than inserting them
+   * off: document offset of the edit
+   * s: the bytes inserted, NULL for a removal
+   * len: number of bytes inserted or removed
+   */
+  struct colCache *cc = &E.cols;
+  struct colEdit *e = &cc->edits[cc->nedits % COL_EDITS];
+  e->off = off;
+  e->len = len;
+  e->del = del;
+  if (!del) {
+    e->lines = memchr(s, '\n', len) != NULL;
+  } else {
+    e->lines = 0;
+    size_t done = 0;
+    while (done < len && !e->lines) {
+      const char *p;
+      size_t n = docSpan(off + done, &p);
+      if (n > len - done)
+        n = len - done;
+      e->lines = memchr(p, '\n', n) != NULL;
+      done += n;
+    }
+  }
+  cc->nedits++;
+}
+
+int colCatchUp(struct colLine *cl) {
+  /* Brings a cached line up to date with the edits made since it was last
+   * looked up: its text moves along with edits before it, and an edit that
+   * touches it or changes its line number, or one that has dropped out of
+   * the log, ends it.
+   *
+   * cl: the cache entry
+   *
+   * Returns:
+   *  0 if the entry is still good, -1 if not
+   */
+  struct colCache *cc = &E.cols;
+  if (cc->nedits - cl->seen > COL_EDITS)
+    return -1;
+  for (; cl->seen < cc->nedits; cl->seen++) {
+    struct colEdit *e = &cc->edits[cl->seen % COL_EDITS];
+    size_t end = e->del ? e->off + e->len : e->off;
+    if (end >= cl->start && e->off <= cl->start + cl->len)
+      return -1;
+    if (e->off < cl->start && e->lines)
+      return -1;
+    if (e->off < cl->start)
+      cl->start = e->del ? cl->start - e->len : cl->start + e->len;
+  }
+  return 0;
+}
+
+struct colLine *colEntry(int line, size_t start, size_t len) {
+  /* Finds the cached columns of a line already looked up, starting it over
+   * when the line isn't cached or its text has changed.
+   *
+   * line: zero based line number
+   * start: document offset of the line
+   * len: length of the line, without its newline
+   *
+   * Returns:
+   *  the line's cache entry
+   */
+  struct colLine *cl = &E.cols.lines[line % COL_CACHE_LINES];
+  if (cl->line == line && colCatchUp(cl) == 0 && cl->start == start &&
+      cl->len == len)
+    return cl;
+  cl->line = line;
+  cl->start = start;
+  cl->len = len;
+  cl->seen = E.cols.nedits;
+  cl->ascii = 0;
+  cl->done = 0;
+  cl->col = 0;
+  cl->nmarks = 0;
+  cl->nwraps = 0;
+  cl->wrapdone = 0;
+  return cl;
+}
+
+struct colLine *colLookup(int line) {
+  /* Finds the cached columns of a line, only looking the line up in the
+   * document when they aren't cached. A line after a cached one starts
+   * past its newline, so walking down the lines looks up one line end each.
+   *
+   * line: zero based line number
+   *
+   * Returns:
+   *  the line's cache entry, NULL if the line doesn't exist
+   */
+  if (line < 0)
+    return NULL;
+  struct colLine *cl = &E.cols.lines[line % COL_CACHE_LINES];
+  if (cl->line == line && colCatchUp(cl) == 0)
+    return cl;
+  struct colLine *prev =
+      &E.cols.lines[(line + COL_CACHE_LINES - 1) % COL_CACHE_LINES];
+  size_t start, next;
+  if (line > 0 && prev->line == line - 1 && colCatchUp(prev) == 0) {
+    start = prev->start + prev->len + 1;
+    if (start > docLength())
+      return NULL;
+  } else if (docLineStart(line, &start) == -1) {
+    return NULL;
+  }
+  size_t len =
+      (docLineStart(line + 1, &next) == 0 ? next - 1 : docLength()) - start;
+  return colEntry(line, start, len);
+}
+
+int docCharAt(size_t off, size_t end, int *cp) {
+  /* Decodes the character at a document offset.
+   *
+   * off: offset of the character, before end
+   * end: where the text the character is part of ends
+   * cp: receives the code point, as charDecode gives it
+   *
+   * Returns:
+   *  the length of the character in bytes
+   */
+  char buf[4];
+  const char *p;
+  size_t n = docSpan(off, &p);
+  if (n > end - off)
+    n = end - off;
+  if (n < 4 && n < end - off) {
+    n = docRead(off, buf, end - off < 4 ? end - off : 4);
+    p = buf;
+  }
+  return charDecode(p, n, cp);
+}
+
+size_t docWalk(size_t off, size_t upto, size_t end, size_t *col,
+               size_t stop) {
+  /* Walks over the characters of a line counting columns, for as long as the
+   * next character starts before upto and ends by column stop. Runs of
+   * printable ASCII are skipped a vector compare at a time.
+   *
+   * off: document offset of a character boundary to start at
+   * upto: no character starting here or after is walked over
+   * end: where the line ends
+   * col: the column at off, updated
+   * stop: the last column a character walked over may end at
+   *
+   * Returns:
+   *  the document offset walked to
+   */
+  while (off < upto) {
+    const char *p;
+    size_t n = docSpan(off, &p);
+    if (n > end - off)
+      n = end - off;
+    // characters may only start before upto, but may run on past it
+    size_t lim = n < upto - off ? n : upto - off;
+    size_t i = 0;
+    while (i < lim) {
+      size_t k = asciiSpan(p + i, lim - i);
+      size_t room = stop > *col ? stop - *col : 0;
+      if (k > room) {
+        *col += room;
+        return off + i + room;
+      }
+      *col += k;
+      i += k;
+      if (i == lim)
+        break;
+
+      int cp;
+      // a character cut off by the end of the span is read whole
+      int len = n - i >= 4 || off + n == end ? charDecode(p + i, n - i, &cp)
+                                             : docCharAt(off + i, end, &cp);
+      int w = charColumns(cp, *col);
+      if (*col + w > stop)
+        return off + i;
+      *col += w;
+      i += len;
+    }
+    off += i;
+  }
+  return off;
+}
+
+void colScan(struct colLine *cl, size_t upto, size_t upcol) {
+  /* Works out the columns of a line further until upto bytes of it are
+   * covered and it has gone past column upcol. The printable ASCII the line
+   * starts with, all of most lines, is skipped a span at a time and needs no
+   * marks; after it the columns are walked a mark at a time.
+   *
+   * cl: the line's cache entry
+   * upto: bytes of the line to cover
+   * upcol: column to go past
+   */
+  while (cl->ascii == cl->done && cl->done < cl->len &&
+         (cl->done < upto || cl->col <= upcol)) {
+    const char *p;
+    size_t n = docSpan(cl->start + cl->done, &p);
+    if (n > cl->len - cl->done)
+      n = cl->len - cl->done;
+    size_t k = asciiSpan(p, n);
+    cl->ascii += k;
+    cl->done += k;
+    cl->col += k;
+    if (k < n)
+      break;
+  }
+  while (cl->done < cl->len && (cl->done < upto || cl->col <= upcol)) {
+    size_t seg = cl->len - cl->done < COL_STEP ? cl->len : cl->done + COL_STEP;
+    cl->done = docWalk(cl->start + cl->done, cl->start + seg,
+                       cl->start + cl->len, &cl->col, (size_t)-1) -
+               cl->start;
+    if (cl->nmarks == cl->cap) {
+      int cap = cl->cap ? cl->cap * 2 : 16;
+      struct colMark *marks = realloc(cl->marks, sizeof(*marks) * cap);
+      if (marks == NULL)
+        die("realloc");
+      cl->marks = marks;
+      cl->cap = cap;
+    }
+    cl->marks[cl->nmarks].off = cl->done;
+    cl->marks[cl->nmarks].col = cl->col;
+    cl->nmarks++;
+  }
+}
+
+size_t colOf(int line, size_t x) {
+  /* Finds the screen column of a byte of a line.
+   *
+   * line: zero based line number
+   * x: byte offset in the line
+   *
+   * Returns:
+   *  the column the character at x starts in, x if the line doesn't exist
+   */
+  struct colLine *cl = colLookup(line);
+  if (cl == NULL || x == 0)
+    return x;
+  if (x > cl->len)
+    x = cl->len;
+  colScan(cl, x, 0);
+  if (x <= cl->ascii)
+    return x;
+  int lo = 0, hi = cl->nmarks;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cl->marks[mid].off <= x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  size_t off = lo ? cl->marks[lo - 1].off : cl->ascii;
+  size_t col = lo ? cl->marks[lo - 1].col : cl->ascii;
+  docWalk(cl->start + off, cl->start + x, cl->start + cl->len, &col,
+          (size_t)-1);
+  return col;
+}
+
+size_t colLineOffset(struct colLine *cl, size_t c, size_t *charcol) {
+  /* Finds the character of a line that covers a screen column: zero width
+   * characters go with the one before them, and a wide character or a tab
+   * covers all its columns.
+   *
+   * cl: the line's cache entry
+   * c: the column
+   * charcol: if not NULL, receives the column the character starts in
+   *
+   * Returns:
+   *  the byte offset of the character in the line, the line's length if the
+   *  line ends before the column
+   */
+  colScan(cl, 0, c);
+  if (c < cl->ascii || cl->ascii == cl->len) {
+    size_t off = c < cl->ascii ? c : cl->len;
+    if (charcol)
+      *charcol = off;
+    return off;
+  }
+  int lo = 0, hi = cl->nmarks;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cl->marks[mid].col <= c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  size_t off = lo ? cl->marks[lo - 1].off : cl->ascii;
+  size_t col = lo ? cl->marks[lo - 1].col : cl->ascii;
+  off = docWalk(cl->start + off, cl->start + cl->len, cl->start + cl->len,
+                &col, c) -
+        cl->start;
+  if (charcol)
+    *charcol = col;
+  return off;
+}
+
+size_t colOffset(int line, size_t c, size_t *charcol) {
+  /* colLineOffset for a line looked up by number.
+   *
+   * Returns:
+   *  the byte offset of the character covering column c, 0 if the line
+   *  doesn't exist
+   */
+  struct colLine *cl = colLookup(line);
+  if (cl == NULL) {
+    if (charcol)
+      *charcol = 0;
+    return 0;
+  }
+  return colLineOffset(cl, c, charcol);
+}
+
+int colWrapTo(struct colLine *cl, size_t width, int rows, size_t c) {
+  /* Finds the screen rows of a line wrapped at a width, as far as needed:
+   * each next row starts at the character that covers the column just past
+   * the row before it, found through the line's columns, which is where
+   * wrapBreaks puts it. They are kept with the line's columns until it is
+   * edited or the width changes.
+   *
+   * cl: the line's cache entry
+   * width: columns of a screen row, at least 1
+   * rows: rows to find
+   * c: column to find rows up to
+   *
+   * Returns:
+   *  the rows found: at least rows, and past c, unless the line ends first
+   */
+  if (cl->wrapwidth != width) {
+    cl->wrapwidth = width;
+    cl->nwraps = 0;
+    cl->wrapdone = 0;
+  }
+  while (!cl->wrapdone && (cl->nwraps + 1 < rows ||
+                           (cl->nwraps ? cl->wraps[cl->nwraps - 1] : 0) <= c)) {
+    size_t start = cl->nwraps ? cl->wraps[cl->nwraps - 1] : 0;
+    size_t edge = start + width;
+    size_t charcol;
+    size_t off = colLineOffset(cl, edge, &charcol);
+    size_t next;
+    if (off == cl->len) {
+      // the end of the line is only on the next row if this one is full
+      if (charcol != edge) {
+        cl->wrapdone = 1;
+        break;
+      }
+      next = edge;
+    } else if (charcol > start) {
+      next = charcol;
+    } else {
+      // a character wider than the screen has a row to itself
+      int cp;
+      docCharAt(cl->start + off, cl->start + cl->len, &cp);
+      next = charcol + charColumns(cp, charcol);
+    }
+    if (cl->nwraps == cl->wrapcap) {
+      int cap = cl->wrapcap ? cl->wrapcap * 2 : 16;
+      size_t *wraps = realloc(cl->wraps, sizeof(*wraps) * cap);
+      if (wraps == NULL)
+        die("realloc");
+      cl->wraps = wraps;
+      cl->wrapcap = cap;
+    }
+    cl->wraps[cl->nwraps++] = next;
+  }
+  return cl->nwraps + 1;
+}
+
+size_t colWrapStart(struct colLine *cl, size_t width, int sub, size_t *end) {
+  /* Finds where a screen row of a wrapped line starts and ends.
+   *
+   * cl: the line's cache entry
+   * width: columns of a screen row, at least 1
+   * sub: the screen row within the line, past the last meaning the last
+   * end: receives the column the next row starts in, or for the last row
+   *  the column after its last one
+   *
+   * Returns:
+   *  the column the row starts in
+   */
+  int rows = colWrapTo(cl, width, sub + 2, 0);
+  if (sub > rows - 1)
+    sub = rows - 1;
+  size_t start = sub ? cl->wraps[sub - 1] : 0;
+  *end = sub < rows - 1 ? cl->wraps[sub] : start + width;
+  return start;
+}
+
+int colWrapRow(struct colLine *cl, size_t width, size_t c, size_t *start) {
+  /* Finds the screen row of a wrapped line a column is on.
+   *
+   * cl: the line's cache entry
+   * width: columns of a screen row, at least 1
+   * c: the column, the start of a character or the end of the line
+   * start: receives the column the row starts in
+   *
+   * Returns:
+   *  the screen row within the line
+   */
+  int rows = colWrapTo(cl, width, 1, c);
+  int lo = 0, hi = rows - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (cl->wraps[mid - 1] <= c)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  *start = lo ? cl->wraps[lo - 1] : 0;
+  return lo;
+}
+
+void syntaxLock(struct syntaxWorker *w) {
+  /* Takes the highlighter thread's lock for the editor. The thread looks
+   * at the wanted count after every row it lexes and lets go of the lock
+   * until the editor is done, so the editor waits for one row at most
+   * rather than for whoever the mutex happens to favour.
+   *
+   * w: the highlighter thread's state
+   */
+  __atomic_add_fetch(&w->wanted, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&w->lock);
+  __atomic_sub_fetch(&w->wanted, 1, __ATOMIC_SEQ_CST);
+}
+
+void syntaxUnlock(struct syntaxWorker *w) {
+  /* Gives the highlighter thread's lock back and lets the thread go on.
+   *
+   * w: the highlighter thread's state
+   */
+  pthread_cond_signal(&w->yield);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void docInsert(size_t off, const char *s, size_t len) {
+  /* Inserts bytes into the document.
+   *
+   * off: document offset to insert at
+   * s: the bytes to insert
+   * len: number of bytes to insert
+   */
+  journalAppend(0, off, s, len);
+  colCacheEdit(0, off, s, len);
+  E.edits++;
+  if (E.dockind == DOC_ROWS) {
+    // the highlighter thread reads the rows
+    syntaxLock(&E.hlworker);
+    rowsInsert(&E.rows, off, s, len);
+    syntaxUnlock(&E.hlworker);
+    wrapEdit(&E.wrap, &E.rows, off);
+  } else {
+    ptInsert(&E.pt, off, s, len);
+  }
+}
+
+void docDelete(size_t off, size_t len) {
+  /* Removes a range of bytes from the document.
+   *
+   * off: document offset of the first byte to remove
+   * len: number of bytes to remove
+   */
+  journalAppend(1, off, NULL, len);
+  colCacheEdit(1, off, NULL, len);
+  E.edits++;
+  if (E.dockind == DOC_ROWS) {
+    syntaxLock(&E.hlworker);
+    rowsDelete(&E.rows, off, len);
+    syntaxUnlock(&E.hlworker);
+    wrapEdit(&E.wrap, &E.rows, off);
+  } else {
+    ptDelete(&E.pt, off, len);
+  }
+}
+
+/*** syntax highlighting ***/
+
+int isSeparator(int c) {
+  /* Returns:
+   *  1 if a character can't be part of a keyword or number
+   */
+  if (isalnum(c) || c == '_' || c >= 0x80)
+    return 0;
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}", c) != NULL;
+}
+
+int syntaxLex(struct editorSyntax *syn, const char *p, int n, int state,
+              unsigned char *hl) {
+  /* Lexes one row, giving every byte a highlight class.
+   *
+   * syn: how to highlight the file
+   * p: text of the row
+   * n: length of the row
+   * state: lexer state at the start of the row
+   * hl: receives n highlight classes, or NULL to only get the end state
+   *
+   * Returns:
+   *  the lexer state at the end of the row
+   */
+  const char **keywords = syn->keywords;
+  const char *scs = syn->comment;
+  const char *mcs = syn->mlstart;
+  const char *mce = syn->mlend;
+  int scslen = scs ? strlen(scs) : 0;
+  int mcslen = mcs ? strlen(mcs) : 0;
+  int mcelen = mce ? strlen(mce) : 0;
+
+  int prevsep = 1;
+  int prevhl = HL_NORMAL;
+  int instring = 0;
+  int incomment = state == LEX_COMMENT;
+  int i = 0;
+  while (i < n) {
+    char c = p[i];
+    int cls = HL_NORMAL;
+    int len = 1;
+
+    if (scslen && c == scs[0] && !instring && !incomment &&
+        n - i >= scslen && memcmp(p + i, scs, scslen) == 0) {
+      if (hl)
+        memset(hl + i, HL_COMMENT, n - i);
+      break;
+    }
+
+    if (mcslen && mcelen && !instring) {
+      if (incomment) {
+        cls = HL_COMMENT;
+        if (c == mce[0] && n - i >= mcelen &&
+            memcmp(p + i, mce, mcelen) == 0) {
+          len = mcelen;
+          incomment = 0;
+        }
+        goto next;
+      } else if (c == mcs[0] && n - i >= mcslen &&
+                 memcmp(p + i, mcs, mcslen) == 0) {
+        cls = HL_COMMENT;
+        len = mcslen;
+        incomment = 1;
+        goto next;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_STRINGS) {
+      if (instring) {
+        cls = HL_STRING;
+        if (c == '\\' && i + 1 < n)
+          len = 2;
+        else if (c == instring)
+          instring = 0;
+        goto next;
+      } else if (c == '"' || c == '\'') {
+        instring = c;
+        cls = HL_STRING;
+        goto next;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit((unsigned char)c) && (prevsep || prevhl == HL_NUMBER)) ||
+          (c == '.' && prevhl == HL_NUMBER)) {
+        cls = HL_NUMBER;
+        goto next;
+      }
+    }
+
+    if (prevsep && !isSeparator((unsigned char)c)) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        if (keywords[j][0] != c)
+          continue;
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+          klen--;
+        if (n - i >= klen && memcmp(p + i, keywords[j], klen) == 0 &&
+            (i + klen == n || isSeparator((unsigned char)p[i + klen]))) {
+          cls = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+          len = klen;
+          break;
+        }
+      }
+    }
+
+  next:
+    if (hl) {
+      hl[i] = cls;
+      if (len > 1)
+        memset(hl + i + 1, cls, len - 1);
+    }
+    // a string or comment ends with a separator as far as what follows goes
+    prevsep = cls == HL_STRING || cls == HL_COMMENT ||
+              isSeparator((unsigned char)p[i + len - 1]);
+    prevhl = cls;
+    i += len;
+  }
+  return incomment ? LEX_COMMENT : LEX_NORMAL;
+}
+
+const char *syntaxRowText(struct rowStore *rs, int r, struct abuf *sb) {
+  /* Gets the text of a row as contiguous bytes, straight from the arena when
+   * its gap is at the end, else copied.
+   *
+   * rs: the row store
+   * r: the row
+   * sb: buffer for a copy
+   *
+   * Returns:
+   *  pointer to the row's text, valid until the row store changes or the
+   *  next call with the same sb
+   */
+  if (rs->gap[r] == rs->len[r])
+    return rs->arena + rs->off[r];
+  if (abReserve(sb, rs->len[r]) == -1)
+    die("malloc");
+  rowsCopy(rs, r, 0, sb->b, rs->len[r]);
+  return sb->b;
+}
+
+int syntaxRowEnd(struct rowStore *rs, int r, struct abuf *sb) {
+  /* Lexes a row from its start state, which must be valid.
+   *
+   * rs: the row store
+   * r: the row
+   * sb: buffer for copying the row
+   *
+   * Returns:
+   *  the lexer state at the end of the row
+   */
+  return syntaxLex(E.syntax, syntaxRowText(rs, r, sb), rs->len[r], rs->hl[r],
+                   NULL);
+}
+
+void syntaxUpdate(int upto) {
+  /* Brings the lexer states up to date as far as a row, for drawing it.
+   * Edited rows are re-lexed, and the rows after them only until a state
+   * comes out the same as before, since from there on nothing changes. Past
+   * the screen that is left to the highlighter thread, which also lexes the
+   * rows no one has looked at yet.
+   *
+   * upto: last row that needs a valid start state
+   */
+  struct rowStore *rs = &E.rows;
+  struct syntaxWorker *w = &E.hlworker;
+  if (upto >= rs->numrows)
+    upto = rs->numrows - 1;
+  syntaxLock(w);
+
+  if (rs->hleditend >= rs->hledit && rs->hledit < rs->hlvalid) {
+    int r = rs->hledit;
+    while (r + 1 < rs->numrows) {
+      int end = syntaxRowEnd(rs, r, &E.hlrow);
+      r++;
+      if (r > rs->hleditend && r < rs->hlvalid && rs->hl[r] == end)
+        break;
+      rs->hl[r] = end;
+      if (r >= rs->hlvalid || r > upto) {
+        rs->hlvalid = r + 1;
+        break;
+      }
+    }
+  }
+  rs->hledit = 0;
+  rs->hleditend = -1;
+
+  while (rs->hlvalid <= upto) {
+    rs->hl[rs->hlvalid] = syntaxRowEnd(rs, rs->hlvalid - 1, &E.hlrow);
+    rs->hlvalid++;
+  }
+  if (rs->hlvalid < rs->numrows)
+    pthread_cond_signal(&w->work);
+  syntaxUnlock(w);
+}
+
+void *syntaxThread(void *arg) {
+  /* Highlighter thread body: lexes rows past the valid states while there
+   * are any. Between rows it steps aside whenever the editor wants the
+   * lock, waiting until the editor has had it, so edits and frames never
+   * wait for more than the row being lexed.
+   *
+   * arg: the highlighter thread's state
+   */
+  struct syntaxWorker *w = arg;
+  struct rowStore *rs = &E.rows;
+  struct abuf sb = ABUF_INIT;
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    if (__atomic_load_n(&w->wanted, __ATOMIC_SEQ_CST) > 0) {
+      pthread_cond_wait(&w->yield, &w->lock);
+      continue;
+    }
+    if (E.syntax == NULL || E.dockind != DOC_ROWS ||
+        rs->hlvalid >= rs->numrows) {
+      pthread_cond_wait(&w->work, &w->lock);
+      continue;
+    }
+    rs->hl[rs->hlvalid] = syntaxRowEnd(rs, rs->hlvalid - 1, &sb);
+    rs->hlvalid++;
+  }
+  return NULL;
+}
+
+void syntaxInit(struct syntaxWorker *w) {
+  /* Sets up the highlighter thread's lock. The thread itself is started by
+   * the first file that gets highlighted.
+   *
+   * w: the highlighter thread's state
+   */
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->yield, NULL);
+  w->wanted = 0;
+  w->running = 0;
+}
+
+void syntaxSelect(const char *filename) {
+  /* Picks the highlighting for a file by the end of its name.
+   *
+   * filename: name of the file, or NULL
+   */
+  struct editorSyntax *syn = NULL;
+  size_t flen = filename ? strlen(filename) : 0;
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES && syn == NULL; j++) {
+    const char **m;
+    for (m = HLDB[j].filematch; *m; m++) {
+      size_t mlen = strlen(*m);
+      if (flen >= mlen && strcmp(filename + flen - mlen, *m) == 0) {
+        syn = &HLDB[j];
+        break;
+      }
+    }
+  }
+
+  struct syntaxWorker *w = &E.hlworker;
+  syntaxLock(w);
+  E.syntax = syn;
+  pthread_cond_signal(&w->work);
+  syntaxUnlock(w);
+  if (syn && !w->running &&
+      pthread_create(&w->thread, NULL, syntaxThread, w) == 0)
+    w->running = 1;
+}
+
+/*** undo ***/
+
+void undoReset(struct undoLog *u) {
+  /* Forgets all history, keeping the log's memory and file for reuse.
+   *
+   * u: the log
+   */
+  u->memlen = 0;
+  u->spilled = 0;
+  u->floor = 0;
+  u->end = 0;
+  u->cur = 0;
+  u->last = UNDO_NONE;
+  u->seal = 1;
+  u->join = 0;
+}
+
+void undoInit(struct undoLog *u) {
+  /* Sets up an empty log with the default memory cap.
+   *
+   * u: the log
+   */
+  u->mem = NULL;
+  u->memcap = 0;
+  u->fd = -1;
+  u->cap = UNDO_MEM_DEFAULT;
+  u->text.b = NULL;
+  u->text.len = 0;
+  u->text.cap = 0;
+  undoReset(u);
+}
+
+int undoRead(struct undoLog *u, size_t pos, void *buf, size_t len) {
+  /* Copies bytes out of the log, from the file for the part spilled to it.
+   *
+   * u: the log
+   * pos: log position of the bytes
+   * buf: receives the bytes
+   * len: number of bytes
+   *
+   * Returns:
+   *  0 on success, -1 if the file couldn't be read
+   */
+  char *out = buf;
+  while (len > 0 && pos < u->spilled) {
+    size_t n = u->spilled - pos < len ? u->spilled - pos : len;
+    ssize_t r = pread(u->fd, out, n, pos);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    out += r;
+    pos += r;
+    len -= r;
+  }
+  if (len > 0)
+    memcpy(out, u->mem + (pos - u->spilled), len);
+  return 0;
+}
+
+void undoAppend(struct undoLog *u, const void *p, size_t len) {
+  /* Adds bytes to the end of the log.
+   *
+   * u: the log, with nothing left to redo
+   * p: the bytes
+   * len: number of bytes
+   */
+  if (u->memlen + len > u->memcap) {
+    size_t cap = u->memcap ? u->memcap * 2 : 4096;
+    while (cap < u->memlen + len)
+      cap *= 2;
+    char *new = realloc(u->mem, cap);
+    if (new == NULL)
+      die("realloc");
+    u->mem = new;
+    u->memcap = cap;
+  }
+  memcpy(u->mem + u->memlen, p, len);
+  u->memlen += len;
+  u->end += len;
+}
+
+void undoSpill(struct undoLog *u) {
+  /* Moves everything before the last record out of memory once the log
+   * outgrows its cap, to the log's temporary file. The last record stays so
+   * typing can go on adding to it. If the file can't be written that history
+   * is dropped instead.
+   *
+   * u: the log
+   */
+  if (u->memlen <= u->cap || u->last == UNDO_NONE || u->last <= u->spilled)
+    return;
+
+  size_t n = u->last - u->spilled;
+  if (u->fd == -1) {
+    const char *tmpdir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/txt-undo-XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    u->fd = mkstemp(path);
+    if (u->fd != -1)
+      unlink(path);
+  }
+  size_t done = 0;
+  while (u->fd != -1 && done < n) {
+    ssize_t w = pwrite(u->fd, u->mem + done, n - done, u->spilled + done);
+    if (w == -1 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    done += w;
+  }
+  if (done < n)
+    u->floor = u->last;
+
+  memmove(u->mem, u->mem + n, u->memlen - n);
+  u->memlen -= n;
+  u->spilled += n;
+  // let go of the room a big record took once it has moved out
+  if (u->memcap > 2 * u->cap && u->memlen <= u->cap) {
+    size_t cap = u->cap > 4096 ? u->cap : 4096;
+    char *new = realloc(u->mem, cap);
+    if (new != NULL) {
+      u->mem = new;
+      u->memcap = cap;
+    }
+  }
+}
+
+void undoPush(int flags, size_t off, const char *s, size_t len) {
+  /* Records an edit about to be made. An edit that carries on from the last
+   * one, the next character typed or deleted, is added to its record so a
+   * run of typing is undone as one edit.
+   *
+   * flags: UNDO_DELETE and UNDO_BACKWARD as fit the edit
+   * off: document offset of the edit
+   * s: the bytes inserted or about to be removed, in document order
+   * len: number of bytes
+   */
+  struct undoLog *u = &E.undo;
+  struct undoRecord r;
+  int i;
+
+  // an edit after undoing drops what could have been redone
+  if (u->cur < u->end) {
+    if (u->cur < u->spilled) {
+      u->spilled = u->cur;
+      u->memlen = 0;
+    } else {
+      u->memlen = u->cur - u->spilled;
+    }
+    u->end = u->cur;
+  }
+
+  if (!u->seal && u->last != UNDO_NONE && u->last >= u->spilled) {
+    memcpy(&r, u->mem + (u->last - u->spilled), sizeof(r));
+    int carries;
+    if ((r.flags & ~UNDO_JOINED) != flags)
+      carries = 0;
+    else if (flags & UNDO_BACKWARD)
+      carries = off + len == r.off;
+    else if (flags & UNDO_DELETE)
+      carries = off == r.off;
+    else
+      carries = off == r.off + r.len;
+    if (carries) {
+      if (flags & UNDO_BACKWARD)
+        r.off = off;
+      r.len += len;
+      memcpy(u->mem + (u->last - u->spilled), &r, sizeof(r));
+      if (flags & UNDO_BACKWARD)
+        for (i = len - 1; i >= 0; i--)
+          undoAppend(u, s + i, 1);
+      else
+        undoAppend(u, s, len);
+      u->cur = u->end;
+      u->join = 0;
+      return;
+    }
+  }
+
+  r.off = off;
+  r.len = len;
+  r.prev = u->last;
+  r.flags = flags | (u->join ? UNDO_JOINED : 0);
+  u->last = u->end;
+  undoAppend(u, &r, sizeof(r));
+  if (flags & UNDO_BACKWARD)
+    for (i = len - 1; i >= 0; i--)
+      undoAppend(u, s + i, 1);
+  else
+    undoAppend(u, s, len);
+  u->cur = u->end;
+  u->seal = 0;
+  u->join = 0;
+  undoSpill(u);
+}
+
+int undoApply(struct undoRecord *r, size_t pos, int redo) {
+  /* Undoes or redoes one record and puts the cursor where it happened.
+   *
+   * r: the record
+   * pos: log position of the record
+   * redo: make the edit again rather than take it back
+   *
+   * Returns:
+   *  0 on success, -1 if the record's bytes couldn't be read
+   */
+  struct undoLog *u = &E.undo;
+  size_t cursor = r->off;
+  // undoing a deletion or redoing an insertion puts the bytes back
+  int insert = (r->flags & UNDO_DELETE) ? !redo : redo;
+  if (insert) {
+    u->text.len = 0;
+    if (abReserve(&u->text, r->len) == -1)
+      die("malloc");
+    char *p = u->text.b;
+    if (undoRead(u, pos + sizeof(*r), p, r->len) == -1)
+      return -1;
+    if (r->flags & UNDO_BACKWARD) {
+      size_t i;
+      for (i = 0; i < r->len / 2; i++) {
+        char c = p[i];
+        p[i] = p[r->len - 1 - i];
+        p[r->len - 1 - i] = c;
+      }
+    }
+    docInsert(r->off, p, r->len);
+    // typing redone and backspacing undone leave the cursor after the text
+    if (redo || (r->flags & UNDO_BACKWARD))
+      cursor += r->len;
+  } else {
+    docDelete(r->off, r->len);
+  }
+  E.cy = docLineOf(cursor, &E.cx);
+  return 0;
+}
+
+void editorUndo() {
+  /* Takes back the last edit, with the edits joined to it.
+   */
+  struct undoLog *u = &E.undo;
+  struct undoRecord r;
+  do {
+    if (u->last == UNDO_NONE || u->last < u->floor)
+      break;
+    if (undoRead(u, u->last, &r, sizeof(r)) == -1 ||
+        undoApply(&r, u->last, 0) == -1) {
+      // the file let us down, so this is as far back as it goes
+      u->floor = u->cur;
+      break;
+    }
+    u->cur = u->last;
+    u->last = r.prev;
+  } while (r.flags & UNDO_JOINED);
+  u->seal = 1;
+}
+
+void editorRedo() {
+  /* Makes the last edit undone again, with the edits joined to it.
+   */
+  struct undoLog *u = &E.undo;
+  struct undoRecord r;
+  while (u->cur < u->end) {
+    if (undoRead(u, u->cur, &r, sizeof(r)) == -1 ||
+        undoApply(&r, u->cur, 1) == -1)
+      break;
+    u->last = u->cur;
+    u->cur += sizeof(r) + r.len;
+    if (u->cur == u->end || undoRead(u, u->cur, &r, sizeof(r)) == -1 ||
+        !(r.flags & UNDO_JOINED))
+      break;
+  }
+  u->seal = 1;
+}
+
+/*** save ***/
+
+void saveCollect(struct saveState *s, struct pieceNode *t) {
+  /* Appends the pieces of a tree to the save's snapshot in document order,
+   * joining pieces that continue one another.
+   *
+   * s: the save
+   * t: root of the tree
+   */
+  if (t == NULL)
+    return;
+  saveCollect(s, t->left);
+  struct piece *last = s->nspans > 0 ? &s->spans[s->nspans - 1] : NULL;
+  if (last != NULL && last->buf == t->p.buf &&
+      last->start + last->len == t->p.start) {
+    last->len += t->p.len;
+  } else {
+    if (s->nspans == s->spancap) {
+      int cap = s->spancap ? s->spancap * 2 : 64;
+      struct piece *new = realloc(s->spans, sizeof(struct piece) * cap);
+      if (new == NULL)
+        die("realloc");
+      s->spans = new;
+      s->spancap = cap;
+    }
+    s->spans[s->nspans++] = t->p;
+  }
+  saveCollect(s, t->right);
+}
+
+int saveFail(struct saveState *s, const char *what) {
+  /* Records why a save failed, keeping the first failure.
+   *
+   * s: the save
+   * what: the call that failed, with errno set by it
+   *
+   * Returns:
+   *  -1
+   */
+  if (s->failed == NULL) {
+    s->failed = what;
+    s->err = errno;
+  }
+  return -1;
+}
+
+void saveProgress(struct saveState *s, size_t n) {
+  /* Counts bytes written, waking the event loop every SAVE_WAKE bytes so the
+   * status bar can follow along.
+   *
+   * s: the save
+   * n: bytes just written
+   */
+  size_t before = __atomic_fetch_add(&s->written, n, __ATOMIC_RELAXED);
+  if (before / SAVE_WAKE != (before + n) / SAVE_WAKE)
+    editorWake();
+}
+
+int saveWriteAll(struct saveState *s, int fd, const char *p, size_t n) {
+  /* Writes a buffer out in full.
+   *
+   * s: the save
+   * fd: the temporary file
+   * p: the bytes
+   * n: number of bytes
+   *
+   * Returns:
+   *  0 on success, -1 on error
+   */
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return saveFail(s, "write");
+    }
+    p += w;
+    n -= w;
+    saveProgress(s, w);
+  }
+  return 0;
+}
+
+ssize_t saveCopyRange(struct saveState *s, int fd, size_t off, size_t len) {
+  /* Has the kernel copy a span of the original file into the temporary file
+   * without it passing through the mapping.
+   *
+   * s: the save
+   * fd: the temporary file
+   * off: offset of the span in the original file
+   * len: length of the span
+   *
+   * Returns:
+   *  bytes copied, short of len when the kernel can't copy between these
+   *  files and the rest has to be written by hand, or -1 on error
+   */
+  loff_t in = off;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = copy_file_range(E.fd, &in, fd, NULL, len - done, 0);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+          errno == EOPNOTSUPP)
+        break;
+      return saveFail(s, "copy_file_range");
+    }
+    if (n == 0)
+      break;
+    done += n;
+    saveProgress(s, n);
+  }
+  return done;
+}
+
+int saveWrite(struct saveState *s, int fd) {
+  /* Writes the snapshot to the temporary file. Bytes are gathered into large
+   * writes, except for long spans of the mapped original, which the kernel
+   * copies from the file directly.
+   *
+   * s: the save
+   * fd: the temporary file
+   *
+   * Returns:
+   *  0 on success, -1 on error
+   */
+  if (s->copy != NULL)
+    return saveWriteAll(s, fd, s->copy, s->total);
+
+  char *buf = malloc(SAVE_BUF);
+  if (buf == NULL)
+    return saveFail(s, "malloc");
+  size_t len = 0;
+  int kernel = E.origmapped;
+  int i;
+  for (i = 0; i < s->nspans; i++) {
+    struct piece *sp = &s->spans[i];
+    size_t start = sp->start;
+    size_t left = sp->len;
+    if (sp->buf == PIECE_ORIG && kernel && left >= SAVE_COPY_MIN) {
+      if (saveWriteAll(s, fd, buf, len) == -1)
+        break;
+      len = 0;
+      ssize_t n = saveCopyRange(s, fd, start, left);
+      if (n == -1)
+        break;
+      if ((size_t)n < left)
+        kernel = 0;
+      start += n;
+      left -= n;
+    }
+    while (left > 0) {
+      size_t n = SAVE_BUF - len < left ? SAVE_BUF - len : left;
+      if (sp->buf == PIECE_ORIG) {
+        memcpy(buf + len, E.orig + start, n);
+      } else {
+        pthread_mutex_lock(&s->lock);
+        memcpy(buf + len, E.pt.add + start, n);
+        pthread_mutex_unlock(&s->lock);
+      }
+      len += n;
+      start += n;
+      left -= n;
+      if (len == SAVE_BUF) {
+        if (saveWriteAll(s, fd, buf, len) == -1)
+          break;
+        len = 0;
+      }
+    }
+    if (s->failed != NULL)
+      break;
+  }
+  if (s->failed == NULL)
+    saveWriteAll(s, fd, buf, len);
+  free(buf);
+  return s->failed == NULL ? 0 : -1;
+}
+
+void *saveThread(void *arg) {
+  /* Save thread body: writes the snapshot to a temporary file in the same
+   * directory, flushes it as the sync setting asks and renames it over the
+   * file, so the file is only ever the old or the new document. A symlink is
+   * followed and the file it points to replaced.
+   *
+   * arg: the save
+   */
+  struct saveState *s = arg;
+  char *target = realpath(s->path, NULL);
+  const char *path = target != NULL ? target : s->path;
+  const char *slash = strrchr(path, '/');
+  int dirlen = slash != NULL ? slash - path + 1 : 0;
+  size_t size = strlen(path) + 16;
+  // the main thread may be drawing, so failures are left for it to report
+  // rather than ending the editor from here
+  char *tmp = malloc(size);
+  int fd = -1;
+  if (tmp == NULL) {
+    saveFail(s, "malloc");
+  } else {
+    snprintf(tmp, size, "%.*s.%s.XXXXXX", dirlen, path, path + dirlen);
+    fd = mkstemp(tmp);
+    if (fd == -1)
+      saveFail(s, "mkstemp");
+  }
+  if (fd != -1) {
+    // mkstemp makes the file private; give it the permissions and owner of
+    // the file it replaces, as far as allowed
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+        saveFail(s, "fchown");
+      if (fchmod(fd, st.st_mode & 07777) == -1)
+        saveFail(s, "fchmod");
+    } else if (fchmod(fd, s->mode) == -1) {
+      saveFail(s, "fchmod");
+    }
+
+    if (s->failed == NULL && saveWrite(s, fd) == 0 && s->sync != SYNC_NONE &&
+        fsync(fd) == -1)
+      saveFail(s, "fsync");
+    if (close(fd) == -1)
+      saveFail(s, "close");
+    if (s->failed == NULL && rename(tmp, path) == -1)
+      saveFail(s, "rename");
+    if (s->failed != NULL)
+      unlink(tmp);
+  }
+
+  // the rename itself only lasts once the directory is flushed too
+  if (s->failed == NULL && s->sync == SYNC_FULL) {
+    char *dir = dirlen > 0 ? strndup(path, dirlen) : strdup(".");
+    int dfd = dir != NULL ? open(dir, O_RDONLY | O_DIRECTORY) : -1;
+    if (dir == NULL)
+      saveFail(s, "strdup");
+    else if (dfd == -1 || fsync(dfd) == -1)
+      saveFail(s, "fsync");
+    if (dfd != -1)
+      close(dfd);
+    free(dir);
+  }
+
+  free(tmp);
+  free(target);
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  editorWake();
+  return NULL;
+}
+
+void saveInit(struct saveState *s) {
+  /* Sets up an idle save state.
+   *
+   * s: the save state
+   */
+  pthread_mutex_init(&s->lock, NULL);
+  s->running = 0;
+  s->sync = SYNC_FULL;
+  s->spans = NULL;
+  s->nspans = 0;
+  s->spancap = 0;
+  s->copy = NULL;
+  s->path = NULL;
+}
+
+void saveDone(struct saveState *s) {
+  /* Lets go of a finished save's snapshot and leaves its outcome on the
+   * status bar.
+   *
+   * s: the save, whose thread has been joined
+   */
+  s->running = 0;
+  if (s->failed != NULL)
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "save failed: %s: %s",
+             s->failed, strerror(s->err));
+  else
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "wrote %zu bytes in %lld ms",
+             s->total, editorNow() - s->started);
+  // the journal only needs the edits made since the snapshot
+  if (s->failed == NULL) {
+    journalRestartAt(s->journaled, s->path);
+    if (s->edits > E.savededits)
+      E.savededits = s->edits;
+  }
+  free(s->path);
+  free(s->copy);
+  s->path = NULL;
+  s->copy = NULL;
+  s->nspans = 0;
+  E.dirty = 1;
+}
+
+void editorSaveReap() {
+  /* Picks up the save thread once it has finished.
+   */
+  struct saveState *s = &E.save;
+  if (!s->running || !__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+    return;
+  pthread_join(s->thread, NULL);
+  saveDone(s);
+}
+
+void editorSaveFinish() {
+  /* Waits for a save in progress to complete. Used before the document or
+   * the file behind it goes away, and by headless runs.
+   */
+  struct saveState *s = &E.save;
+  if (!s->running)
+    return;
+  pthread_join(s->thread, NULL);
+  saveDone(s);
+}
+
+void editorSave() {
+  /* Starts saving the document to its file on the save thread. The document
+   * is snapshotted first, so editing goes on while the save runs and edits
+   * made meanwhile are left for the next save. Pieces are snapshotted as
+   * they are, the row store, at most ROWS_MAX_FILE bytes, is copied out.
+   */
+  struct saveState *s = &E.save;
+  if (s->running)
+    return;
+  if (E.filename == NULL) {
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "no file name to save to");
+    return;
+  }
+
+  s->path = strdup(E.filename);
+  if (s->path == NULL)
+    die("strdup");
+  s->total = docLength();
+  s->nspans = 0;
+  s->copy = NULL;
+  if (E.dockind == DOC_ROWS) {
+    s->copy = malloc(s->total + 1);
+    if (s->copy == NULL)
+      die("malloc");
+    docRead(0, s->copy, s->total);
+  } else {
+    saveCollect(s, E.pt.root);
+  }
+  mode_t mask = umask(0);
+  umask(mask);
+  s->mode = 0666 & ~mask;
+  s->written = 0;
+  s->done = 0;
+  s->failed = NULL;
+  s->err = 0;
+  s->started = editorNow();
+  s->journaled = E.journal.appended;
+  s->edits = E.edits;
+  E.statusmsg[0] = '\0';
+
+  s->running = 1;
+  if (pthread_create(&s->thread, NULL, saveThread, s) != 0) {
+    // no thread to be had: save in place instead
+    saveThread(s);
+    saveDone(s);
+  }
+}
+
+/*** file i/o ***/
+
+void editorReadStream(int fd) {
+  /* Reads a file that cannot be mapped (pipes, character devices, procfs
+   * files) into a heap buffer that becomes the original buffer.
+   *
+   * fd: the file to read until end of file
+   */
+  size_t cap = 1 << 16;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL)
+    die("malloc");
+
+  while (1) {
+    if (len == cap) {
+      cap *= 2;
+      char *new = realloc(buf, cap);
+      if (new == NULL)
+        die("realloc");
+      buf = new;
+    }
+    ssize_t n = read(fd, buf + len, cap - len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      die("read");
+    }
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  E.orig = buf;
+  E.origlen = len;
+  E.origmapped = 0;
+}
+
+void editorCloseFile() {
+  /* Drops the document and lets go of the file behind it, leaving an empty
+   * document with no file name.
+   */
+  // a save still reading the document finishes first
+  editorSaveFinish();
+  journalClose(1);
+  // stops the highlighter thread from looking at the rows
+  syntaxSelect(NULL);
+  undoReset(&E.undo);
+  lineIndexFree(&E.index);
+  ptFree(&E.pt);
+  rowsFree(&E.rows);
+  if (E.origmapped)
+    munmap(E.orig, E.origlen);
+  else
+    free(E.orig);
+  if (E.fd != -1)
+    close(E.fd);
+  free(E.filename);
+
+  E.filename = NULL;
+  E.fd = -1;
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origmapped = 0;
+  E.origrandom = 0;
+  E.cx = 0;
+  E.cy = 0;
+  E.rowoff = 0;
+  E.rowsub = 0;
+  E.coloff = 0;
+  E.follow.size = 0;
+  E.follow.toend = 0;
+  E.edits = 0;
+  E.savededits = 0;
+  E.wrap.valid = 0;
+  E.dockind = DOC_ROWS;
+  colCacheClear(&E.cols);
+  rowsInit(&E.rows);
+  lineIndexInit(&E.index, NULL, 0);
+  ptInit(&E.pt, NULL, 0, &E.index);
+}
+
+void editorOpen(char *filename) {
+  /* Opens a file as the document. Regular files are mapped read-only and used
+   * in place as the piece table's original buffer, so only the pages that get
+   * looked at are ever read from disk. Anything else is streamed into memory.
+   * A file that does not exist yet opens as an empty document.
+   *
+   * filename: path of the file to open
+   */
+  editorCloseFile();
+  E.filename = strdup(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      E.dockind = E.forcepieces ? DOC_PIECES : DOC_ROWS;
+      syntaxSelect(filename);
+      journalStart(filename);
+      return;
+    }
+    die("open");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    die("fstat");
+
+  E.fd = fd;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      // the first pass over a freshly opened file reads it front to back
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      E.orig = map;
+      E.origlen = st.st_size;
+      E.origmapped = 1;
+    }
+  }
+  if (E.orig == NULL)
+    editorReadStream(fd);
+  E.follow.size = E.origlen;
+
+  ptFree(&E.pt);
+  lineIndexFree(&E.index);
+  if (!E.forcepieces && E.origlen <= ROWS_MAX_FILE) {
+    // typical files are copied into rows and the original let go
+    rowsLoad(&E.rows, E.orig, E.origlen);
+    if (E.origmapped)
+      munmap(E.orig, E.origlen);
+    else
+      free(E.orig);
+    E.orig = NULL;
+    E.origlen = 0;
+    E.origmapped = 0;
+    E.dockind = DOC_ROWS;
+  } else {
+    E.dockind = DOC_PIECES;
+  }
+
+  lineIndexInit(&E.index, E.orig, E.origlen);
+  ptInit(&E.pt, E.orig, E.origlen, &E.index);
+  if (E.indexthread)
+    lineIndexStart(&E.index);
+  syntaxSelect(filename);
+  journalStart(filename);
+}
+
+void editorRecover(int replay) {
+  /* Settles what to do with the edits found in a journal at open: replays
+   * them over the file, or throws them away. Replayed edits stay in the
+   * journal, as they are still not saved; a record that doesn't fit the
+   * document ends the replay, and the journal is cut before it so the edits
+   * made from here on can be replayed after the ones that were.
+   *
+   * replay: replay the edits rather than discard them
+   */
+  struct journal *j = &E.journal;
+  long long t = editorNow();
+  if (replay) {
+    size_t pos = sizeof(struct journalHeader);
+    size_t off = 0;
+    int count = 0;
+    while (pos < j->foundlen) {
+      struct journalRecord r;
+      memcpy(&r, j->found + pos, sizeof(r));
+      size_t len = docLength();
+      if (r.off > len || (r.del && r.len > len - r.off))
+        break;
+      if (r.del) {
+        docDelete(r.off, r.len);
+        off = r.off;
+      } else {
+        docInsert(r.off, j->found + pos + sizeof(r), r.len);
+        off = r.off + r.len;
+      }
+      pos += sizeof(r) + (r.del ? 0 : r.len);
+      count++;
+    }
+    E.cy = docLineOf(off, &E.cx);
+    snprintf(E.statusmsg, sizeof(E.statusmsg),
+             "recovered %d unsaved edits in %lld ms", count, editorNow() - t);
+
+    // carry on after the last record replayed
+    j->fd = open(j->path, O_RDWR);
+    if (j->fd == -1 || ftruncate(j->fd, pos) == -1) {
+      if (j->fd != -1)
+        close(j->fd);
+      j->fd = -1;
+      unlink(j->path);
+    } else {
+      j->appended = pos - sizeof(struct journalHeader);
+    }
+  } else {
+    unlink(j->path);
+  }
+  free(j->found);
+  j->found = NULL;
+  j->recover = 0;
+  j->active = 1;
+}
+
+void editorAdviseJump(size_t off) {
+  /* Tells the kernel that the mapping is no longer read sequentially once the
+   * cursor starts jumping around, and prefetches the pages around the
+   * landing spot.
+   *
+   * off: document offset being jumped to
+   */
+  if (!E.origmapped || E.dockind != DOC_PIECES)
+    return;
+  if (!E.origrandom) {
+    madvise(E.orig, E.origlen, MADV_RANDOM);
+    E.origrandom = 1;
+  }
+
+  // prefetch the original bytes the piece at off refers to, if any
+  const char *p;
+  size_t n = docSpan(off, &p);
+  if (n > 0 && p >= E.orig && p < E.orig + E.origlen) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (p - E.orig) & ~(page - 1);
+    size_t len = 1 << 20;
+    if (start + len > E.origlen)
+      len = E.origlen - start;
+    madvise(E.orig + start, len, MADV_WILLNEED);
+  }
+}
+
+/*** editor operations ***/
+
+int editorRowExists(int line) {
+  /* Checks whether a line holds text (a newline ending the document does not
+   * start another row).
+   *
+   * line: zero based line number
+   *
+   * Returns:
+   *  1 if the row exists, 0 if not
+   */
+  size_t start;
+  return docLineStart(line, &start) == 0 && start < docLength();
+}
+
+int editorLastLine() {
+  /* Finds the last line the cursor can reach, counting the lines of the
+   * whole document only if they aren't counted already.
+   *
+   * Returns:
+   *  the zero based line after the document's last newline, or after its
+   *  last row if that has no newline
+   */
+  int col;
+  int line = docLineOf(docLength(), &col);
+  return col > 0 ? line + 1 : line;
+}
+
+size_t editorLineEnd(int line) {
+  /* Finds where a line ends from where the next one starts, so a long line
+   * isn't scanned.
+   *
+   * line: zero based line number of a line that exists
+   *
+   * Returns:
+   *  the document offset of the line's newline, or the document length
+   */
+  size_t next;
+  if (docLineStart(line + 1, &next) == 0)
+    return next - 1;
+  return docLength();
+}
+
+int editorRowLen(int line) {
+  /* Returns:
+   *  the length in bytes of a line without its newline, 0 if it does not exist
+   */
+  size_t start;
+  if (docLineStart(line, &start) == -1)
+    return 0;
+  return editorLineEnd(line) - start;
+}
+
+size_t editorCursorOffset() {
+  /* Returns:
+   *  the document offset under the cursor
+   */
+  size_t start;
+  if (docLineStart(E.cy, &start) == -1)
+    return docLength();
+  size_t rowlen = editorLineEnd(E.cy) - start;
+  return start + ((size_t)E.cx < rowlen ? (size_t)E.cx : rowlen);
+}
+
+void editorInsertText(const char *s, size_t len) {
+  /* Inserts text at the cursor as a single edit and moves the cursor to the
+   * end of it.
+   *
+   * s: the text to insert
+   * len: length of the text
+   */
+  size_t start;
+  if (docLineStart(E.cy, &start) == -1) {
+    // the cursor is on the line after a last row with no newline
+    undoPush(0, docLength(), "\n", 1);
+    docInsert(docLength(), "\n", 1);
+    docLineStart(E.cy, &start);
+    E.undo.join = 1;
+  }
+
+  size_t off = editorCursorOffset();
+  undoPush(0, off, s, len);
+  docInsert(off, s, len);
+
+  const char *nl = memrchr(s, '\n', len);
+  if (nl) {
+    // typing goes into a new record once a line is finished
+    E.undo.seal = 1;
+    E.cy += countNewlines(s, len);
+    E.cx = s + len - (nl + 1);
+  } else {
+    E.cx = off - start + len;
+  }
+}
+
+int editorEncodeUtf8(int c, char *buf) {
+  /* Encodes a code point as UTF-8.
+   *
+   * c: the unicode code point
+   * buf: receives up to 4 bytes
+   *
+   * Returns:
+   *  the number of bytes written
+   */
+  if (c < 0x80) {
+    buf[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    buf[0] = 0xc0 | (c >> 6);
+    buf[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else if (c < 0x10000) {
+    buf[0] = 0xe0 | (c >> 12);
+    buf[1] = 0x80 | ((c >> 6) & 0x3f);
+    buf[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  buf[0] = 0xf0 | (c >> 18);
+  buf[1] = 0x80 | ((c >> 12) & 0x3f);
+  buf[2] = 0x80 | ((c >> 6) & 0x3f);
+  buf[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+void editorInsertChar(int c) {
+  /* Inserts a character at the cursor and moves the cursor past it.
+   *
+   * c: the unicode code point to insert
+   */
+  char buf[4];
+  editorInsertText(buf, editorEncodeUtf8(c, buf));
+}
+
+void editorInsertNewline() {
+  /* Splits the line at the cursor.
+   */
+  editorInsertText("\n", 1);
+}
+
+void editorInsertPaste() {
+  /* Inserts the text of the last bracketed paste. Terminals send line breaks
+   * in pasted text as carriage returns.
+   */
+  char *p = E.paste.b;
+  int i, len = 0;
+  for (i = 0; i < E.paste.len; i++) {
+    if (p[i] == '\r') {
+      p[len++] = '\n';
+      if (i + 1 < E.paste.len && p[i + 1] == '\n')
+        i++;
+    } else {
+      p[len++] = p[i];
+    }
+  }
+  if (len > 0) {
+    // a paste is undone on its own
+    E.undo.seal = 1;
+    editorInsertText(p, len);
+    E.undo.seal = 1;
+  }
+  abReset(&E.paste);
+}
+
+int editorCharBefore(size_t off, size_t start, char *buf) {
+  /* Reads the character of a line that ends at a document offset.
+   *
+   * off: document offset just past the character
+   * start: where the line starts, before off
+   * buf: receives the bytes of the character, up to 4
+   *
+   * Returns:
+   *  the length of the character in bytes
+   */
+  int n = off - start < 4 ? off - start : 4;
+  docRead(off - n, buf, n);
+  int i = n - 1;
+  while (i > 0 && (buf[i] & 0xc0) == 0x80)
+    i--;
+  // a malformed sequence goes a byte at a time
+  int cp;
+  if (charDecode(buf + i, n - i, &cp) != n - i)
+    i = n - 1;
+  memmove(buf, buf + i, n - i);
+  return n - i;
+}
+
+void editorDelChar() {
+  /* Deletes the character left of the cursor, a whole UTF-8 sequence, joining
+   * lines when the cursor is at the start of one.
+   */
+  size_t start;
+  if (docLineStart(E.cy, &start) == -1)
+    return;
+
+  size_t off = editorCursorOffset();
+  if (off == 0)
+    return;
+  char buf[4] = {'\n'};
+  int n = off > start ? editorCharBefore(off, start, buf) : 1;
+  undoPush(UNDO_DELETE | UNDO_BACKWARD, off - n, buf, n);
+  if (off > start) {
+    docDelete(off - n, n);
+    E.cx = off - n - start;
+  } else {
+    E.cx = editorRowLen(E.cy - 1);
+    docDelete(off - 1, 1);
+    E.cy--;
+  }
+}
+
+void editorDelForward() {
+  /* Deletes the character under the cursor, joining the next line when the
+   * cursor is at the end of one.
+   */
+  size_t start;
+  if (docLineStart(E.cy, &start) == -1)
+    return;
+
+  size_t off = editorCursorOffset();
+  if (off < docLength()) {
+    char buf[4];
+    int cp;
+    int n = docCharAt(off, docLength(), &cp);
+    docRead(off, buf, n);
+    undoPush(UNDO_DELETE, off, buf, n);
+    docDelete(off, n);
+  }
+}
+
+/*** soft wrap ***/
+
+int wrapIndexReady() {
+  /* Brings the wrap index up to date if the document is wrapped and held in
+   * the row store, the one case it is kept for.
+   *
+   * Returns:
+   *  1 if the index can be used, 0 if lines have to be counted one by one
+   */
+  if (!E.softwrap || E.dockind != DOC_ROWS || E.screencols < 1)
+    return 0;
+  if (!E.wrap.valid || E.wrap.width != E.screencols)
+    wrapBuild(&E.wrap, &E.rows, E.screencols);
+  return 1;
+}
+
+int wrapLineRows(int line, int cap) {
+  /* Counts the screen rows a line takes, broken where wrapBreaks says; a
+   * line that fills its last row has another for a cursor past its end.
+   * Lines of the row store are counted in the wrap index, a line of the
+   * piece table only as far as the cap needs.
+   *
+   * line: zero based line number
+   * cap: the most rows to count, at least 1
+   *
+   * Returns:
+   *  the rows, at most cap; 1 when lines aren't wrapped or for a line that
+   *  doesn't exist
+   */
+  if (!E.softwrap || E.screencols < 1)
+    return 1;
+  int rows;
+  if (E.dockind == DOC_ROWS) {
+    if (line < 0 || line >= E.rows.numrows)
+      return 1;
+    wrapIndexReady();
+    rows = wrapRows(&E.wrap, line);
+  } else {
+    struct colLine *cl = colLookup(line);
+    if (cl == NULL)
+      return 1;
+    rows = colWrapTo(cl, E.screencols, cap, 0);
+  }
+  return rows < cap ? rows : cap;
+}
+
+int wrapMove(int *line, int *sub, int n) {
+  /* Moves a position down or up the screen rows of the document, stopping
+   * at the first row and at the last row the cursor can reach. Through the
+   * wrap index this takes O(log n) for any distance; otherwise the lines
+   * passed over are counted one at a time.
+   *
+   * line: line of the position, updated
+   * sub: screen row within the line, updated
+   * n: rows to move down, negative to move up
+   *
+   * Returns:
+   *  the rows moved, negative when moving up
+   */
+  if (wrapIndexReady()) {
+    int last = E.rows.numrows;
+    if (last > 0 && !editorRowExists(last - 1))
+      last--;
+    int total = wrapBefore(&E.wrap, last + 1);
+    int from = wrapBefore(&E.wrap, *line) + *sub;
+    int to = from + n;
+    if (to > total - 1)
+      to = total - 1;
+    if (to < 0)
+      to = 0;
+    *line = wrapFind(&E.wrap, to, sub);
+    return to - from;
+  }
+
+  int moved = 0;
+  while (n > 0) {
+    int rows = wrapLineRows(*line, *sub + n + 1);
+    if (*sub + n < rows) {
+      *sub += n;
+      moved += n;
+      break;
+    }
+    struct colLine *cl = colLookup(*line);
+    if (cl == NULL || cl->start >= docLength()) {
+      // the last line the cursor can reach
+      moved += rows - 1 - *sub;
+      *sub = rows - 1;
+      break;
+    }
+    moved += rows - *sub;
+    n -= rows - *sub;
+    (*line)++;
+    *sub = 0;
+  }
+  while (n < 0) {
+    if (*sub >= -n) {
+      *sub += n;
+      moved += n;
+      break;
+    }
+    if (*line == 0) {
+      moved -= *sub;
+      *sub = 0;
+      break;
+    }
+    moved -= *sub + 1;
+    n += *sub + 1;
+    (*line)--;
+    *sub = wrapLineRows(*line, INT_MAX) - 1;
+  }
+  return moved;
+}
+
+int wrapDistance(int line, int sub, int toline, int tosub, int limit) {
+  /* Counts the screen rows from one position down to another.
+   *
+   * line, sub: the upper position, a line and a screen row within it
+   * toline, tosub: the lower position
+   * limit: the most rows to count
+   *
+   * Returns:
+   *  the rows between them, at most limit
+   */
+  int d;
+  if (!E.softwrap) {
+    d = toline - line;
+  } else if (wrapIndexReady()) {
+    d = wrapBefore(&E.wrap, toline) + tosub - wrapBefore(&E.wrap, line) - sub;
+  } else {
+    d = tosub - sub;
+    for (; line < toline && d < limit; line++)
+      d += wrapLineRows(line, limit - d);
+  }
+  return d < limit ? d : limit;
+}
+
+size_t wrapOffset(int line, int sub, size_t x) {
+  /* Finds the character at a column of a screen row of a wrapped line. Past
+   * the end of a row cut short by a character that didn't fit, that is the
+   * row's last character, not the one on the next row.
+   *
+   * line: zero based line number
+   * sub: screen row within the line
+   * x: column on that row
+   *
+   * Returns:
+   *  the byte offset of the character in the line
+   */
+  struct colLine *cl = colLookup(line);
+  if (cl == NULL)
+    return 0;
+  size_t end;
+  size_t left = colWrapStart(cl, E.screencols, sub, &end);
+  size_t c = left + x < end ? left + x : end - 1;
+  return colLineOffset(cl, c, NULL);
+}
+
+int wrapRowOf(int line, size_t x, size_t *col) {
+  /* Finds the screen row of a wrapped line a byte of it is on.
+   *
+   * line: zero based line number
+   * x: byte offset in the line
+   * col: receives the column on that row the character at x starts in
+   *
+   * Returns:
+   *  the screen row within the line
+   */
+  size_t rx = colOf(line, x);
+  struct colLine *cl = colLookup(line);
+  if (cl == NULL) {
+    *col = rx;
+    return 0;
+  }
+  size_t start;
+  int sub = colWrapRow(cl, E.screencols, rx, &start);
+  *col = rx - start;
+  return sub;
+}
+
+int editorMoveRows(int n) {
+  /* Moves the cursor up or down a number of screen rows of wrapped lines,
+   * keeping its column on the row.
+   *
+   * n: rows to move down, negative to move up
+   *
+   * Returns:
+   *  the rows moved, negative when moving up
+   */
+  if (E.screencols < 1)
+    return 0;
+  size_t x;
+  int line = E.cy;
+  int sub = wrapRowOf(E.cy, E.cx, &x);
+  int moved = wrapMove(&line, &sub, n);
+  if (moved == 0)
+    return 0;
+  E.cy = line;
+  E.cx = wrapOffset(line, sub, x);
+  return moved;
+}
+
+void editorWrapToggle() {
+  /* Turns wrapping lines at the screen width on or off.
+   */
+  E.softwrap = !E.softwrap;
+  E.rowsub = 0;
+  E.coloff = 0;
+}
+
+/*** follow ***/
+
+void followUnwatch() {
+  /* Drops the inotify watches of the followed file and stops polling it.
+   */
+  struct follow *fw = &E.follow;
+#ifdef __linux__
+  if (fw->wfile != -1)
+    inotify_rm_watch(fw->ifd, fw->wfile);
+  if (fw->wdir != -1)
+    inotify_rm_watch(fw->ifd, fw->wdir);
+#endif
+  fw->wfile = -1;
+  fw->wdir = -1;
+  editorTimerCancel(TIMER_FOLLOW);
+}
+
+int followWatch() {
+  /* Watches the open file, and the directory it is in for a new file of the
+   * same name, with inotify.
+   *
+   * Returns:
+   *  1 if inotify watches the file, 0 if it has to be polled
+   */
+  struct follow *fw = &E.follow;
+  followUnwatch();
+#ifdef __linux__
+  if (fw->ifd == -1)
+    fw->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fw->ifd != -1) {
+    fw->wfile = inotify_add_watch(fw->ifd, E.filename,
+                                  IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                      IN_DELETE_SELF);
+    char *dir = strdup(E.filename);
+    if (dir == NULL)
+      die("strdup");
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL)
+      slash[1] = '\0';
+    fw->wdir = inotify_add_watch(fw->ifd, slash != NULL ? dir : ".",
+                                 IN_CREATE | IN_MOVED_TO);
+    free(dir);
+    if (fw->wdir != -1)
+      return 1;
+  }
+#endif
+  return 0;
+}
+
+int editorUnsaved() {
+  /* Returns:
+   *  1 if the document has edits the file on disk doesn't hold
+   */
+  return E.edits != E.savededits;
+}
+
+void followToEnd() {
+  /* Puts the cursor at the end of the document. Its line number takes
+   * counting every line of the file, so while the background line index
+   * hasn't got there yet the move waits for it rather than counting them
+   * here; editorHandleWake tries again when the index is done.
+   */
+  struct follow *fw = &E.follow;
+  if (E.dockind == DOC_PIECES && E.index.running &&
+      !lineIndexCovers(&E.index, E.origlen)) {
+    fw->toend = 1;
+    return;
+  }
+  fw->toend = 0;
+  E.cy = docLineOf(docLength(), &E.cx);
+}
+
+void followReopen() {
+  /* Opens the followed file again after it was truncated or replaced, and
+   * goes to its end. Opening it drops the document, so with edits that
+   * weren't saved following stops instead.
+   */
+  if (editorUnsaved()) {
+    E.follow.on = 0;
+    followUnwatch();
+    snprintf(E.statusmsg, sizeof(E.statusmsg),
+             "stopped following: the file was replaced and edits aren't "
+             "saved");
+    return;
+  }
+  char *filename = strdup(E.filename);
+  if (filename == NULL)
+    die("strdup");
+  editorOpen(filename);
+  free(filename);
+  // without a watch now, followPoll takes over
+  followWatch();
+  followToEnd();
+}
+
+int followAppend(size_t size) {
+  /* Appends bytes written to the followed file since it was last looked at
+   * to the document, reading only those bytes. Line counts of the new text
+   * are taken as it is inserted, so the line index grows with it. A cursor
+   * on the last line stays at the end, moved by the newlines read rather
+   * than by counting lines again. The bytes come from the file, so they
+   * leave a document that matched it still matching it.
+   *
+   * size: the file's size now
+   *
+   * Returns:
+   *  1 if the document changed, 0 if not
+   */
+  struct follow *fw = &E.follow;
+  size_t n = size - fw->size;
+  if (n > FOLLOW_CHUNK) {
+    n = FOLLOW_CHUNK;
+    fw->behind = 1;
+  }
+  fw->buf.len = 0;
+  if (abReserve(&fw->buf, n) == -1)
+    die("malloc");
+  size_t got = 0;
+  while (got < n) {
+    ssize_t r = pread(E.fd, fw->buf.b + got, n - got, fw->size + got);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    got += r;
+  }
+  if (got == 0)
+    return 0;
+
+  int atend = !fw->toend && !editorRowExists(E.cy + 1);
+  int clean = !editorUnsaved();
+  docInsert(docLength(), fw->buf.b, got);
+  fw->size += got;
+  if (clean)
+    E.savededits = E.edits;
+  if (atend) {
+    const char *nl = memrchr(fw->buf.b, '\n', got);
+    E.cy += countNewlines(fw->buf.b, got);
+    E.cx = nl ? (int)(fw->buf.b + got - nl - 1) : E.cx + (int)got;
+  }
+  return 1;
+}
+
+int followCheck() {
+  /* Catches up with the followed file: appended bytes are added to the
+   * document, and a file that was truncated, or replaced by another under
+   * its name as log rotation does, is opened again once the bytes written
+   * to the old one have been read.
+   *
+   * Returns:
+   *  1 if the document changed, 0 if not
+   */
+  struct follow *fw = &E.follow;
+  fw->behind = 0;
+  // a find or the recovery prompt holds the document still until it is done
+  if (!fw->on || E.find.active || E.journal.recover)
+    return 0;
+
+  struct stat st, named;
+  int have = E.fd != -1 && fstat(E.fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (have && (size_t)st.st_size < fw->size) {
+    followReopen();
+    return 1;
+  }
+  int changed = have && (size_t)st.st_size > fw->size &&
+                followAppend(st.st_size);
+  if (fw->behind)
+    return changed;
+
+  if (stat(E.filename, &named) == 0 &&
+      (!have || named.st_ino != st.st_ino || named.st_dev != st.st_dev)) {
+    followReopen();
+    return 1;
+  }
+  return changed;
+}
+
+void followPoll() {
+  /* Follow timer callback: looks at the file and, unless inotify watches it
+   * now, arms itself again. A look held off by a find is retried on the
+   * timer too, since inotify won't report those changes again.
+   */
+  int held = E.find.active || E.journal.recover;
+  if (followCheck())
+    E.dirty = 1;
+  if (E.follow.on && (E.follow.wdir == -1 || held))
+    editorTimerSet(TIMER_FOLLOW, FOLLOW_POLL_MS, followPoll);
+}
+
+void editorHandleFollow() {
+  /* Handles inotify events for the followed file. Which events came doesn't
+   * matter, the file is simply looked at again.
+   */
+  struct follow *fw = &E.follow;
+  char buf[4096];
+  while (read(fw->ifd, buf, sizeof(buf)) > 0)
+    ;
+  followPoll();
+}
+
+void editorFollowToggle() {
+  /* Starts or stops following the open file. Following goes to the end of
+   * the file and keeps the view there as the file grows, while the cursor
+   * is on the last line. The document no longer matches any state of the
+   * file a journal could be replayed over, so journaling stops; with edits
+   * that aren't saved yet that would leave them nowhere but in memory, and
+   * a rotated file being opened again would drop them, so those have to be
+   * saved first.
+   */
+  struct follow *fw = &E.follow;
+  if (fw->on) {
+    fw->on = 0;
+    followUnwatch();
+    return;
+  }
+  if (E.filename == NULL) {
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "no file to follow");
+    return;
+  }
+  if (editorUnsaved()) {
+    snprintf(E.statusmsg, sizeof(E.statusmsg),
+             "save first: following can reopen the file and drop edits");
+    return;
+  }
+  fw->on = 1;
+  journalClose(0);
+  followWatch();
+  followPoll();
+  followToEnd();
+}
+
+/*** find ***/
+
+size_t findBMH(const char *h, size_t n, const char *nd, size_t m,
+               const size_t *skip) {
+  /* Boyer-Moore-Horspool search: the byte under the end of the window picks
+   * how far the window moves when it doesn't match.
+   *
+   * h: text to search
+   * n: length of the text
+   * nd: the needle
+   * m: length of the needle, at least 1
+   * skip: shift for every byte value, from findPrepare
+   *
+   * Returns:
+   *  offset of the first match, or n if there is none
+   */
+  size_t i = 0;
+  while (i + m <= n) {
+    unsigned char c = h[i + m - 1];
+    if (c == (unsigned char)nd[m - 1] && memcmp(h + i, nd, m - 1) == 0)
+      return i;
+    i += skip[c];
+  }
+  return n;
+}
+
+#ifdef TXT_X86
+size_t findLiteralSSE2(const char *h, size_t n, const char *nd, size_t m,
+                       const size_t *skip) {
+  /* Vector prefilter: compares 16 positions at a time
+   * against the needle's first and last byte and only checks the rest of
+   * the needle where both match. The tail is left to findBMH.
+   */
+  const __m128i first = _mm_set1_epi8(nd[0]);
+  const __m128i last = _mm_set1_epi8(nd[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(h + i + bit + 1, nd + 1, m - 2) == 0)
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i + findBMH(h + i, n - i, nd, m, skip);
+}
+
+__attribute__((target("avx2"))) size_t
+findLiteralAVX2(const char *h, size_t n, const char *nd, size_t m,
+                const size_t *skip) {
+  /* AVX2 version of findLiteralSSE2, 32 positions per compare.
+   */
+  const __m256i first = _mm256_set1_epi8(nd[0]);
+  const __m256i last = _mm256_set1_epi8(nd[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + m - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(h + i + bit + 1, nd + 1, m - 2) == 0)
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i + findBMH(h + i, n - i, nd, m, skip);
+}
+#endif
+
+size_t findLiteral(const char *h, size_t n, const char *nd, size_t m,
+                   const size_t *skip) {
+  /* Finds the first occurrence of a needle: memchr for a single byte, else
+   * the vector prefilter where there is one and Horspool elsewhere. On text
+   * the prefilter wins even for long needles, whose Horspool shifts stay
+   * short when they hold most of the alphabet.
+   *
+   * h: text to search
+   * n: length of the text
+   * nd: the needle
+   * m: length of the needle, at least 1
+   * skip: Horspool shifts, from findPrepare
+   *
+   * Returns:
+   *  offset of the first match, or n if there is none
+   */
+  if (m > n)
+    return n;
+  if (m == 1) {
+    const char *hit = memchr(h, nd[0], n);
+    return hit ? (size_t)(hit - h) : n;
+  }
+#ifdef TXT_X86
+  if (__builtin_cpu_supports("avx2"))
+    return findLiteralAVX2(h, n, nd, m, skip);
+  return findLiteralSSE2(h, n, nd, m, skip);
+#else
+  return findBMH(h, n, nd, m, skip);
+#endif
+}
+
+void findPrepare(struct findState *f) {
+  /* Gets a new query ready to search for: fills in the Horspool shifts of a
+   * literal or compiles an expression.
+   *
+   * f: the find whose query changed
+   */
+  if (f->compiled) {
+    regfree(&f->re);
+    f->compiled = 0;
+  }
+  f->bad = 0;
+  if (f->querylen == 0)
+    return;
+
+  if (f->regex) {
+    char pattern[FIND_MAX + 1];
+    memcpy(pattern, f->query, f->querylen);
+    pattern[f->querylen] = '\0';
+    // with REG_NEWLINE matches never span lines, which lets the scan cut
+    // the document at line ends
+    f->compiled = regcomp(&f->re, pattern, REG_EXTENDED | REG_NEWLINE) == 0;
+    f->bad = !f->compiled;
+    return;
+  }
+
+  size_t m = f->querylen;
+  int c;
+  for (c = 0; c < 256; c++)
+    f->skip[c] = m;
+  size_t i;
+  for (i = 0; i + 1 < m; i++)
+    f->skip[(unsigned char)f->query[i]] = m - 1 - i;
+}
+
+const char *findWindow(size_t off, size_t len, int nul) {
+  /* Gets a range of the document as contiguous bytes, straight from where it
+   * is stored if it is all in one piece, or else copied.
+   *
+   * off: document offset of the range
+   * len: length of the range
+   * nul: the bytes must be followed by a NUL byte, which always copies them
+   *
+   * Returns:
+   *  pointer to the bytes, valid until the document changes or the next call
+   */
+  const char *p;
+  if (!nul && docSpan(off, &p) >= len)
+    return p;
+  struct abuf *sb = &E.find.scratch;
+  if (abReserve(sb, len + 1) == -1)
+    die("malloc");
+  docRead(off, sb->b, len);
+  sb->b[len] = '\0';
+  return sb->b;
+}
+
+void editorFindJump(int i) {
+  /* Moves the cursor to one of the matches found.
+   *
+   * i: index of the match in the find's match list
+   */
+  struct findState *f = &E.find;
+  f->current = i;
+  E.cy = docLineOf(f->matches[i], &E.cx);
+  editorAdviseJump(f->matches[i]);
+  E.dirty = 1;
+}
+
+void findKeep(size_t off) {
+  /* Adds a match to the find's list. The cursor jumps to the first one found
+   * right away.
+   *
+   * off: document offset of the match
+   */
+  struct findState *f = &E.find;
+  if (f->nmatches == FIND_MAX_MATCHES)
+    return;
+  if (f->nmatches == f->matchcap) {
+    int cap = f->matchcap ? f->matchcap * 2 : 256;
+    size_t *new = realloc(f->matches, sizeof(size_t) * cap);
+    if (new == NULL)
+      die("realloc");
+    f->matches = new;
+    f->matchcap = cap;
+  }
+  f->matches[f->nmatches++] = off;
+  if (f->current == -1)
+    editorFindJump(0);
+}
+
+void findJobRecord(struct findJob *job, size_t off, size_t end) {
+  /* Adds a match to a job. Safe to call from the worker threads.
+   *
+   * job: the job the match was found in
+   * off: document offset of the match
+   * end: document offset just past the match
+   */
+  if (job->count++ == 0)
+    job->first = off;
+  job->lastend = end;
+  if (job->nmatches == FIND_MAX_MATCHES)
+    return;
+  if (job->nmatches == job->matchcap) {
+    int cap = job->matchcap ? job->matchcap * 2 : 64;
+    size_t *new = realloc(job->matches, sizeof(size_t) * cap);
+    if (new == NULL)
+      die("realloc");
+    job->matches = new;
+    job->matchcap = cap;
+  }
+  job->matches[job->nmatches++] = off;
+}
+
+int findJobCancelled(struct findJob *job) {
+  /* Checks whether the pool has dropped the job a worker is searching.
+   *
+   * job: the job being searched
+   *
+   * Returns:
+   *  1 if the job's results will not be used, else 0
+   */
+  return job->gen != __atomic_load_n(&E.findpool.gen, __ATOMIC_RELAXED);
+}
+
+void findScanLiteral(struct findJob *job, const char *w) {
+  /* Finds the matches of a literal query that start in a job. Matches don't
+   * overlap.
+   *
+   * job: the job to search
+   * w: the bytes from job->start to job->wend
+   */
+  struct findState *f = &E.find;
+  size_t n = job->wend - job->start;
+  size_t lim = job->limit - job->start;
+  size_t m = f->querylen;
+  size_t i = 0;
+  while (i < lim && !findJobCancelled(job)) {
+    size_t hit = findLiteral(w + i, n - i, f->query, m, f->skip);
+    if (i + hit >= lim)
+      break;
+    findJobRecord(job, job->start + i + hit, job->start + i + hit + m);
+    i += hit + m;
+  }
+}
+
+void findScanRegex(struct findJob *job, const char *w, regex_t *re) {
+  /* Finds the matches of an expression that start in a job. Empty matches
+   * are passed over. Without REG_STARTEND text after a NUL byte is searched
+   * on its own, since the regex engine stops at one.
+   *
+   * job: the job to search
+   * w: the bytes from job->start to job->wend, followed by a NUL
+   * re: the compiled expression, used by no other thread meanwhile
+   */
+  size_t lim = job->limit - job->start;
+  size_t i = 0;
+  int eflags = job->prev == '\n' ? 0 : REG_NOTBOL;
+
+  while (i < lim && !findJobCancelled(job)) {
+    regmatch_t m;
+#ifdef REG_STARTEND
+    // given the end, the engine doesn't measure the rest of the job before
+    // every match, and takes NUL bytes as text; the byte before i tells it
+    // whether i starts a line
+    m.rm_so = i;
+    m.rm_eo = job->wend - job->start;
+    if (regexec(re, w, 1, &m, eflags | REG_STARTEND) != 0)
+      break;
+    size_t so = m.rm_so;
+    size_t eo = m.rm_eo;
+#else
+    if (regexec(re, w + i, 1, &m, eflags) != 0) {
+      i += strlen(w + i) + 1;
+      eflags = REG_NOTBOL;
+      continue;
+    }
+    size_t so = i + m.rm_so;
+    size_t eo = i + m.rm_eo;
+#endif
+    if (so >= lim)
+      break;
+    if (eo > so)
+      findJobRecord(job, job->start + so, job->start + eo);
+    i = eo > so ? eo : so + 1;
+#ifndef REG_STARTEND
+    eflags = w[i - 1] == '\n' ? 0 : REG_NOTBOL;
+#endif
+  }
+}
+
+void findRunJob(struct findJob *job, const char *w, regex_t *re) {
+  /* Searches a job for the find's query.
+   *
+   * job: the job to search, with no matches yet
+   * w: the bytes from job->start to job->wend, followed by a NUL for an
+   *    expression
+   * re: the compiled expression for an expression, used by no other thread
+   *     meanwhile
+   */
+  if (E.find.regex)
+    findScanRegex(job, w, re);
+  else
+    findScanLiteral(job, w);
+}
+
+void findJobReset(struct findJob *job, size_t start) {
+  /* Empties a job of its matches so it can be searched again.
+   *
+   * job: the job
+   * start: where its matches may start from now on
+   */
+  free(job->matches);
+  job->matches = NULL;
+  job->nmatches = 0;
+  job->matchcap = 0;
+  job->count = 0;
+  job->first = (size_t)-1;
+  job->lastend = 0;
+  job->start = start;
+  job->prev = '\n';
+  if (start > 0)
+    docRead(start - 1, &job->prev, 1);
+  job->gen = E.findpool.gen;
+  job->done = 0;
+}
+
+int findAddJob() {
+  /* Cuts the next job off the part of the document still to be searched.
+   * Jobs are FIND_CHUNK bytes. For an expression they end at a line end, so
+   * a match never needs text from two jobs, within reason for very long
+   * lines.
+   *
+   * Returns:
+   *  1 if a job was added, 0 if the whole document is covered
+   */
+  struct findState *f = &E.find;
+  size_t len = docLength();
+  size_t end = f->wrapped ? f->start : len;
+  if (f->pos >= end) {
+    if (f->wrapped || f->start == 0)
+      return 0;
+    f->wrapped = 1;
+    f->wrapjob = f->njobs;
+    f->pos = 0;
+    end = f->start;
+  }
+  size_t limit = end - f->pos > FIND_CHUNK ? f->pos + FIND_CHUNK : end;
+  size_t wend;
+  if (f->regex) {
+    wend = limit;
+    if (limit < len) {
+      size_t nl = docFindByte(limit - 1, '\n');
+      if (nl >= limit + FIND_CHUNK) {
+        // cut a very long line, looking on past the cut for the end of a
+        // match that crosses it
+        wend = limit + FIND_CHUNK;
+      } else {
+        wend = nl < len ? nl + 1 : len;
+        if (wend <= end)
+          limit = wend;
+      }
+    }
+  } else {
+    wend = limit + f->querylen - 1;
+    if (wend > len)
+      wend = len;
+  }
+
+  if (f->njobs == f->jobcap) {
+    int cap = f->jobcap ? f->jobcap * 2 : 16;
+    struct findJob *new = realloc(f->jobs, sizeof(struct findJob) * cap);
+    if (new == NULL)
+      die("realloc");
+    f->jobs = new;
+    f->jobcap = cap;
+  }
+  struct findJob *job = &f->jobs[f->njobs++];
+  job->matches = NULL;
+  findJobReset(job, f->pos);
+  job->limit = limit;
+  job->wend = wend;
+  f->pos = limit;
+  return 1;
+}
+
+void findPoolInit(struct findPool *fp) {
+  /* Sets up an empty pool sized to the processors online. The threads are
+   * only started by the first find that uses them.
+   *
+   * fp: the pool
+   */
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  fp->max = n < 1 ? 1 : n > FIND_THREADS_MAX ? FIND_THREADS_MAX : n;
+  fp->nthreads = 0;
+  fp->started = 0;
+  fp->nre = 0;
+  pthread_mutex_init(&fp->lock, NULL);
+  pthread_cond_init(&fp->work, NULL);
+  pthread_cond_init(&fp->idle, NULL);
+}
+
+const char *findPoolWindow(struct findPool *fp, size_t off, size_t len,
+                           int nul, struct abuf *sb) {
+  /* Gets a range of the document from the span snapshot, like findWindow
+   * but without touching the document.
+   *
+   * fp: the pool holding the snapshot
+   * off: document offset of the range
+   * len: length of the range
+   * nul: the bytes must be followed by a NUL byte, which always copies them
+   * sb: the calling worker's buffer for copies
+   *
+   * Returns:
+   *  pointer to the bytes, valid until the next call with the same sb
+   */
+  int lo = 0;
+  int hi = fp->nspans - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (fp->spans[mid].off <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  struct findSpan *s = &fp->spans[lo];
+  if (!nul && s->off + s->len >= off + len)
+    return s->p + (off - s->off);
+
+  if (abReserve(sb, len + 1) == -1)
+    die("malloc");
+  size_t n = 0;
+  for (; n < len; s++) {
+    size_t from = off + n - s->off;
+    size_t take = s->len - from < len - n ? s->len - from : len - n;
+    memcpy(sb->b + n, s->p + from, take);
+    n += take;
+  }
+  sb->b[len] = '\0';
+  return sb->b;
+}
+
+void *findWorker(void *arg) {
+  /* Worker thread body: searches jobs as they are handed out, and wakes the
+   * event loop as each one finishes so the count on the status bar moves.
+   *
+   * arg: the pool
+   */
+  struct findPool *fp = arg;
+  struct abuf sb = ABUF_INIT;
+  pthread_mutex_lock(&fp->lock);
+  int self = fp->started++;
+  while (1) {
+    if (fp->next == fp->njobs) {
+      pthread_cond_wait(&fp->work, &fp->lock);
+      continue;
+    }
+    struct findJob *job = &fp->jobs[fp->next++];
+    job->gen = fp->gen;
+    fp->busy++;
+    pthread_mutex_unlock(&fp->lock);
+
+    findRunJob(job,
+               findPoolWindow(fp, job->start, job->wend - job->start,
+                              E.find.regex, &sb),
+               self < fp->nre ? &fp->re[self] : NULL);
+
+    pthread_mutex_lock(&fp->lock);
+    fp->busy--;
+    job->done = 1;
+    pthread_cond_broadcast(&fp->idle);
+    pthread_mutex_unlock(&fp->lock);
+    editorWake();
+    pthread_mutex_lock(&fp->lock);
+  }
+  return NULL;
+}
+
+int findPoolStart(struct findPool *fp) {
+  /* Starts the pool's threads if they aren't running yet.
+   *
+   * fp: the pool
+   *
+   * Returns:
+   *  1 if the pool can take jobs, 0 if the find should search on its own
+   */
+  while (fp->nthreads < fp->max &&
+         pthread_create(&fp->threads[fp->nthreads], NULL, findWorker, fp) == 0)
+    fp->nthreads++;
+  return fp->nthreads > 1 && fp->max > 1;
+}
+
+void findPoolCancel(struct findPool *fp) {
+  /* Takes back the jobs handed to the pool, waiting for those being
+   * searched to be dropped.
+   *
+   * fp: the pool
+   */
+  if (fp->nthreads == 0)
+    return;
+  pthread_mutex_lock(&fp->lock);
+  __atomic_add_fetch(&fp->gen, 1, __ATOMIC_RELAXED);
+  fp->jobs = NULL;
+  fp->njobs = 0;
+  fp->next = 0;
+  while (fp->busy > 0)
+    pthread_cond_wait(&fp->idle, &fp->lock);
+  pthread_mutex_unlock(&fp->lock);
+  while (fp->nre > 0)
+    regfree(&fp->re[--fp->nre]);
+}
+
+int findPoolCompile(struct findPool *fp, const struct findState *f) {
+  /* Compiles a copy of a find's expression for every worker, to be freed
+   * again when its jobs are cancelled. Nothing is needed for a literal.
+   *
+   * fp: the pool, with no jobs
+   * f: the find about to hand its jobs to the pool
+   *
+   * Returns:
+   *  0 if the workers are ready, -1 if the expression couldn't be compiled
+   */
+  if (!f->regex)
+    return 0;
+  char pattern[FIND_MAX + 1];
+  memcpy(pattern, f->query, f->querylen);
+  pattern[f->querylen] = '\0';
+  for (; fp->nre < fp->nthreads; fp->nre++) {
+    if (regcomp(&fp->re[fp->nre], pattern, REG_EXTENDED | REG_NEWLINE) != 0) {
+      while (fp->nre > 0)
+        regfree(&fp->re[--fp->nre]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void findPoolSubmit(struct findPool *fp, struct findJob *jobs, int njobs) {
+  /* Snapshots where the document's bytes are and hands a find's jobs to the
+   * pool.
+   *
+   * fp: the pool, with no jobs
+   * jobs: the jobs, which must stay put until they are done or cancelled
+   * njobs: number of jobs
+   */
+
+  size_t len = docLength();
+  size_t off = 0;
+  fp->nspans = 0;
+  while (off < len) {
+    if (fp->nspans == fp->spancap) {
+      int cap = fp->spancap ? fp->spancap * 2 : 64;
+      struct findSpan *new = realloc(fp->spans, sizeof(struct findSpan) * cap);
+      if (new == NULL)
+        die("realloc");
+      fp->spans = new;
+      fp->spancap = cap;
+    }
+    struct findSpan *s = &fp->spans[fp->nspans++];
+    s->off = off;
+    s->len = docSpan(off, &s->p);
+    off += s->len;
+  }
+
+  pthread_mutex_lock(&fp->lock);
+  fp->jobs = jobs;
+  fp->njobs = njobs;
+  fp->next = 0;
+  pthread_cond_broadcast(&fp->work);
+  pthread_mutex_unlock(&fp->lock);
+}
+
+void findMerge() {
+  /* Adds the matches of finished jobs to the match list, in document order
+   * from the start of the scan. A job only merges once those before it
+   * have. Where a match at the end of one job overlaps the start of the
+   * next, the next is searched again from where the match ends, as a scan
+   * of the whole document would.
+   */
+  struct findState *f = &E.find;
+  struct findPool *fp = &E.findpool;
+  int upto = f->merged;
+  int i;
+  if (f->pooled)
+    pthread_mutex_lock(&fp->lock);
+  while (upto < f->njobs && f->jobs[upto].done)
+    upto++;
+  // finished jobs that can't merge yet still count towards the status
+  f->pending = 0;
+  f->pendingbytes = 0;
+  for (i = upto; i < f->njobs; i++) {
+    if (f->jobs[i].done) {
+      f->pending += f->jobs[i].count;
+      f->pendingbytes += f->jobs[i].limit - f->jobs[i].start;
+    }
+  }
+  if (f->pooled)
+    pthread_mutex_unlock(&fp->lock);
+
+  for (; f->merged < upto; f->merged++) {
+    struct findJob *job = &f->jobs[f->merged];
+    if (f->merged == f->wrapjob) {
+      f->nfirst = f->nmatches;
+      f->lastend = 0;
+    }
+    if (job->first < f->lastend) {
+      size_t limit = job->limit;
+      findJobReset(job, f->lastend < limit ? f->lastend : limit);
+      findRunJob(job, findWindow(job->start, job->wend - job->start, f->regex),
+                 &f->re);
+    }
+    for (i = 0; i < job->nmatches; i++)
+      findKeep(job->matches[i]);
+    f->total += job->count;
+    if (job->count > 0)
+      f->lastend = job->lastend;
+    f->donebytes += job->limit - job->start;
+    free(job->matches);
+    job->matches = NULL;
+    job->nmatches = 0;
+  }
+  // let the count on the status bar move along
+  if (editorNow() - E.lastframe >= FRAME_MAX_DELAY_MS)
+    E.dirty = 1;
+}
+
+void editorFindStep() {
+  /* Moves the find along. Searching on its own, it searches the next job;
+   * with the pool it merges whatever the workers have finished. Called from
+   * the event loop until the scan is done, so input is looked at between
+   * jobs.
+   */
+  struct findState *f = &E.find;
+  if (!f->pooled && f->merged == f->njobs) {
+    if (!findAddJob()) {
+      f->scanning = 0;
+      E.dirty = 1;
+      return;
+    }
+    struct findJob *job = &f->jobs[f->njobs - 1];
+    findRunJob(job, findWindow(job->start, job->wend - job->start, f->regex),
+                 &f->re);
+    job->done = 1;
+  }
+  findMerge();
+  if (f->pooled && f->merged == f->njobs) {
+    f->scanning = 0;
+    E.dirty = 1;
+  }
+}
+
+void findReset() {
+  /* Cancels the jobs of the last scan and drops their matches.
+   */
+  struct findState *f = &E.find;
+  findPoolCancel(&E.findpool);
+  int i;
+  for (i = f->merged; i < f->njobs; i++)
+    free(f->jobs[i].matches);
+  f->njobs = 0;
+  f->merged = 0;
+  f->pooled = 0;
+  f->scanning = 0;
+}
+
+void editorFindRestart() {
+  /* Starts the scan over for a changed query from where the cursor was when
+   * the prompt opened. A piece table document bigger than one job is cut
+   * into jobs up front and handed to the worker pool; otherwise the first
+   * job is searched right away.
+   */
+  struct findState *f = &E.find;
+  findReset();
+  findPrepare(f);
+  E.cx = f->origcx;
+  E.cy = f->origcy;
+  f->start = editorCursorOffset();
+  f->pos = f->start;
+  f->wrapped = 0;
+  f->wrapjob = -1;
+  f->lastend = 0;
+  f->pending = 0;
+  f->pendingbytes = 0;
+  f->donebytes = 0;
+  f->nmatches = 0;
+  f->nfirst = 0;
+  f->total = 0;
+  f->current = -1;
+  f->scanning = f->querylen > 0 && !f->bad;
+  if (!f->scanning)
+    return;
+  if (E.dockind == DOC_PIECES && docLength() > FIND_CHUNK &&
+      findPoolStart(&E.findpool) && findPoolCompile(&E.findpool, f) == 0) {
+    while (findAddJob())
+      ;
+    f->pooled = 1;
+    findPoolSubmit(&E.findpool, f->jobs, f->njobs);
+  }
+  editorFindStep();
+}
+
+void editorFindFinish() {
+  /* Runs the scan to the end, waiting for the workers if it has any.
+   */
+  struct findState *f = &E.find;
+  struct findPool *fp = &E.findpool;
+  while (f->scanning) {
+    if (f->pooled) {
+      pthread_mutex_lock(&fp->lock);
+      while (!f->jobs[f->merged].done)
+        pthread_cond_wait(&fp->idle, &fp->lock);
+      pthread_mutex_unlock(&fp->lock);
+    }
+    editorFindStep();
+  }
+}
+
+void editorFindStart() {
+  /* Opens the find prompt.
+   */
+  struct findState *f = &E.find;
+  f->active = 1;
+  f->querylen = 0;
+  f->origcx = E.cx;
+  f->origcy = E.cy;
+  editorFindRestart();
+}
+
+void editorFindEnd(int accept) {
+  /* Closes the find prompt.
+   *
+   * accept: leave the cursor on the match, else put it back where it was
+   */
+  struct findState *f = &E.find;
+  f->active = 0;
+  findReset();
+  if (!accept) {
+    E.cx = f->origcx;
+    E.cy = f->origcy;
+  }
+}
+
+void editorFindKey(int c) {
+  /* Handles a key while the find prompt is open. Typing edits the query and
+   * searches again, the arrows go from match to match, ctrl-r switches
+   * between literal and regular expression search, enter leaves the cursor
+   * on the match and escape goes back to where it was.
+   *
+   * c: the key
+   */
+  struct findState *f = &E.find;
+  switch (c) {
+  case '\x1b':
+    editorFindEnd(0);
+    return;
+  case '\r':
+    editorFindEnd(1);
+    return;
+  case CTRL_KEY('r'):
+    f->regex = !f->regex;
+    break;
+  case MOVE_DOWN:
+  case MOVE_RIGHT:
+  case CTRL_KEY('f'):
+    if (f->nmatches > 0)
+      editorFindJump((f->current + 1) % f->nmatches);
+    return;
+  case MOVE_UP:
+  case MOVE_LEFT:
+    if (f->nmatches > 0)
+      editorFindJump((f->current + f->nmatches - 1) % f->nmatches);
+    return;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    if (f->querylen == 0)
+      return;
+    // drop a whole UTF-8 character
+    while (--f->querylen > 0 && (f->query[f->querylen] & 0xc0) == 0x80)
+      ;
+    break;
+  case PASTE_KEY: {
+    // the first line of the paste
+    char *nl = memchr(E.paste.b, '\n', E.paste.len);
+    int n = nl ? nl - E.paste.b : E.paste.len;
+    if (n > FIND_MAX - f->querylen)
+      n = FIND_MAX - f->querylen;
+    memcpy(f->query + f->querylen, E.paste.b, n);
+    f->querylen += n;
+  } break;
+  default:
+    if (c == '\t' || (c >= 32 && c != 127 && c < 0x110000)) {
+      char buf[4];
+      int n = editorEncodeUtf8(c, buf);
+      if (f->querylen + n > FIND_MAX)
+        return;
+      memcpy(f->query + f->querylen, buf, n);
+      f->querylen += n;
+      break;
+    }
+    return;
+  }
+  editorFindRestart();
+}
+
+int editorFindPrompt(char *buf, int size) {
+  /* Formats the find prompt with the query.
+   *
+   * buf: receives the prompt
+   * size: size of buf
+   *
+   * Returns:
+   *  length of the prompt, at most size - 1
+   */
+  int n = snprintf(buf, size, "%s: %.*s", E.find.regex ? "Regex" : "Search",
+                   E.find.querylen, E.find.query);
+  return n < size ? n : size - 1;
+}
+
+int editorFindStatus(char *buf, int size) {
+  /* Formats how the find is getting on: which match the cursor is on and of
+   * how many, or how far the scan has got.
+   *
+   * buf: receives the status
+   * size: size of buf
+   *
+   * Returns:
+   *  length of the status, at most size - 1
+   */
+  struct findState *f = &E.find;
+  int n;
+  if (f->bad) {
+    n = snprintf(buf, size, "bad expression");
+  } else if (f->querylen == 0) {
+    n = snprintf(buf, size, "%s", f->regex ? "literal: ^R" : "regex: ^R");
+  } else if (f->scanning) {
+    size_t len = docLength();
+    size_t done = f->donebytes + f->pendingbytes;
+    n = snprintf(buf, size, "%zu so far, %d%%", f->total + f->pending,
+                 len ? (int)(done * 100 / len) : 100);
+  } else if (f->total == 0) {
+    n = snprintf(buf, size, "no matches");
+  } else {
+    // number the matches in document order
+    int k = f->current < f->nfirst ? f->nmatches - f->nfirst + f->current
+                                   : f->current - f->nfirst;
+    n = snprintf(buf, size, "%d of %zu", k + 1, f->total);
+  }
+  return n < size ? n : size - 1;
+}
+
+/*** go to ***/
+
+void editorJumpTo(int line, size_t x) {
+  /* Moves the cursor to a place in the document and the view to put it in
+   * the middle of the screen.
+   *
+   * line: zero based line number of a line the cursor can reach
+   * x: byte offset within the line
+   */
+  E.cy = line;
+  E.cx = x;
+  E.rowoff = line;
+  E.rowsub = 0;
+  if (E.softwrap && E.screencols > 0) {
+    E.rowsub = colOf(line, x) / E.screencols;
+    wrapMove(&E.rowoff, &E.rowsub, -(E.screenrows / 2));
+  } else if (E.rowoff > E.screenrows / 2) {
+    E.rowoff -= E.screenrows / 2;
+  } else {
+    E.rowoff = 0;
+  }
+  editorAdviseJump(editorCursorOffset());
+}
+
+int editorGoto(const char *q) {
+  /* Moves the cursor to a position typed at the go-to prompt: a line
+   * number, a byte offset after '@' (in hex after "@0x"), or how far
+   * through the document's bytes as a percentage followed by '%'. A line
+   * or offset past the end goes to the last line. Each is found by one
+   * lookup in the line index, so it takes as long anywhere in a document
+   * of any size once the index has reached that far.
+   *
+   * q: the position, NUL terminated
+   *
+   * Returns:
+   *  0 if the cursor moved, -1 if q isn't a position
+   */
+  size_t len = docLength();
+  size_t qlen = strlen(q);
+  char *end;
+  int line, col;
+  if (q[0] == '@' && isdigit((unsigned char)q[1])) {
+    errno = 0;
+    unsigned long long off = strtoull(q + 1, &end, 0);
+    if (*end != '\0')
+      return -1;
+    if (errno == ERANGE || off > len)
+      off = len;
+    line = docLineOf(off, &col);
+  } else if (qlen > 1 && q[qlen - 1] == '%' &&
+             (isdigit((unsigned char)q[0]) || q[0] == '.')) {
+    double pct = strtod(q, &end);
+    if (end != q + qlen - 1)
+      return -1;
+    size_t off = pct < 100 ? (size_t)(len * (pct / 100)) : len;
+    line = docLineOf(off, &col);
+    col = 0;
+  } else if (isdigit((unsigned char)q[0])) {
+    errno = 0;
+    unsigned long long n = strtoull(q, &end, 10);
+    if (*end != '\0')
+      return -1;
+    size_t start;
+    line = errno == ERANGE || n > INT_MAX ? INT_MAX : n > 0 ? (int)n - 1 : 0;
+    // only a line past the end needs the lines of the whole document
+    if (docLineStart(line, &start) == -1)
+      line = docLineOf(len, &col);
+    col = 0;
+  } else {
+    return -1;
+  }
+  editorJumpTo(line, col);
+  return 0;
+}
+
+void editorGotoStart() {
+  /* Opens the go-to prompt.
+   */
+  E.gotoactive = 1;
+  E.gotolen = 0;
+}
+
+void editorGotoKey(int c) {
+  /* Handles a key while the go-to prompt is open. Enter goes to the
+   * position typed and escape closes the prompt without moving.
+   *
+   * c: the key
+   */
+  switch (c) {
+  case '\x1b':
+    E.gotoactive = 0;
+    break;
+  case '\r':
+    E.gotoactive = 0;
+    E.gotoquery[E.gotolen] = '\0';
+    if (editorGoto(E.gotoquery) == -1)
+      snprintf(E.statusmsg, sizeof(E.statusmsg),
+               "not a line, @offset or percentage: %s", E.gotoquery);
+    break;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    if (E.gotolen > 0)
+      E.gotolen--;
+    break;
+  default:
+    if (c > 32 && c < 127 && E.gotolen < GOTO_MAX - 1)
+      E.gotoquery[E.gotolen++] = c;
+    break;
+  }
+}
+
+int editorGotoPrompt(char *buf, int size) {
+  /* Formats the go-to prompt with what has been typed.
+   *
+   * buf: receives the prompt
+   * size: size of buf
+   *
+   * Returns:
+   *  length of the prompt, at most size - 1
+   */
+  int n = snprintf(buf, size, "Go to line, @offset or n%%: %.*s", E.gotolen,
+                   E.gotoquery);
+  return n < size ? n : size - 1;
+}
+
+/*** input ***/
+
+void editorMoveCursor(int key) {
+  /* Moves the cursor. Left and right go by whole characters, taking zero
+   * width ones along with the character before them; up and down keep the
+   * screen column.
+   *
+   * key: motion keys (using vim motion keys)
+   */
+  size_t rx = colOf(E.cy, E.cx);
+  switch (key) {
+  case MOVE_LEFT:
+    if (E.cx != 0) {
+      E.cx = rx > 0 ? colOffset(E.cy, rx - 1, NULL) : 0;
+    }
+    break;
+  case MOVE_RIGHT:
+    if (E.cx < editorRowLen(E.cy)) {
+      size_t start, end;
+      docLineStart(E.cy, &start);
+      end = editorLineEnd(E.cy);
+      int cp;
+      size_t off = start + E.cx;
+      off += docCharAt(off, end, &cp);
+      rx += charColumns(cp, rx);
+      E.cx = docWalk(off, end, end, &rx, rx) - start;
+    }
+    break;
+  case MOVE_UP:
+    if (E.softwrap) {
+      editorMoveRows(-1);
+    } else if (E.cy != 0) {
+      E.cy--;
+      E.cx = colOffset(E.cy, rx, NULL);
+    }
+    break;
+  case MOVE_DOWN:
+    if (E.softwrap) {
+      editorMoveRows(1);
+    } else if (editorRowExists(E.cy)) {
+      E.cy++;
+      E.cx = colOffset(E.cy, rx, NULL);
     }
     break;
   }
+
+  // snap the cursor back onto the text of the new line
+  int rowlen = editorRowLen(E.cy);
+  if (E.cx > rowlen) {
+    E.cx = rowlen;
+  }
+}
+
+void editorPage(int dir) {
+  /* Moves the view and the cursor a screen up or down together, so the
+   * cursor keeps its place on the screen and its column. The line a page
+   * away is looked up directly through the line index rather than stepped
+   * to a line at a time, and wrapped lines are moved through by the wrap
+   * index where there is one.
+   *
+   * dir: 1 to page down, -1 to page up
+   */
+  int n = dir * E.screenrows;
+  if (E.softwrap) {
+    int moved = editorMoveRows(n);
+    if (moved != 0)
+      wrapMove(&E.rowoff, &E.rowsub, moved);
+    return;
+  }
+
+  size_t rx = colOf(E.cy, E.cx);
+  int line = E.cy + n;
+  int top = E.rowoff + n;
+  if (line < 0)
+    line = 0;
+  if (top < 0)
+    top = 0;
+  // the line before the one landed on must hold text, unless that's the top
+  if (n > 0 && !editorRowExists(line - 1)) {
+    // past the end the view goes no further than the last line at the bottom
+    line = editorLastLine();
+    top = line - E.screenrows + 1 > E.rowoff ? line - E.screenrows + 1
+                                             : E.rowoff;
+  }
+  E.rowoff = top < line ? top : line;
+  E.cy = line;
+  E.cx = colOffset(line, rx, NULL);
 }
 
 void editorProcessKeyPress() {
@@ -244,38 +8062,382 @@ void editorProcessKeyPress() {
    */
 
   int c = editorReadKey();
+  // messages stay up until the next key
+  E.statusmsg[0] = '\0';
+  if (E.journal.recover) {
+    editorRecover(c == 'y' || c == 'Y');
+    latencyKeyDone();
+    return;
+  }
+  if (E.find.active) {
+    // the find moves the cursor away from the last edit
+    E.undo.seal = 1;
+    editorFindKey(c);
+    latencyKeyDone();
+    return;
+  }
+  if (E.gotoactive) {
+    E.undo.seal = 1;
+    editorGotoKey(c);
+    latencyKeyDone();
+    return;
+  }
+
   switch (c) {
+  case '\r':
+    editorInsertNewline();
+    break;
+  case CTRL_KEY('f'):
+    editorFindStart();
+    break;
+  case CTRL_KEY('g'):
+    editorGotoStart();
+    break;
   case CTRL_KEY('q'):
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    // never leave a save half done; unsaved edits are dropped on purpose
+    editorSaveFinish();
+    journalClose(0);
+    editorWrite("\x1b[2J\x1b[H", 7);
     exit(0);
     break;
+  case CTRL_KEY('e'):
+    editorFollowToggle();
+    break;
+  case CTRL_KEY('w'):
+    editorWrapToggle();
+    break;
+  case CTRL_KEY('s'):
+    editorSave();
+    break;
+  case CTRL_KEY('y'):
+    editorRedo();
+    break;
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+  case CTRL_KEY('t'):
+    latencyDump();
+    break;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+    editorDelChar();
+    break;
+  case DEL_KEY:
+    editorDelForward();
+    break;
+  case PASTE_KEY:
+    editorInsertPaste();
+    break;
+  case HOME_KEY:
+    E.cx = 0;
+    break;
+  case END_KEY:
+    E.cx = editorRowLen(E.cy);
+    break;
   case PAGE_UP:
-  case PAGE_DOWN: {
-    int times = E.screenrows;
-    while (times--) {
-      editorMoveCursor(c == PAGE_UP ? MOVE_UP : MOVE_DOWN);
-    }
-  } break;
+  case PAGE_DOWN:
+    editorPage(c == PAGE_UP ? -1 : 1);
+    editorAdviseJump(editorCursorOffset());
+    break;
   case MOVE_UP:
   case MOVE_DOWN:
   case MOVE_LEFT:
   case MOVE_RIGHT:
     editorMoveCursor(c);
     break;
+  default:
+    if (c == '\t' || (c >= 32 && c != 127 && c < 0x110000)) {
+      editorInsertChar(c);
+    }
+    break;
   }
+  latencyKeyDone();
 }
 
 /*** output ***/
 
-void editorDrawRows(struct abuf *ab) {
-  /* Draws the rows of the editor.
+void editorDrawText(int y, size_t left, size_t col, const char *p, size_t n,
+                    const unsigned char *hl) {
+  /* Draws text of a line onto a row of the frame, cut off at the screen
+   * width: tabs as blanks up to the next tab stop, wide characters over two
+   * cells, zero width ones over the character before them, and control
+   * characters and malformed UTF-8 as '?'. A character only partly in view
+   * shows as blanks.
    *
-   * ab: the append buffer
+   * y: the screen row to draw on
+   * left: the column of the line at the left edge of the screen
+   * col: the column of the line the text starts in
+   * p: the text
+   * n: length of the text
+   * hl: highlight class of every byte of the text, or NULL for none
+   */
+  size_t i = 0;
+  while (i < n) {
+    if (col >= left) {
+      size_t k = asciiSpan(p + i, n - i);
+      framePutAscii(&E.frame, y, col - left, p + i, k, hl ? hl + i : NULL);
+      col += k;
+      i += k;
+      if (i == n)
+        break;
+    }
+    int cp;
+    int len = charDecode(p + i, n - i, &cp);
+    int w = charColumns(cp, col);
+    int x = col - left;
+    if (col < left || cp == '\t') {
+      for (; x < (int)(col - left) + w; x++)
+        if (x >= 0)
+          framePutChar(&E.frame, y, x, " ", 1, 1, HL_NORMAL);
+    } else {
+      int c = hl ? hl[i] : HL_NORMAL;
+      if (cp == -1)
+        framePutChar(&E.frame, y, x, "?", 1, 1, c);
+      else
+        framePutChar(&E.frame, y, x, p + i, len, w, c);
+    }
+    col += w;
+    i += len;
+  }
+}
+
+const unsigned char *editorHighlight(const char *p, int n, int state) {
+  /* Works out the highlight classes of a line about to be drawn.
+   *
+   * p: text of the line
+   * n: length of the line
+   * state: lexer state at the start of the line
+   *
+   * Returns:
+   *  the class of every byte, valid until the next call, or NULL when the
+   *  file isn't highlighted
+   */
+  if (E.syntax == NULL)
+    return NULL;
+  if (abReserve(&E.hlclass, n) == -1)
+    die("malloc");
+  syntaxLex(E.syntax, p, n, state, (unsigned char *)E.hlclass.b);
+  return (unsigned char *)E.hlclass.b;
+}
+
+void editorDrawLine(int y, struct colLine *cl, size_t left, size_t right) {
+  /* Draws the part of a line of the piece table that is in view onto a row
+   * of the frame. Only those bytes are read, however long the line is,
+   * found from the line's cached columns.
+   *
+   * y: the screen row to draw on
+   * cl: the cached columns of the line to draw
+   * left: the column of the line at the left edge of the screen
+   * right: the column the characters drawn must start before
+   */
+  size_t col = 0;
+  size_t from = left > 0 ? colLineOffset(cl, left, &col) : 0;
+  size_t to = colLineOffset(cl, right, NULL);
+  if (from >= to)
+    return;
+  size_t n = to - from;
+  struct abuf *sb = &E.hlrow;
+  if (abReserve(sb, n) == -1)
+    die("malloc");
+  docRead(cl->start + from, sb->b, n);
+  // lexed from a normal state, since where comments spanning lines start
+  // isn't tracked in the piece table
+  editorDrawText(y, left, col, sb->b, n,
+                 editorHighlight(sb->b, n, LEX_NORMAL));
+}
+
+void editorDrawRow(int y, int r, struct colLine *cl, size_t left,
+                   size_t right) {
+  /* Draws the part of a row of the row store that is in view onto a row of
+   * the frame, straight from the text on either side of its gap. A
+   * highlighted row is lexed from its lexer state, which syntaxUpdate has
+   * made valid, up to the right edge of the screen, or when it is wrapped
+   * up to the bottom right corner once for all its screen rows.
+   *
+   * y: the screen row to draw on
+   * r: the row to draw
+   * cl: the row's cached columns
+   * left: the column of the row at the left edge of the screen
+   * right: the column the characters drawn must start before
+   */
+  struct rowStore *rs = &E.rows;
+  int len = rs->len[r];
+  size_t col = 0;
+  int from = left > 0 ? (int)colLineOffset(cl, left, &col) : 0;
+  int end = colLineOffset(cl, right, NULL);
+  if (from >= end)
+    return;
+
+  if (E.syntax) {
+    if (E.hlline != r || E.hlend < end) {
+      int upto = end;
+      if (E.softwrap)
+        upto = colLineOffset(
+            cl, left + (size_t)(E.screenrows - y) * E.screencols, NULL);
+      E.hltext = syntaxRowText(rs, r, &E.hlrow);
+      editorHighlight(E.hltext, upto, rs->hl[r]);
+      E.hlline = r;
+      E.hlend = upto;
+    }
+    const unsigned char *hl = (unsigned char *)E.hlclass.b;
+    editorDrawText(y, left, col, E.hltext + from, end - from, hl + from);
+    return;
+  }
+
+  // the text is only copied when the gap splits it
+  const char *b = rs->arena + rs->off[r];
+  int g = rs->gap[r];
+  const char *p;
+  if (end <= g) {
+    p = b + from;
+  } else if (from >= g) {
+    p = b + rs->cap[r] - len + from;
+  } else {
+    if (abReserve(&E.hlrow, end - from) == -1)
+      die("malloc");
+    rowsCopy(rs, r, from, E.hlrow.b, end - from);
+    p = E.hlrow.b;
+  }
+  editorDrawText(y, left, col, p, end - from, NULL);
+}
+
+void editorDrawStatus() {
+  /* Draws the status bar on the bottom row: the find or go-to prompt while
+   * one is open, otherwise the file name and where the cursor is.
+   */
+  int y = E.screenrows;
+  char left[FIND_MAX + 64];
+  char right[192];
+  int llen, rlen;
+  frameClearRow(&E.frame, y);
+  if (E.journal.recover) {
+    llen = snprintf(left, sizeof(left),
+                    "%d unsaved edits from a session that died. Recover? "
+                    "(y/n)",
+                    E.journal.recover);
+    rlen = 0;
+  } else if (E.find.active) {
+    llen = editorFindPrompt(left, sizeof(left));
+    rlen = editorFindStatus(right, sizeof(right));
+  } else if (E.gotoactive) {
+    llen = editorGotoPrompt(left, sizeof(left));
+    rlen = 0;
+  } else {
+    llen = snprintf(left, sizeof(left), "%.80s",
+                    E.filename ? E.filename : "[No Name]");
+    rlen = 0;
+    if (E.save.running)
+      rlen = snprintf(right, sizeof(right), "saving %d%% | ",
+                      E.save.total > 0
+                          ? (int)(__atomic_load_n(&E.save.written,
+                                                  __ATOMIC_RELAXED) *
+                                  100 / E.save.total)
+                          : 0);
+    else if (E.statusmsg[0] != '\0')
+      rlen = snprintf(right, sizeof(right), "%s | ", E.statusmsg);
+    if (E.follow.on)
+      rlen += snprintf(right + rlen, sizeof(right) - rlen, "%s | ",
+                       E.follow.toend ? "follow, indexing" : "follow");
+    if (E.softwrap)
+      rlen += snprintf(right + rlen, sizeof(right) - rlen, "wrap | ");
+    rlen += snprintf(right + rlen, sizeof(right) - rlen, "line %d, col %d",
+                     E.cy + 1, E.rx + 1);
+    if (E.debug)
+      rlen += snprintf(right + rlen, sizeof(right) - rlen,
+                       " | frame %lu: %zu bytes", E.frames, E.framebytes);
+  }
+
+  framePut(&E.frame, y, 0, left, llen);
+  int rwidth = textWidth(right, rlen);
+  if (textWidth(left, llen) + 1 + rwidth <= E.screencols)
+    framePut(&E.frame, y, E.screencols - rwidth, right, rlen);
+}
+
+void editorScroll() {
+  /* Scrolls just far enough to bring the cursor into view, and works out
+   * where on the screen it is. Wrapped lines scroll a screen row at a time
+   * and never sideways.
+   */
+  if (E.softwrap && E.screencols > 0) {
+    size_t x;
+    E.rx = colOf(E.cy, E.cx);
+    E.coloff = 0;
+    int sub = wrapRowOf(E.cy, E.cx, &x);
+    // an edit may have left the top line shorter
+    int rows = wrapLineRows(E.rowoff, E.rowsub + 1);
+    if (E.rowsub >= rows)
+      E.rowsub = rows - 1;
+    if (E.cy < E.rowoff || (E.cy == E.rowoff && sub < E.rowsub)) {
+      E.rowoff = E.cy;
+      E.rowsub = sub;
+    }
+    int y = wrapDistance(E.rowoff, E.rowsub, E.cy, sub, E.screenrows);
+    if (E.screenrows > 0 && y >= E.screenrows) {
+      E.rowoff = E.cy;
+      E.rowsub = sub;
+      y = -wrapMove(&E.rowoff, &E.rowsub, -(E.screenrows - 1));
+    }
+    E.cursory = y;
+    E.cursorx = x;
+    return;
+  }
+  E.rowsub = 0;
+  if (E.cy < E.rowoff)
+    E.rowoff = E.cy;
+  if (E.screenrows > 0 && E.cy >= E.rowoff + E.screenrows)
+    E.rowoff = E.cy - E.screenrows + 1;
+  E.rx = colOf(E.cy, E.cx);
+  if (E.rx < E.coloff)
+    E.coloff = E.rx;
+  if (E.screencols > 0 && E.rx >= E.coloff + E.screencols)
+    E.coloff = E.rx - E.screencols + 1;
+  E.cursory = E.cy - E.rowoff;
+  E.cursorx = E.rx - E.coloff;
+}
+
+void editorDrawRows() {
+  /* Draws the lines of the document that are scrolled into view into the
+   * frame, a wrapped line over as many rows as it takes, with a tilde on
+   * every row past the end of it, and the status bar below them. Only the
+   * visible lines are looked up and read, so a frame costs the same
+   * anywhere in a document of any size.
    */
   int y;
+  size_t len = docLength();
+  // an empty last row is only the newline ending the row before it
+  int numrows = E.rows.numrows;
+  if (numrows > 0 && E.rows.len[numrows - 1] == 0)
+    numrows--;
+  if (E.syntax && E.dockind == DOC_ROWS)
+    syntaxUpdate(E.rowoff + E.screenrows - 1);
+  E.hlline = -1;
+
+  int line = E.rowoff;
+  int sub = E.rowsub;
   for (y = 0; y < E.screenrows; y++) {
-    if (y == E.screenrows / 3) {
+    frameClearRow(&E.frame, y);
+    int drawn = 1;
+    struct colLine *cl = NULL;
+    if (E.dockind == DOC_ROWS && line < numrows) {
+      size_t start;
+      docLineStart(line, &start);
+      cl = colEntry(line, start, E.rows.len[line]);
+    } else if (E.dockind == DOC_PIECES && (cl = colLookup(line)) != NULL &&
+               cl->start >= len) {
+      cl = NULL;
+    }
+    if (cl != NULL) {
+      // a wrapped row ends where wrapBreaks started the next one
+      size_t right, left = E.coloff;
+      if (E.softwrap)
+        left = colWrapStart(cl, E.screencols, sub, &right);
+      else
+        right = left + E.screencols;
+      if (E.dockind == DOC_ROWS)
+        editorDrawRow(y, line, cl, left, right);
+      else
+        editorDrawLine(y, cl, left, right);
+    } else if (len == 0 && y == E.screenrows / 3) {
       char welcome[80];
       int welcomelen = snprintf(welcome, sizeof(welcome),
                                 "txt editor --- version %s", TXT_VERSION);
@@ -285,68 +8447,1085 @@ void editorDrawRows(struct abuf *ab) {
 
       int padding = (E.screencols - welcomelen) / 2;
       if (padding) {
-        abAppend(ab, "~", 1);
-        padding--;
+        framePut(&E.frame, y, 0, "~", 1);
       }
-      while (padding--) {
-        abAppend(ab, " ", 1);
-      }
-
-      abAppend(ab, welcome, welcomelen);
+      framePut(&E.frame, y, padding, welcome, welcomelen);
+      drawn = 0;
     } else {
-      abAppend(ab, "~", 1);
+      framePut(&E.frame, y, 0, "~", 1);
+      drawn = 0;
     }
 
-    abAppend(ab, "\x1b[K", 3);
-    if (y < E.screenrows - 1) {
-      abAppend(ab, "\r\n", 2);
+    // the next row goes on with a wrapped line, else starts the next line
+    if (drawn && E.softwrap && cl != NULL &&
+        colWrapTo(cl, E.screencols, sub + 2, 0) > sub + 1) {
+      sub++;
+      continue;
     }
+    line++;
+    sub = 0;
+  }
+
+  editorDrawStatus();
+}
+
+int editorViewMoved() {
+  /* Returns:
+   *  the screen rows the view has scrolled down since the shadow was drawn,
+   *  negative if up, or a screen's worth if it moved further
+   */
+  int top = E.rowoff, sub = E.rowsub;
+  int oldtop = E.shadowrowoff, oldsub = E.shadowrowsub;
+  if (top > oldtop || (top == oldtop && sub >= oldsub))
+    return wrapDistance(oldtop, oldsub, top, sub, E.screenrows);
+  return -wrapDistance(top, sub, oldtop, oldsub, E.screenrows);
+}
+
+int editorComposeFrame() {
+  /* Draws the next frame and builds, in the output buffer, the escapes that
+   * send the terminal only the cells that changed since the last one, then
+   * places the cursor. The first frame clears the screen and compares against
+   * a blank one. When the view has moved by less than a screen the terminal
+   * is told to scroll, so only the rows coming into view are drawn. The
+   * output buffer is kept between frames, so composing a frame doesn't
+   * allocate once it has grown.
+   *
+   * Returns:
+   *  number of bytes at the start of the output buffer not worth sending
+   */
+  struct abuf *ab = &E.ab;
+  abReset(ab);
+
+  editorScroll();
+  editorDrawRows();
+
+  // hide the cursor while cells are redrawn so it doesn't flicker, dropped
+  // again below if nothing but the cursor moved
+  abAppend(ab, "\x1b[?25l", 6);
+  int d = E.shadowvalid && E.coloff == E.shadowcoloff ? editorViewMoved() : 0;
+  if (!E.shadowvalid) {
+    abAppend(ab, "\x1b[2J", 4);
+    frameResize(&E.shadow, E.frame.rows, E.frame.cols);
+    E.shadowvalid = 1;
+  } else if (d != 0 && d > -E.screenrows && d < E.screenrows) {
+    // the view moved a few rows: the terminal scrolls the text area, leaving
+    // only the rows coming into view to be drawn
+    abAppend(ab, "\x1b[1;", 4);
+    abAppendInt(ab, E.screenrows);
+    abAppend(ab, "r\x1b[", 4);
+    abAppendInt(ab, d > 0 ? d : -d);
+    abAppend(ab, d > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+    frameScroll(&E.shadow, 0, E.screenrows, d);
+  }
+  frameDiff(ab, &E.shadow, &E.frame);
+  E.shadowrowoff = E.rowoff;
+  E.shadowrowsub = E.rowsub;
+  E.shadowcoloff = E.coloff;
+  int skip = ab->len == 6 ? 6 : 0;
+
+  if (E.find.active || E.gotoactive) {
+    char prompt[FIND_MAX + 64];
+    int n = E.find.active ? editorFindPrompt(prompt, sizeof(prompt))
+                          : editorGotoPrompt(prompt, sizeof(prompt));
+    int col = textWidth(prompt, n);
+    abAppendMove(ab, E.screenrows, col < E.screencols ? col : E.screencols - 1);
+  } else {
+    abAppendMove(ab, E.cursory, E.cursorx);
   }
+  abAppend(ab, "\x1b[?25h", 6);
+
+  // the frame just composed is what the terminal shows once it is sent
+  struct frame tmp = E.shadow;
+  E.shadow = E.frame;
+  E.frame = tmp;
+  return skip;
 }
 
 void editorRefreshScreen() {
-  /* Resets the screen by clearing and moving the cursor to the top, then draws
-   * the tilde rows and moves the cursor back to the top.
+  /* Composes the next frame and writes it to the terminal as a synchronized
+   * update (DEC mode 2026), so terminals that support it paint the whole
+   * frame at once instead of showing it half drawn. Others ignore the mode.
    */
-  struct abuf ab = ABUF_INIT;
+  long long start = E.lat.path ? editorNanos() : 0;
+  int skip = editorComposeFrame();
+  long long built = E.lat.path ? editorNanos() : 0;
+
+  struct iovec iov[3] = {
+      {"\x1b[?2026h", 8},
+      {E.ab.b + skip, E.ab.len - skip},
+      {"\x1b[?2026l", 8},
+  };
+  editorWritev(iov, 3);
+  if (E.lat.path)
+    latencyFrame(start, built, editorNanos());
+  E.framebytes = E.ab.len - skip + 16;
+  E.frames++;
+}
+
+void editorSetScreenSize(int rows, int cols) {
+  /* Sets the size of the screen and resizes the frame to match. The bottom
+   * row is kept for the status bar. The next frame is drawn in full.
+   *
+   * rows: number of rows on the screen
+   * cols: number of columns on the screen
+   */
+  E.screenrows = rows > 1 ? rows - 1 : 0;
+  E.screencols = cols;
+  frameResize(&E.frame, rows, cols);
+  E.shadowvalid = 0;
+}
+
+/*** event loop ***/
+
+void editorFlushEscape() {
+  /* Escape timer callback: a sequence that is still incomplete was really a
+   * lone escape press followed by other keys.
+   */
+  editorDecodeInput(1);
+}
+
+void editorSizeTimeout() {
+  /* Size timer callback: the terminal never answered the size query, so
+   * frames go on at the size they had.
+   */
+  E.sizequery = 0;
+  E.dirty = 1;
+}
+
+void editorQuerySize() {
+  /* Asks the terminal for its size the way that works without TIOCGWINSZ:
+   * the cursor is sent as far right and down as it goes, its position
+   * asked for and then put back. The answer arrives with the input, and
+   * frames wait for it a short while so none is drawn at a stale size.
+   */
+  static const char query[] = "\x1b" "7\x1b[999C\x1b[999B\x1b[6n\x1b" "8";
+  outputWrite(query, sizeof(query) - 1);
+  E.sizequery = 1;
+  editorTimerSet(TIMER_SIZE, SIZE_REPORT_MS, editorSizeTimeout);
+}
+
+void editorResize(int rows, int cols) {
+  /* Takes on a window size. Only the screen size and the frames depend on
+   * it directly; the scroll position, the column and the wrapped rows of
+   * lines are fitted to it as the next frame is drawn, which is drawn in
+   * full. A size that hasn't changed changes nothing.
+   *
+   * rows: number of rows in the window
+   * cols: number of columns in the window
+   */
+  if (rows == E.frame.rows && cols == E.frame.cols)
+    return;
+  editorSetScreenSize(rows, cols);
+  E.dirty = 1;
+}
+
+void editorHandleResize() {
+  /* Picks up a new window size after SIGWINCH. Signals that arrive before
+   * the loop gets to them make a single resize and a single frame. Where
+   * TIOCGWINSZ doesn't work the terminal is asked instead.
+   */
+  editorDrainFd(E.sigpipe[0]);
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) {
+    editorQuerySize();
+    return;
+  }
+  editorResize(rows, cols);
+}
+
+void editorHandleReport() {
+  /* Takes on the size the terminal reported in answer to a size query.
+   */
+  E.sizereport = 0;
+  editorTimerCancel(TIMER_SIZE);
+  editorResize(E.reportrows, E.reportcols);
+  // frames were held back for the answer
+  E.dirty = 1;
+}
+
+void editorHandleWake() {
+  /* Handles a wakeup from a background thread. Results are picked up by
+   * whoever draws them, so this only has to clear the notification and ask
+   * for a frame.
+   */
+  editorDrainFd(E.wakefd[0]);
+  editorSaveReap();
+  if (E.follow.toend)
+    followToEnd();
+  E.dirty = 1;
+}
+
+void editorScheduleFrame() {
+  /* Draws a frame if anything changed, unless that would go over the frame
+   * rate cap, in which case the frame timer draws it once the cap allows.
+   * While the terminal hasn't taken all of the last frame, or hasn't said
+   * how big it is when asked, no new one is drawn; the event loop calls
+   * again once it has.
+   */
+  if (!E.dirty || E.outq.len > 0 || E.sizequery)
+    return;
+  if (E.maxfps > 0) {
+    long long wait = E.lastframe + 1000 / E.maxfps - editorNow();
+    if (wait > 0) {
+      if (E.timers[TIMER_FRAME].fn == NULL)
+        editorTimerSet(TIMER_FRAME, wait, editorScheduleFrame);
+      return;
+    }
+  }
+
+  editorRefreshScreen();
+  E.dirty = 0;
+  E.lastframe = editorNow();
+}
+
+void editorEventLoop() {
+  /* Sleeps in poll() until there is input, a signal, a wakeup from a
+   * background thread or a timer due, and handles it. Input that keeps
+   * arriving (a paste, key repeat) is all handled before the next frame is
+   * drawn, so a burst of keys costs one frame instead of one per key.
+   * Output the terminal is slow to take is written as stdout drains. Nothing
+   * runs while the editor is idle.
+   */
+  E.dirty = 1;
+  editorScheduleFrame();
+  while (1) {
+    struct pollfd fds[5];
+    fds[0].fd = STDIN_FILENO;
+    fds[1].fd = E.sigpipe[0];
+    fds[2].fd = E.wakefd[0];
+    fds[0].events = fds[1].events = fds[2].events = POLLIN;
+    // poll() skips negative descriptors
+    fds[3].fd = E.outq.len > 0 ? STDOUT_FILENO : -1;
+    fds[3].events = POLLOUT;
+    fds[4].fd = E.follow.on ? E.follow.ifd : -1;
+    fds[4].events = POLLIN;
+
+    // a find searching on its own, or a followed file with more bytes
+    // waiting, only waits for input between steps; the pool wakes the loop
+    // as its jobs finish
+    int busy = (E.find.scanning && !E.find.pooled) || E.follow.behind;
+    int n = poll(fds, 5, busy ? 0 : editorTimerTimeout());
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      die("poll");
+    }
+
+    if (fds[1].revents & POLLIN)
+      editorHandleResize();
+    if (fds[2].revents & POLLIN)
+      editorHandleWake();
+    if (fds[3].revents & (POLLOUT | POLLERR | POLLHUP))
+      outputFlush();
+    if (fds[4].revents & POLLIN)
+      editorHandleFollow();
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      // the terminal went away
+      if (editorFillInput() == 0 && !(fds[0].revents & POLLIN))
+        exit(1);
+      editorDecodeInput(0);
+      if (E.inlen > 0 && !E.inpaste)
+        editorTimerSet(TIMER_ESCAPE, ESC_TIMEOUT_MS, editorFlushEscape);
+      else
+        editorTimerCancel(TIMER_ESCAPE);
+    }
+    if (E.sizereport)
+      editorHandleReport();
+    editorRunTimers();
+
+    while (E.keyqlen > 0) {
+      editorProcessKeyPress();
+      E.dirty = 1;
+    }
+    if (E.find.scanning)
+      editorFindStep();
+    if (E.follow.behind && followCheck())
+      E.dirty = 1;
+
+    // more input is already waiting: take it before drawing, as long as the
+    // screen hasn't been held back for too long
+    if (editorWaitInput(0) && editorNow() - E.lastframe < FRAME_MAX_DELAY_MS)
+      continue;
+    editorScheduleFrame();
+  }
+}
+
+/*** headless ***/
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+int headlessUnescape(const char *line, int len, char *out) {
+  /* Turns a line of a script into the input it stands for. Backslash escapes
+   * work as in C, with \e for escape; \x takes up to two hex digits, and
+   * with none is a plain x.
+   *
+   * line: the line, without its newline
+   * len: length of the line
+   * out: buffer of at least len bytes for the input
+   *
+   * Returns:
+   *  number of bytes of input
+   */
+  int i, n = 0;
+  for (i = 0; i < len; i++) {
+    if (line[i] != '\\' || i == len - 1) {
+      out[n++] = line[i];
+      continue;
+    }
+    char c = line[++i];
+    switch (c) {
+    case 'e':
+      out[n++] = '\x1b';
+      break;
+    case 'r':
+      out[n++] = '\r';
+      break;
+    case 'n':
+      out[n++] = '\n';
+      break;
+    case 't':
+      out[n++] = '\t';
+      break;
+    case 'x': {
+      int v = 0, digits = 0;
+      while (digits < 2 && i + 1 < len &&
+             isxdigit((unsigned char)line[i + 1])) {
+        unsigned char d = line[++i];
+        v = v * 16 + (isdigit(d) ? d - '0' : tolower(d) - 'a' + 10);
+        digits++;
+      }
+      // without hex digits the x stands for itself, as other letters do
+      out[n++] = digits > 0 ? v : 'x';
+    } break;
+    default:
+      out[n++] = c;
+      break;
+    }
+  }
+  return n;
+}
+
+void headlessReport() {
+  /* Prints what the virtual terminal shows at the end of a headless run and
+   * totals for its frames.
+   */
+  struct headlessStats *hs = &E.hstats;
+  printf("--- screen %dx%d, cursor %d,%d%s\n", E.vt.screen.rows,
+         E.vt.screen.cols, E.vt.cy + 1, E.vt.cx + 1,
+         E.vt.cursor ? "" : " (hidden)");
+  vtDump(&E.vt, stdout);
+  printf("---\n");
+  if (hs->frames == 0)
+    return;
+  printf("frames %lu, bytes %zu (%.1f/frame), unknown sequences %lu\n",
+         hs->frames, hs->bytes, (double)hs->bytes / hs->frames,
+         E.vt.unknown);
+  printf("latency min %lld us, avg %.1f us, max %lld us\n", hs->latmin,
+         (double)hs->latsum / hs->frames, hs->latmax);
+}
+
+void headlessFrame(const char *input, int len) {
+  /* Feeds a burst of input through the decoder and the editor, then draws a
+   * frame into the virtual terminal and reports on it.
+   *
+   * input: the bytes of input
+   * len: number of bytes
+   */
+  struct headlessStats *hs = &E.hstats;
+  long long start = editorNanos();
+  int keys = 0;
+  int pos = 0;
+  while (pos < len || E.keyqlen > 0) {
+    int n = INBUF_SIZE - E.inlen;
+    if (n > len - pos)
+      n = len - pos;
+    memcpy(E.inbuf + E.inlen, input + pos, n);
+    E.inlen += n;
+    pos += n;
+    // the end of the burst stands in for the escape timeout running out
+    editorDecodeInput(pos == len || n == 0);
+    while (E.keyqlen > 0) {
+      editorProcessKeyPress();
+      keys++;
+    }
+  }
+  // finish any find and save so the frame shows their result, and write
+  // the journal as its timer would have
+  editorFindFinish();
+  editorSaveFinish();
+  journalSync();
+  while (E.follow.on && followCheck() && E.follow.behind)
+    ;
+
+  size_t before = E.vt.bytes;
+  editorRefreshScreen();
+  size_t bytes = E.vt.bytes - before;
+  long long us = (editorNanos() - start) / 1000;
+
+  hs->frames++;
+  hs->bytes += bytes;
+  hs->latsum += us;
+  if (hs->frames == 1 || us < hs->latmin)
+    hs->latmin = us;
+  if (us > hs->latmax)
+    hs->latmax = us;
+  printf("frame %lu: %d keys, %zu bytes, %lld us\n", hs->frames, keys, bytes,
+         us);
+}
+
+void headlessRun(const char *script) {
+  /* Runs the editor without a terminal. Every line of the script is a burst
+   * of input, handled like keys arriving together and followed by one frame;
+   * lines starting with # are comments. Output goes to the virtual terminal,
+   * whose screen is printed with the totals when the editor exits.
+   *
+   * script: path of the script
+   */
+  FILE *fp = fopen(script, "r");
+  if (fp == NULL)
+    die("fopen");
+  atexit(headlessReport);
+
+  headlessFrame("", 0);
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) != -1) {
+    if (len > 0 && line[len - 1] == '\n')
+      len--;
+    if (len > 0 && line[0] == '#')
+      continue;
+    char *input = malloc(len + 1);
+    if (input == NULL)
+      die("malloc");
+    headlessFrame(input, headlessUnescape(line, len, input));
+    free(input);
+  }
+  free(line);
+  fclose(fp);
+  exit(0);
+}
+
+/*** bench ***/
+
+#ifdef TXT_BENCH
+
+// size of the screen the benchmarks draw into
+#define BENCH_ROWS 50
+#define BENCH_COLS 200
+
+// how many times each operation is repeated
+#define BENCH_FRAMES 2000
+#define BENCH_EDITS 20000
+#define BENCH_LOOKUPS 100000
 
-  editorDrawRows(&ab);
+// length of the line the horizontal scrolling benchmark scrolls along
+#define BENCH_LONG_LINE 100000
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, E.cx + 1);
-  abAppend(&ab, buf, strlen(buf));
+uint64_t benchSeed = 88172645463325252ull;
 
-  abAppend(&ab, "\x1b[?25h", 6);
+size_t benchRandom(size_t n) {
+  /* Returns:
+   *  a pseudo-random number below n, the same sequence on every run
+   */
+  benchSeed ^= benchSeed << 13;
+  benchSeed ^= benchSeed >> 7;
+  benchSeed ^= benchSeed << 17;
+  return benchSeed % n;
+}
+
+void benchReport(const char *name, const char *what, long long ns,
+                 long ops, unsigned long allocs, long long bytes) {
+  /* Prints one line of results.
+   *
+   * name: what was measured
+   * what: the document it was measured on, or "-"
+   * ns: total time taken
+   * ops: number of operations in that time
+   * allocs: heap allocations made in that time
+   * bytes: bytes of output produced in that time, or -1 if there is none
+   */
+  printf("%-16s %-12s %14.1f ns/op %10.3f allocs/op", name, what,
+         (double)ns / ops, (double)allocs / ops);
+  if (bytes >= 0)
+    printf(" %10.1f bytes/op", (double)bytes / ops);
+  printf("\n");
+  fflush(stdout);
+}
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+void benchAppend() {
+  /* Measures appending short strings to an output buffer that is reset
+   * after every frame's worth of them, the way frames are composed.
+   */
+  struct abuf ab = ABUF_INIT;
+  int frames = 20000;
+  int per = 1000;
+  unsigned long allocs = benchAllocs;
+  long long t = editorNanos();
+  int i, j;
+  for (i = 0; i < frames; i++) {
+    abReset(&ab);
+    for (j = 0; j < per; j++)
+      abAppend(&ab, "\x1b[1;1Hab", 8);
+  }
+  t = editorNanos() - t;
+  benchReport("abAppend", "-", t, (long)frames * per, benchAllocs - allocs,
+              -1);
   abFree(&ab);
 }
 
+void benchDecoder() {
+  /* Measures decoding a mix of plain, UTF-8 and escape sequence keys.
+   */
+  static const char keys[] = "typing some text "
+                             "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"
+                             "\x1b[A\x1b[B\x1b[1;5C\x1b[3~\x1bOH\x1b[6~\r\x7f";
+  int keylen = sizeof(keys) - 1;
+  int fill = INBUF_SIZE / keylen * keylen;
+  int rounds = 20000;
+  long nkeys = 0;
+  unsigned long allocs = benchAllocs;
+  long long t = editorNanos();
+  int i;
+  for (i = 0; i < rounds; i++) {
+    int pos;
+    for (pos = 0; pos < fill; pos += keylen)
+      memcpy(E.inbuf + pos, keys, keylen);
+    E.inlen = fill;
+    while (E.inlen > 0) {
+      editorDecodeInput(0);
+      nkeys += E.keyqlen;
+      E.keyqhead = 0;
+      E.keyqlen = 0;
+    }
+  }
+  t = editorNanos() - t;
+  benchReport("decode", "-", t, nkeys, benchAllocs - allocs, -1);
+}
+
+long benchGenerate(int fd, size_t size) {
+  /* Writes a synthetic file of lines of random printable text and random
+   * lengths up to a little over half the screen width.
+   *
+   * fd: file to write to
+   * size: number of bytes to write
+   *
+   * Returns:
+   *  number of lines in the file
+   */
+  size_t blocklen = 1 << 20;
+  char *block = malloc(blocklen);
+  if (block == NULL)
+    die("malloc");
+  size_t i;
+  size_t linelen = 0;
+  size_t linemax = benchRandom(120);
+  for (i = 0; i < blocklen; i++) {
+    if (linelen == linemax) {
+      block[i] = '\n';
+      linelen = 0;
+      linemax = benchRandom(120);
+    } else {
+      block[i] = benchRandom(8) == 0 ? ' ' : 'a' + benchRandom(26);
+      linelen++;
+    }
+  }
+
+  long lines = 1;
+  size_t done = 0;
+  while (done < size) {
+    size_t n = size - done < blocklen ? size - done : blocklen;
+    if (write(fd, block, n) != (ssize_t)n)
+      die("write");
+    lines += countNewlines(block, n);
+    done += n;
+  }
+  free(block);
+  return lines;
+}
+
+void benchFrames(const char *what, long lines) {
+  /* Measures composing frames of the open document: redrawn in full, with
+   * nothing changed, with a character typed and deleted before each, after
+   * jumping to a random line, scrolling down a line at a time, going to a
+   * random byte offset, paging down, scrolling along a very long line, and
+   * paging down through wrapped lines.
+   *
+   * what: name of the document for the report
+   * lines: number of lines in the document
+   */
+  unsigned long allocs = benchAllocs;
+  long long bytes = 0;
+  long long t = editorNanos();
+  int i;
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    E.shadowvalid = 0;
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame full", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++)
+    bytes += E.ab.len - editorComposeFrame();
+  t = editorNanos() - t;
+  benchReport("frame idle", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    if (i % 2 == 0)
+      editorInsertChar('x');
+    else
+      editorDelChar();
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame typing", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    E.cy = benchRandom(lines);
+    E.cx = 0;
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame jump", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  E.cy = 0;
+  editorComposeFrame();
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    E.cy = E.screenrows + i;
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame scroll", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    char q[GOTO_MAX];
+    snprintf(q, sizeof(q), "@%zu", benchRandom(docLength()));
+    editorGoto(q);
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame goto", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  E.cy = 0;
+  E.rowoff = 0;
+  editorComposeFrame();
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    editorPage(1);
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame page", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  // a line of BENCH_LONG_LINE bytes at the top, scrolled through
+  char *line = malloc(BENCH_LONG_LINE);
+  if (line == NULL)
+    die("malloc");
+  for (i = 0; i < BENCH_LONG_LINE - 1; i++)
+    line[i] = benchRandom(8) == 0 ? ' ' : 'a' + benchRandom(26);
+  line[BENCH_LONG_LINE - 1] = '\n';
+  docInsert(0, line, BENCH_LONG_LINE);
+  free(line);
+  E.cy = 0;
+  E.cx = 0;
+  editorComposeFrame();
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    E.cx = (long)i * (BENCH_LONG_LINE - 1) / BENCH_FRAMES;
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame hscroll", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+
+  // lines wrapped, paged down a screen at a time from the long line on
+  E.softwrap = 1;
+  E.cx = 0;
+  editorComposeFrame();
+  allocs = benchAllocs;
+  bytes = 0;
+  t = editorNanos();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    editorPage(1);
+    bytes += E.ab.len - editorComposeFrame();
+  }
+  t = editorNanos() - t;
+  benchReport("frame wrap page", what, t, BENCH_FRAMES, benchAllocs - allocs,
+              bytes);
+  E.softwrap = 0;
+  docDelete(0, BENCH_LONG_LINE);
+  E.cy = 0;
+  E.cx = 0;
+}
+
+void benchFind(const char *name, const char *what, const char *query,
+               int regex) {
+  /* Measures a find through the whole document.
+   *
+   * name: what is being searched for, for the report
+   * what: name of the document for the report
+   * query: the query
+   * regex: the query is a regular expression
+   */
+  struct findState *f = &E.find;
+  f->active = 1;
+  f->regex = regex;
+  f->querylen = strlen(query);
+  memcpy(f->query, query, f->querylen);
+  f->origcx = 0;
+  f->origcy = 0;
+
+  unsigned long allocs = benchAllocs;
+  long long t = editorNanos();
+  editorFindRestart();
+  editorFindFinish();
+  t = editorNanos() - t;
+  size_t mib = docLength() >> 20;
+  // one operation is one mebibyte searched
+  benchReport(name, what, t, mib ? mib : 1, benchAllocs - allocs, -1);
+  editorFindEnd(0);
+}
+
+void benchDocument(size_t size, int pieces) {
+  /* Measures opening, indexing, line lookups, finds, drawing, random edits,
+   * typing and undoing it, and saving on a synthetic file of the given size.
+   *
+   * size: size of the file in bytes
+   * pieces: keep the file in the piece table even if it is small enough for
+   *         rows
+   */
+  const char *tmpdir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/txt-bench-XXXXXX",
+           tmpdir ? tmpdir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd == -1)
+    die("mkstemp");
+  long lines = benchGenerate(fd, size);
+  close(fd);
+
+  E.forcepieces = pieces;
+  unsigned long allocs = benchAllocs;
+  long long t = editorNanos();
+  editorOpen(path);
+  t = editorNanos() - t;
+  unlink(path);
+
+  char what[32];
+  snprintf(what, sizeof(what), "%zuM/%s", size >> 20,
+           E.dockind == DOC_ROWS ? "rows" : "pieces");
+  benchReport("open", what, t, 1, benchAllocs - allocs, -1);
+
+  if (E.dockind == DOC_PIECES) {
+    allocs = benchAllocs;
+    t = editorNanos();
+    lineIndexEnsure(&E.index, E.origlen);
+    t = editorNanos() - t;
+    // one operation is one mebibyte indexed
+    benchReport("index/MiB", what, t, size >> 20 ? size >> 20 : 1,
+                benchAllocs - allocs, -1);
+  }
+
+  size_t off;
+  allocs = benchAllocs;
+  t = editorNanos();
+  int i;
+  for (i = 0; i < BENCH_LOOKUPS; i++)
+    docLineStart(benchRandom(lines), &off);
+  t = editorNanos() - t;
+  benchReport("line lookup", what, t, BENCH_LOOKUPS, benchAllocs - allocs,
+              -1);
+
+  benchFind("find short/MiB", what, "qzxj", 0);
+  if (E.dockind == DOC_PIECES) {
+    // the same search without the worker pool
+    int threads = E.findpool.max;
+    E.findpool.max = 1;
+    benchFind("find serial/MiB", what, "qzxj", 0);
+    E.findpool.max = threads;
+  }
+  benchFind("find long/MiB", what, "abcdefghijklmnopqrstuvwxyzabcdefgh", 0);
+  // the piece table searches an expression on the worker pool
+  if (size <= ROWS_MAX_FILE || E.dockind == DOC_PIECES)
+    benchFind("find regex/MiB", what, "[0-9]+", 1);
+  if (E.dockind == DOC_PIECES) {
+    int threads = E.findpool.max;
+    E.findpool.max = 1;
+    benchFind("regex serial/MiB", what, "[0-9]+", 1);
+    E.findpool.max = threads;
+  }
+
+  benchFrames(what, lines);
+  // again with the text highlighted as C
+  char hlwhat[40];
+  snprintf(hlwhat, sizeof(hlwhat), "%s/c", what);
+  syntaxSelect("bench.c");
+  benchFrames(hlwhat, lines);
+  syntaxSelect(NULL);
+
+  allocs = benchAllocs;
+  t = editorNanos();
+  for (i = 0; i < BENCH_EDITS; i++)
+    docInsert(benchRandom(docLength() + 1), "abc", 3);
+  t = editorNanos() - t;
+  benchReport("insert", what, t, BENCH_EDITS, benchAllocs - allocs, -1);
+
+  allocs = benchAllocs;
+  t = editorNanos();
+  for (i = 0; i < BENCH_EDITS; i++)
+    docDelete(benchRandom(docLength() - 3), 3);
+  t = editorNanos() - t;
+  benchReport("delete", what, t, BENCH_EDITS, benchAllocs - allocs, -1);
+
+  // a run of typing goes into one undo record, taken back in one edit
+  E.cy = lines / 2;
+  E.cx = 0;
+  allocs = benchAllocs;
+  t = editorNanos();
+  for (i = 0; i < BENCH_EDITS; i++)
+    editorInsertChar('a' + i % 26);
+  t = editorNanos() - t;
+  benchReport("type", what, t, BENCH_EDITS, benchAllocs - allocs, -1);
+
+  allocs = benchAllocs;
+  t = editorNanos();
+  editorUndo();
+  t = editorNanos() - t;
+  benchReport("undo typing", what, t, 1, benchAllocs - allocs, -1);
+
+  // the edited document written back over the file's old name, leaving
+  // flushing to the kernel so the disk doesn't dominate
+  E.save.sync = SYNC_NONE;
+  allocs = benchAllocs;
+  t = editorNanos();
+  editorSave();
+  editorSaveFinish();
+  t = editorNanos() - t;
+  if (E.save.failed != NULL)
+    fprintf(stderr, "%s\n", E.statusmsg);
+  unlink(path);
+  benchReport("save/MiB", what, t, size >> 20 ? size >> 20 : 1,
+              benchAllocs - allocs, -1);
+
+  editorCloseFile();
+}
+
+int benchMain(int argc, char *argv[]) {
+  /* Runs the benchmarks headless on a fixed size screen and prints the
+   * results. Documents go up to the size given in mebibytes on the command
+   * line, 1024 by default.
+   */
+  size_t maxmb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+  E.indexthread = 0;
+  E.journal.enabled = 0;
+  editorSetScreenSize(BENCH_ROWS, BENCH_COLS);
+
+  benchAppend();
+  benchDecoder();
+
+  static const size_t sizes[] = {1, 16, 256, 1024};
+  size_t i;
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= maxmb; i++) {
+    size_t size = sizes[i] << 20;
+    if (size <= ROWS_MAX_FILE)
+      benchDocument(size, 0);
+    benchDocument(size, 1);
+  }
+  return 0;
+}
+
+#endif
+
 /*** init ***/
 
 void initEditor() {
-  /* Initializes the editor by getting the size of the terminal window and
-   * storing it in the editorConfig struct.
+  /* Initializes the editor with an empty document and no screen. The screen
+   * size is set separately, from the terminal or by the benchmarks.
    */
   E.cx = 0;
   E.cy = 0;
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
-    die("getWindowSize");
-  }
+  E.rx = 0;
+  E.rowoff = 0;
+  E.rowsub = 0;
+  E.coloff = 0;
+  E.cursory = 0;
+  E.cursorx = 0;
+  E.filename = NULL;
+  E.fd = -1;
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origmapped = 0;
+  E.origrandom = 0;
+  E.indexthread = 1;
+  E.dockind = DOC_ROWS;
+  E.forcepieces = 0;
+  rowsInit(&E.rows);
+  lineIndexInit(&E.index, NULL, 0);
+  ptInit(&E.pt, NULL, 0, &E.index);
+  memset(&E.cols, 0, sizeof(E.cols));
+  colCacheClear(&E.cols);
+  E.softwrap = 0;
+  memset(&E.wrap, 0, sizeof(E.wrap));
+  E.frame.cells = NULL;
+  E.shadow.cells = NULL;
+  E.shadowvalid = 0;
+  E.debug = 0;
+  E.ab.b = NULL;
+  E.ab.len = 0;
+  E.ab.cap = 0;
+  E.framebytes = 0;
+  E.frames = 0;
+  E.dirty = 1;
+  E.maxfps = 0;
+  E.lastframe = 0;
+  E.screenrows = 0;
+  E.screencols = 0;
+  E.headless = 0;
+  findPoolInit(&E.findpool);
+  syntaxInit(&E.hlworker);
+  E.syntax = NULL;
+  saveInit(&E.save);
+  E.statusmsg[0] = '\0';
+  E.gotoactive = 0;
+  E.gotolen = 0;
+  E.sizequery = 0;
+  E.sizereport = 0;
+  undoInit(&E.undo);
+  journalInit(&E.journal);
+  E.follow.on = 0;
+  E.follow.size = 0;
+  E.follow.ifd = -1;
+  E.follow.wfile = -1;
+  E.follow.wdir = -1;
+  E.follow.behind = 0;
+  E.follow.toend = 0;
+  E.follow.buf.b = NULL;
+  E.follow.buf.len = 0;
+  E.follow.buf.cap = 0;
 }
 
-int main() {
-  enableRawMode();
+int main(int argc, char *argv[]) {
   initEditor();
+#ifdef TXT_BENCH
+  return benchMain(argc, argv);
+#endif
 
-  // continuously read from stdin
-  while (1) {
-    editorRefreshScreen();
-    editorProcessKeyPress();
+  // geometry of the virtual terminal in a headless run
+  int rows = DEFAULT_ROWS, cols = DEFAULT_COLS;
+  char *script = NULL;
+  int follow = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "dfF:g:H:JL:npS:U:w")) != -1) {
+    switch (opt) {
+    case 'd':
+      E.debug = 1;
+      break;
+    case 'f':
+      // the file is followed from the start, with nothing to journal
+      follow = 1;
+      E.journal.enabled = 0;
+      break;
+    case 'F':
+      E.maxfps = atoi(optarg);
+      break;
+    case 'g':
+      if (sscanf(optarg, "%dx%d", &rows, &cols) != 2 || rows < 1 || cols < 1) {
+        fprintf(stderr, "%s: bad geometry %s\n", argv[0], optarg);
+        exit(1);
+      }
+      break;
+    case 'H':
+      script = optarg;
+      E.headless = 1;
+      break;
+    case 'J':
+      E.journal.enabled = 0;
+      break;
+    case 'L':
+      E.lat.path = optarg;
+      atexit(latencyDump);
+      break;
+    case 'n':
+      E.indexthread = 0;
+      break;
+    case 'p':
+      E.forcepieces = 1;
+      break;
+    case 'S':
+      if (strcmp(optarg, "none") == 0) {
+        E.save.sync = SYNC_NONE;
+      } else if (strcmp(optarg, "file") == 0) {
+        E.save.sync = SYNC_FILE;
+      } else if (strcmp(optarg, "full") == 0) {
+        E.save.sync = SYNC_FULL;
+      } else {
+        fprintf(stderr, "%s: bad sync %s\n", argv[0], optarg);
+        exit(1);
+      }
+      break;
+    case 'U':
+      E.undo.cap = strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'w':
+      E.softwrap = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-dfJnpw] [-F fps] [-H script [-g rowsxcols]] "
+              "[-L file] [-S none|file|full] [-U mib] [file]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  // a terminal that won't tell its size is asked once in raw mode
+  int query = 0;
+  if (E.headless) {
+    vtInit(&E.vt, rows, cols);
+  } else if (getWindowSize(&rows, &cols) == -1) {
+    rows = DEFAULT_ROWS;
+    cols = DEFAULT_COLS;
+    query = 1;
+  }
+  editorSetScreenSize(rows, cols);
+
+  editorInitEvents();
+  if (!E.headless)
+    enableRawMode();
+  if (query)
+    editorQuerySize();
+  if (optind < argc) {
+    editorOpen(argv[optind]);
+    if (follow)
+      editorFollowToggle();
   }
 
+  if (E.headless)
+    headlessRun(script);
+  editorEventLoop();
+
   return 0;
 }
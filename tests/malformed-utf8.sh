@@ -0,0 +1,16 @@
+#!/bin/sh
+# Malformed UTF-8 input is inserted as U+FFFD, one for each maximal run of
+# bytes that could start a character, and never decodes to a special key.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+here=$(dirname "$0")
+: > "$dir/f.txt"
+./editor -J -H "$here/malformed-utf8.txt" -g 5x60 "$dir/f.txt" > "$dir/out"
+want=$(printf 'ab\357\277\275\357\277\275\357\277\275\357\277\275\357\277\275\357\277\275\357\277\275\357\277\275\357\277\275Xc')
+if [ "$(sed -n '/^--- screen/{n;p;}' "$dir/out")" != "$want" ]; then
+  cat "$dir/out"
+  echo "malformed-utf8: FAIL"
+  exit 1
+fi
+echo "malformed-utf8: ok"
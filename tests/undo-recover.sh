@@ -0,0 +1,18 @@
+#!/bin/sh
+# Undoing edits and then recovering them from the journal gives back the
+# document as it was after the undo.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+here=$(dirname "$0")
+printf 'hello\n' > "$dir/f.txt"
+./editor -H "$here/undo-recover-1.txt" -g 5x120 "$dir/f.txt" > /dev/null
+test -f "$dir/.f.txt.txtj"
+./editor -H "$here/undo-recover-2.txt" -g 5x120 "$dir/f.txt" > "$dir/out"
+if ! grep -q recovered "$dir/out" ||
+    ! sed -n '/^--- screen/{n;p;}' "$dir/out" | grep -qx hello; then
+  cat "$dir/out"
+  echo "undo-recover: FAIL"
+  exit 1
+fi
+echo "undo-recover: ok"